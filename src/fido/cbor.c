@@ -15,6 +15,8 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define CBOR_FILE_ID 1
+
 #include "pico_keys.h"
 #if !defined(ENABLE_EMULATION) && !defined(ESP_PLATFORM)
 #include "pico/stdlib.h"
@@ -26,6 +28,7 @@
 #include "apdu.h"
 #include "management.h"
 #include "ctap2_cbor.h"
+#include "cbor_arena.h"
 #include "version.h"
 
 const bool _btrue = true, _bfalse = false;
@@ -34,7 +37,7 @@ int cbor_reset();
 int cbor_get_info();
 int cbor_make_credential(const uint8_t *data, size_t len);
 int cbor_client_pin(const uint8_t *data, size_t len);
-int cbor_get_assertion(const uint8_t *data, size_t len, bool next);
+int cbor_get_assertion(const uint8_t *data, size_t len);
 int cbor_get_next_assertion(const uint8_t *data, size_t len);
 int cbor_selection();
 int cbor_cred_mgmt(const uint8_t *data, size_t len);
@@ -50,15 +53,30 @@ const uint8_t *cbor_data = NULL;
 size_t cbor_len = 0;
 uint8_t cbor_cmd = 0;
 
-int cbor_parse(uint8_t cmd, const uint8_t *data, size_t len) {
+uint8_t *cbor_resp = NULL;
+size_t cbor_resp_max = 0;
+
+cbor_error_event_t cbor_error_ring[CBOR_ERROR_RING_SIZE];
+uint32_t cbor_error_count = 0;
+uint8_t cbor_error_handler = 0;
+
+void cbor_resp_set(uint8_t *buf, size_t max) {
+    buf[-1] = 0;
+    cbor_resp = buf;
+    cbor_resp_max = max;
+}
+
+static int cbor_dispatch(uint8_t cmd, const uint8_t *data, size_t len) {
     if (len == 0 && cmd == CTAPHID_CBOR) {
         return CTAP1_ERR_INVALID_LEN;
     }
     if (len > 0) {
         DEBUG_DATA(data + 1, len - 1);
     }
+    cbor_error_handler = cmd == CTAPHID_CBOR && len > 0 ? data[0] : cmd;
     if (cap_supported(CAP_FIDO2)) {
         if (cmd == CTAPHID_CBOR) {
+            pinUvAuthTokenUsageTimerObserver();
             if (data[0] == CTAP_MAKE_CREDENTIAL) {
                 return cbor_make_credential(data + 1, len - 1);
             }
@@ -72,7 +90,7 @@ int cbor_parse(uint8_t cmd, const uint8_t *data, size_t len) {
                 return cbor_client_pin(data + 1, len - 1);
             }
             else if (data[0] == CTAP_GET_ASSERTION) {
-                return cbor_get_assertion(data + 1, len - 1, false);
+                return cbor_get_assertion(data + 1, len - 1);
             }
             else if (data[0] == CTAP_GET_NEXT_ASSERTION) {
                 return cbor_get_next_assertion(data + 1, len - 1);
@@ -104,11 +122,27 @@ int cbor_parse(uint8_t cmd, const uint8_t *data, size_t len) {
     return CTAP1_ERR_INVALID_CMD;
 }
 
+// Shared by the CTAPHID and CCID transports. Handler scratch is released here, once the
+// response has been encoded into cbor_resp.
+int cbor_parse(uint8_t cmd, const uint8_t *data, size_t len) {
+    int ret = cbor_dispatch(cmd, data, len);
+    cbor_arena_reset();
+    if (ret == CborErrorOutOfMemory) { // Response did not fit in cbor_resp_max
+        return CTAP1_ERR_OTHER;
+    }
+    return ret;
+}
+
 void cbor_thread(void) {
     card_init_core1();
     while (1) {
         uint32_t m;
-        queue_remove_blocking(&usb_to_card_q, &m);
+        while (!queue_try_remove(&usb_to_card_q, &m)) {
+            if (fill_key_agreement_pool() == false) {
+                queue_remove_blocking(&usb_to_card_q, &m);
+                break;
+            }
+        }
         uint32_t flag = m + 1;
         queue_add_blocking(&card_to_usb_q, &flag);
 
@@ -143,12 +177,42 @@ int cbor_process(uint8_t last_cmd, const uint8_t *data, size_t len) {
     cbor_data = data;
     cbor_len = len;
     cbor_cmd = last_cmd;
-    ctap_resp->init.data[0] = 0;
-    res_APDU = ctap_resp->init.data + 1;
+    cbor_resp_set(ctap_resp->init.data + 1, CTAP_MAX_CBOR_PAYLOAD);
+    res_APDU = cbor_resp;
     res_APDU_size = 0;
     return 2; // CBOR processing
 }
 
+static CborError cbor_string_slice(CborValue *it, const uint8_t **data, size_t *len) {
+    CborError error = cbor_value_get_string_length(it, len);
+    if (error != CborNoError) {
+        return error;
+    }
+    const uint8_t *p = cbor_value_get_next_byte(it);
+    uint8_t ai = *p & 0x1f;
+    *data = p + 1 + (ai < 24 ? 0 : (1 << (ai - 24)));
+    return cbor_value_advance(it);
+}
+
+CborError cbor_borrow_key(CborValue *it, const uint8_t **data, size_t *len) {
+    if (cbor_value_is_length_known(it) == false) { // Not allowed in CTAP2 canonical CBOR
+        return CborErrorUnknownLength;
+    }
+    return cbor_string_slice(it, data, len);
+}
+
+CborError cbor_borrow_string(CborValue *it, uint8_t **data, size_t *len, bool *nofree) {
+    if (cbor_value_is_length_known(it) == false) {
+        *nofree = false;
+        if (cbor_value_is_text_string(it)) {
+            return cbor_value_dup_text_string(it, (char **) data, len, it);
+        }
+        return cbor_value_dup_byte_string(it, data, len, it);
+    }
+    *nofree = true;
+    return cbor_string_slice(it, (const uint8_t **) data, len);
+}
+
 CborError COSE_key_params(int crv, int alg, mbedtls_ecp_group *grp, mbedtls_ecp_point *Q, CborEncoder *mapEncoderParent, CborEncoder *mapEncoder) {
     CborError error = CborNoError;
     int kty = 1;
@@ -0,0 +1,57 @@
+/*
+ * This file is part of the Pico FIDO distribution (https://github.com/polhenarejos/pico-fido).
+ * Copyright (c) 2022 Pol Henarejos.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include "cbor_arena.h"
+#include "mbedtls/platform_util.h"
+
+#define CBOR_ARENA_ALIGN 8
+
+static uint8_t cbor_arena[CBOR_ARENA_SIZE] __attribute__((aligned(CBOR_ARENA_ALIGN)));
+static size_t cbor_arena_used = 0, cbor_arena_hwm = 0;
+
+void *cbor_arena_alloc(size_t size) {
+    size = (size + CBOR_ARENA_ALIGN - 1) & ~(size_t)(CBOR_ARENA_ALIGN - 1);
+    if (size == 0 || size > CBOR_ARENA_SIZE - cbor_arena_used) {
+        return NULL;
+    }
+    void *p = cbor_arena + cbor_arena_used;
+    cbor_arena_used += size;
+    if (cbor_arena_used > cbor_arena_hwm) {
+        cbor_arena_hwm = cbor_arena_used;
+    }
+    return p; // Already zero, released memory is wiped
+}
+
+size_t cbor_arena_mark(void) {
+    return cbor_arena_used;
+}
+
+void cbor_arena_release(size_t mark) {
+    if (mark < cbor_arena_used) {
+        mbedtls_platform_zeroize(cbor_arena + mark, cbor_arena_used - mark);
+        cbor_arena_used = mark;
+    }
+}
+
+void cbor_arena_reset(void) {
+    cbor_arena_release(0);
+}
+
+size_t cbor_arena_high_water(void) {
+    return cbor_arena_hwm;
+}
@@ -0,0 +1,41 @@
+/*
+ * This file is part of the Pico FIDO distribution (https://github.com/polhenarejos/pico-fido).
+ * Copyright (c) 2022 Pol Henarejos.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CBOR_ARENA_H_
+#define _CBOR_ARENA_H_
+
+#include <stddef.h>
+
+#ifndef CBOR_ARENA_SIZE
+#define CBOR_ARENA_SIZE 8192
+#endif
+
+// Scratch memory for a single CTAP2 request. Allocations are zeroed and
+// are only valid until cbor_arena_reset(), called by cbor_parse() after dispatch.
+// Only the handlers' own buffers (authData, COSE keys, config and clientPIN
+// temporaries, the credential_load() working copy) come from here. Strings
+// that tinycbor duplicates into a Credential stay on the heap: they are
+// freed one by one while scanning up to MAX_RESIDENT_CREDENTIALS slots,
+// which a bump allocator cannot reclaim. The getNextAssertion state also
+// outlives the request and stays on the heap.
+extern void *cbor_arena_alloc(size_t size);
+extern size_t cbor_arena_mark(void);
+extern void cbor_arena_release(size_t mark);
+extern void cbor_arena_reset(void);
+extern size_t cbor_arena_high_water(void);
+
+#endif //_CBOR_ARENA_H_
@@ -15,6 +15,8 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define CBOR_FILE_ID 2
+
 #ifndef ESP_PLATFORM
 #include "common.h"
 #else
@@ -27,6 +29,8 @@
 #include "cbor.h"
 #include "ctap.h"
 #include "ctap2_cbor.h"
+#include "cbor_schema.h"
+#include "cbor_arena.h"
 #if !defined(ENABLE_EMULATION) && !defined(ESP_PLATFORM)
 #include "bsp/board.h"
 #endif
@@ -41,19 +45,47 @@
 
 uint32_t usage_timer = 0, initial_usage_time_limit = 0;
 uint32_t max_usage_time_period  = 600 * 1000;
+static uint32_t rolling_usage_time = 0, usage_deadline = 0;
 bool needs_power_cycle = false;
 static mbedtls_ecdh_context hkey;
 static bool hkey_init = false;
+#define KEY_AGREEMENT_POOL_SIZE 2
+static mbedtls_ecdh_context hkey_pool[KEY_AGREEMENT_POOL_SIZE];
+static uint8_t hkey_pool_len = 0;
+#ifdef ENABLE_EMULATION
+uint32_t emulation_clock_skew = 0;
+#endif
+
+static void updateUsageDeadline() {
+    if (rolling_usage_time == 0) { // Not used yet, only the initial window applies
+        usage_deadline = initial_usage_time_limit + TRANSPORT_TIME_LIMIT;
+    }
+    else {
+        usage_deadline = rolling_usage_time + TRANSPORT_TIME_LIMIT;
+        if ((int32_t)(usage_deadline - (usage_timer + max_usage_time_period)) > 0) {
+            usage_deadline = usage_timer + max_usage_time_period;
+        }
+    }
+}
 
 int beginUsingPinUvAuthToken(bool userIsPresent) {
     paut.user_present = userIsPresent;
     paut.user_verified = true;
-    initial_usage_time_limit = board_millis();
-    usage_timer = board_millis();
+    initial_usage_time_limit = fido_millis();
+    usage_timer = initial_usage_time_limit;
+    rolling_usage_time = 0;
+    updateUsageDeadline();
     paut.in_use = true;
     return 0;
 }
 
+static void renewUsageTimer() {
+    if (paut.in_use == true) {
+        rolling_usage_time = fido_millis();
+        updateUsageDeadline();
+    }
+}
+
 void clearUserPresentFlag() {
     if (paut.in_use == true) {
         paut.user_present = false;
@@ -75,6 +107,7 @@ void clearPinUvAuthTokenPermissionsExceptLbw() {
 void stopUsingPinUvAuthToken() {
     paut.permissions = 0;
     usage_timer = 0;
+    rolling_usage_time = usage_deadline = 0;
     paut.in_use = false;
     memset(paut.rp_id_hash, 0, sizeof(paut.rp_id_hash));
     paut.has_rp_id = false;
@@ -97,24 +130,53 @@ bool getUserVerifiedFlagValue() {
     return paut.user_verified;
 }
 
+static int generate_key_agreement(mbedtls_ecdh_context *ctx) {
+    mbedtls_ecdh_init(ctx);
+    mbedtls_ecdh_setup(ctx, MBEDTLS_ECP_DP_SECP256R1);
+    int ret = mbedtls_ecdh_gen_public(&ctx->ctx.mbed_ecdh.grp,
+                                      &ctx->ctx.mbed_ecdh.d,
+                                      &ctx->ctx.mbed_ecdh.Q,
+                                      random_gen,
+                                      NULL);
+    mbedtls_mpi_lset(&ctx->ctx.mbed_ecdh.Qp.Z, 1);
+    return ret;
+}
+
+// Called from cbor_thread while idle. Returns false when the pool is already full or keygen
+// failed, so the caller blocks instead of retrying in a tight loop
+bool fill_key_agreement_pool() {
+    if (hkey_pool_len >= KEY_AGREEMENT_POOL_SIZE) {
+        return false;
+    }
+    if (generate_key_agreement(&hkey_pool[hkey_pool_len]) != 0) {
+        mbedtls_ecdh_free(&hkey_pool[hkey_pool_len]);
+        mbedtls_platform_zeroize(&hkey_pool[hkey_pool_len], sizeof(hkey_pool[hkey_pool_len]));
+        return false;
+    }
+    hkey_pool_len++;
+    return true;
+}
+
+void free_key_agreement_pool() {
+    for (uint8_t i = 0; i < hkey_pool_len; i++) {
+        mbedtls_ecdh_free(&hkey_pool[i]);
+    }
+    mbedtls_platform_zeroize(hkey_pool, sizeof(hkey_pool));
+    hkey_pool_len = 0;
+}
+
 int regenerate() {
     if (hkey_init == true) {
         mbedtls_ecdh_free(&hkey);
     }
-
-    mbedtls_ecdh_init(&hkey);
     hkey_init = true;
-    mbedtls_ecdh_setup(&hkey, MBEDTLS_ECP_DP_SECP256R1);
-    int ret = mbedtls_ecdh_gen_public(&hkey.ctx.mbed_ecdh.grp,
-                                      &hkey.ctx.mbed_ecdh.d,
-                                      &hkey.ctx.mbed_ecdh.Q,
-                                      random_gen,
-                                      NULL);
-    mbedtls_mpi_lset(&hkey.ctx.mbed_ecdh.Qp.Z, 1);
-    if (ret != 0) {
-        return ret;
+    if (hkey_pool_len > 0) { // Take ownership of a spare key
+        hkey_pool_len--;
+        memcpy(&hkey, &hkey_pool[hkey_pool_len], sizeof(hkey));
+        memset(&hkey_pool[hkey_pool_len], 0, sizeof(hkey));
+        return 0;
     }
-    return 0;
+    return generate_key_agreement(&hkey);
 }
 
 int kdf(uint8_t protocol, const mbedtls_mpi *z, uint8_t *sharedSecret) {
@@ -171,15 +233,57 @@ int ecdh(uint8_t protocol, const mbedtls_ecp_point *Q, uint8_t *sharedSecret) {
     return ret;
 }
 
+// HMAC-SHA256 midstates after absorbing the token ipad/opad blocks
+static mbedtls_sha256_context paut_ictx, paut_octx;
+
+static void paut_hmac_setup() {
+    uint8_t pad[64];
+    mbedtls_sha256_free(&paut_ictx);
+    mbedtls_sha256_free(&paut_octx);
+    mbedtls_sha256_init(&paut_ictx);
+    mbedtls_sha256_init(&paut_octx);
+    memset(pad, 0x36, sizeof(pad));
+    for (size_t i = 0; i < sizeof(paut.data); i++) {
+        pad[i] ^= paut.data[i];
+    }
+    mbedtls_sha256_starts(&paut_ictx, 0);
+    mbedtls_sha256_update(&paut_ictx, pad, sizeof(pad));
+    memset(pad, 0x5c, sizeof(pad));
+    for (size_t i = 0; i < sizeof(paut.data); i++) {
+        pad[i] ^= paut.data[i];
+    }
+    mbedtls_sha256_starts(&paut_octx, 0);
+    mbedtls_sha256_update(&paut_octx, pad, sizeof(pad));
+    mbedtls_platform_zeroize(pad, sizeof(pad));
+}
+
+static int paut_hmac(const uint8_t *data, uint16_t len, uint8_t *hmac) {
+    mbedtls_sha256_context ctx;
+    mbedtls_sha256_init(&ctx);
+    mbedtls_sha256_clone(&ctx, &paut_ictx);
+    int ret = mbedtls_sha256_update(&ctx, data, len);
+    if (ret == 0) {
+        ret = mbedtls_sha256_finish(&ctx, hmac);
+    }
+    if (ret == 0) {
+        mbedtls_sha256_clone(&ctx, &paut_octx);
+        ret = mbedtls_sha256_update(&ctx, hmac, 32);
+    }
+    if (ret == 0) {
+        ret = mbedtls_sha256_finish(&ctx, hmac);
+    }
+    mbedtls_sha256_free(&ctx);
+    return ret;
+}
+
 int resetPinUvAuthToken() {
-    uint8_t t[32];
-    random_gen(NULL, t, sizeof(t));
-    file_put_data(ef_authtoken, t, sizeof(t));
+    mbedtls_platform_zeroize(paut.data, sizeof(paut.data));
+    random_gen(NULL, paut.data, sizeof(paut.data));
+    paut.len = sizeof(paut.data);
     paut.permissions = 0;
-    paut.data = file_get_data(ef_authtoken);
-    paut.len = file_get_size(ef_authtoken);
-
-    low_flash_available();
+    paut.user_present = false;
+    user_present_time_limit = 0;
+    paut_hmac_setup();
     return 0;
 }
 
@@ -237,17 +341,29 @@ int verify(uint8_t protocol, const uint8_t *key, const uint8_t *data, uint16_t l
     uint8_t hmac[32];
     //if (paut.in_use == false)
     //    return -2;
-    int ret = mbedtls_md_hmac(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), key, 32, data, len, hmac);
+    int ret = 0;
+    if (key == paut.data) {
+        ret = paut_hmac(data, len, hmac);
+    }
+    else {
+        ret = mbedtls_md_hmac(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), key, 32, data, len, hmac);
+    }
     if (ret != 0) {
         return ret;
     }
     if (protocol == 1) {
-        return memcmp(sign, hmac, 16);
+        ret = memcmp(sign, hmac, 16);
     }
     else if (protocol == 2) {
-        return memcmp(sign, hmac, 32);
+        ret = memcmp(sign, hmac, 32);
     }
-    return -1;
+    else {
+        return -1;
+    }
+    if (ret == 0 && key == paut.data) {
+        renewUsageTimer();
+    }
+    return ret;
 }
 
 int initialize() {
@@ -263,19 +379,14 @@ int pinUvAuthTokenUsageTimerObserver() {
     if (usage_timer == 0) {
         return -1;
     }
-    if (usage_timer + max_usage_time_period > board_millis()) {
-        if (user_present_time_limit == 0 ||
-            user_present_time_limit + TRANSPORT_TIME_LIMIT < board_millis()) {
-            clearUserPresentFlag();
-        }
-        if (paut.in_use == true) {
-            if (initial_usage_time_limit == 0 ||
-                initial_usage_time_limit + TRANSPORT_TIME_LIMIT < board_millis()) {
-                stopUsingPinUvAuthToken();
-                return 1;
-            }
-        }
-        // TO DO: implement a rolling timer
+    uint32_t now = fido_millis();
+    if ((int32_t)(now - (usage_timer + TRANSPORT_TIME_LIMIT)) > 0) {
+        clearUserPresentFlag();
+    }
+    if (paut.in_use == true && (int32_t)(now - usage_deadline) > 0) {
+        stopUsingPinUvAuthToken();
+        resetPinUvAuthToken();
+        return 1;
     }
     return 0;
 }
@@ -297,65 +408,49 @@ int check_mkek_encrypted(const uint8_t *dhash) {
 
 uint8_t new_pin_mismatches = 0;
 
+typedef struct ClientPinRequest {
+    uint64_t pinUvAuthProtocol;
+    uint64_t subcommand;
+    CborSchemaValue keyAgreement;
+    CborByteString pinUvAuthParam;
+    CborByteString newPinEnc;
+    CborByteString pinHashEnc;
+    uint64_t permissions;
+    CborCharString rpId;
+} ClientPinRequest;
+
+static const cbor_schema_field_t client_pin_schema[] = {
+    CBOR_SCHEMA_FIELD(0x01, UINT, true, ClientPinRequest, pinUvAuthProtocol),
+    CBOR_SCHEMA_FIELD(0x02, UINT, true, ClientPinRequest, subcommand),
+    CBOR_SCHEMA_FIELD(0x03, MAP, false, ClientPinRequest, keyAgreement),
+    CBOR_SCHEMA_FIELD(0x04, BYTES, false, ClientPinRequest, pinUvAuthParam),
+    CBOR_SCHEMA_FIELD(0x05, BYTES, false, ClientPinRequest, newPinEnc),
+    CBOR_SCHEMA_FIELD(0x06, BYTES, false, ClientPinRequest, pinHashEnc),
+    CBOR_SCHEMA_FIELD(0x09, UINT, false, ClientPinRequest, permissions),
+    CBOR_SCHEMA_FIELD(0x0A, TEXT, false, ClientPinRequest, rpId),
+};
+
 int cbor_client_pin(const uint8_t *data, size_t len) {
     size_t resp_size = 0;
-    uint64_t subcommand = 0x0, pinUvAuthProtocol = 0, permissions = 0;
     int64_t kty = 0, alg = 0, crv = 0;
     CborParser parser;
     CborEncoder encoder, mapEncoder;
-    CborValue map;
     CborError error = CborNoError;
-    CborByteString pinUvAuthParam = { 0 }, newPinEnc = { 0 }, pinHashEnc = { 0 }, kax = { 0 },
-                   kay = { 0 };
-    CborCharString rpId = { 0 };
-    CBOR_CHECK(cbor_parser_init(data, len, 0, &parser, &map));
-    uint64_t val_c = 1;
+    CborByteString kax = { 0 }, kay = { 0 };
+    ClientPinRequest req = { 0 };
     if (hkey_init == false) {
         initialize();
     }
-    CBOR_PARSE_MAP_START(map, 1)
-    {
-        uint64_t val_u = 0;
-        CBOR_FIELD_GET_UINT(val_u, 1);
-        if (val_c <= 2 && val_c != val_u) {
-            CBOR_ERROR(CTAP2_ERR_MISSING_PARAMETER);
-        }
-        if (val_u < val_c) {
-            CBOR_ERROR(CTAP2_ERR_INVALID_CBOR);
-        }
-        val_c = val_u + 1;
-        if (val_u == 0x01) {
-            CBOR_FIELD_GET_UINT(pinUvAuthProtocol, 1);
-        }
-        else if (val_u == 0x02) {
-            CBOR_FIELD_GET_UINT(subcommand, 1);
-        }
-        else if (val_u == 0x03) {
-            CBOR_CHECK(COSE_read_key(&_f1, &kty, &alg, &crv, &kax, &kay));
-        }
-        else if (val_u == 0x04) {
-            CBOR_FIELD_GET_BYTES(pinUvAuthParam, 1);
-        }
-        else if (val_u == 0x05) {
-            CBOR_FIELD_GET_BYTES(newPinEnc, 1);
-        }
-        else if (val_u == 0x06) {
-            CBOR_FIELD_GET_BYTES(pinHashEnc, 1);
-        }
-        else if (val_u == 0x09) {
-            CBOR_FIELD_GET_UINT(permissions, 1);
-        }
-        else if (val_u == 0x0A) {
-            CBOR_FIELD_GET_TEXT(rpId, 1);
-        }
+    CBOR_CHECK(cbor_schema_decode(&parser, data, len, client_pin_schema, sizeof(client_pin_schema) / sizeof(cbor_schema_field_t), &req));
+    if (req.keyAgreement.present == true) {
+        CBOR_CHECK(COSE_read_key(&req.keyAgreement.value, &kty, &alg, &crv, &kax, &kay));
     }
-    CBOR_PARSE_MAP_END(map, 1);
 
-    cbor_encoder_init(&encoder, ctap_resp->init.data + 1, CTAP_MAX_CBOR_PAYLOAD, 0);
-    if (subcommand == 0x0) {
+    cbor_encoder_init(&encoder, cbor_resp, cbor_resp_max, 0);
+    if (req.subcommand == 0x0) {
         CBOR_ERROR(CTAP2_ERR_MISSING_PARAMETER);
     }
-    else if (subcommand == 0x1) { //getPINRetries
+    else if (req.subcommand == 0x1) { //getPINRetries
         CBOR_CHECK(cbor_encoder_create_map(&encoder, &mapEncoder, needs_power_cycle ? 2 : 1));
         CBOR_CHECK(cbor_encode_uint(&mapEncoder, 0x03));
         CBOR_CHECK(cbor_encode_uint(&mapEncoder, (uint64_t) *file_get_data(ef_pin)));
@@ -364,34 +459,34 @@ int cbor_client_pin(const uint8_t *data, size_t len) {
             CBOR_CHECK(cbor_encode_boolean(&mapEncoder, true));
         }
     }
-    else if (subcommand == 0x2) { //getKeyAgreement
-        if (pinUvAuthProtocol == 1 || pinUvAuthProtocol == 2) {
+    else if (req.subcommand == 0x2) { //getKeyAgreement
+        if (req.pinUvAuthProtocol == 1 || req.pinUvAuthProtocol == 2) {
             CborEncoder mapEncoder2;
             CBOR_CHECK(cbor_encoder_create_map(&encoder, &mapEncoder, 1));
             CBOR_CHECK(cbor_encode_uint(&mapEncoder, 0x01));
 
             CBOR_CHECK(COSE_key_shared(&hkey, &mapEncoder, &mapEncoder2));
         }
-        else if (pinUvAuthProtocol == 0) {
+        else if (req.pinUvAuthProtocol == 0) {
             CBOR_ERROR(CTAP2_ERR_MISSING_PARAMETER);
         }
         else {
             CBOR_ERROR(CTAP1_ERR_INVALID_PARAMETER);
         }
     }
-    else if (subcommand == 0x3) { //setPIN
-        if (kax.present == false || kay.present == false || pinUvAuthProtocol == 0 ||
-            newPinEnc.present == false || pinUvAuthParam.present == false || alg == 0) {
+    else if (req.subcommand == 0x3) { //setPIN
+        if (kax.present == false || kay.present == false || req.pinUvAuthProtocol == 0 ||
+            req.newPinEnc.present == false || req.pinUvAuthParam.present == false || alg == 0) {
             CBOR_ERROR(CTAP2_ERR_MISSING_PARAMETER);
         }
-        if (pinUvAuthProtocol != 1 && pinUvAuthProtocol != 2) {
+        if (req.pinUvAuthProtocol != 1 && req.pinUvAuthProtocol != 2) {
             CBOR_ERROR(CTAP1_ERR_INVALID_PARAMETER);
         }
         if (file_has_data(ef_pin)) {
             CBOR_ERROR(CTAP2_ERR_NOT_ALLOWED);
         }
-        if ((pinUvAuthProtocol == 1 && newPinEnc.len != 64) ||
-            (pinUvAuthProtocol == 2 && newPinEnc.len != 64 + IV_SIZE)) {
+        if ((req.pinUvAuthProtocol == 1 && req.newPinEnc.len != 64) ||
+            (req.pinUvAuthProtocol == 2 && req.newPinEnc.len != 64 + IV_SIZE)) {
             CBOR_ERROR(CTAP1_ERR_INVALID_PARAMETER);
         }
         if (mbedtls_mpi_read_binary(&hkey.ctx.mbed_ecdh.Qp.X, kax.data, kax.len) != 0) {
@@ -401,17 +496,17 @@ int cbor_client_pin(const uint8_t *data, size_t len) {
             CBOR_ERROR(CTAP1_ERR_INVALID_PARAMETER);
         }
         uint8_t sharedSecret[64];
-        int ret = ecdh((uint8_t)pinUvAuthProtocol, &hkey.ctx.mbed_ecdh.Qp, sharedSecret);
+        int ret = ecdh((uint8_t)req.pinUvAuthProtocol, &hkey.ctx.mbed_ecdh.Qp, sharedSecret);
         if (ret != 0) {
             mbedtls_platform_zeroize(sharedSecret, sizeof(sharedSecret));
             CBOR_ERROR(CTAP1_ERR_INVALID_PARAMETER);
         }
-        if (verify((uint8_t)pinUvAuthProtocol, sharedSecret, newPinEnc.data, (uint16_t)newPinEnc.len, pinUvAuthParam.data) != 0) {
+        if (verify((uint8_t)req.pinUvAuthProtocol, sharedSecret, req.newPinEnc.data, (uint16_t)req.newPinEnc.len, req.pinUvAuthParam.data) != 0) {
             mbedtls_platform_zeroize(sharedSecret, sizeof(sharedSecret));
             CBOR_ERROR(CTAP2_ERR_PIN_AUTH_INVALID);
         }
         uint8_t paddedNewPin[64];
-        ret = decrypt((uint8_t)pinUvAuthProtocol, sharedSecret, newPinEnc.data, (uint16_t)newPinEnc.len, paddedNewPin);
+        ret = decrypt((uint8_t)req.pinUvAuthProtocol, sharedSecret, req.newPinEnc.data, (uint16_t)req.newPinEnc.len, paddedNewPin);
         mbedtls_platform_zeroize(sharedSecret, sizeof(sharedSecret));
         if (ret != 0) {
             CBOR_ERROR(CTAP2_ERR_PIN_AUTH_INVALID);
@@ -438,6 +533,7 @@ int cbor_client_pin(const uint8_t *data, size_t len) {
         double_hash_pin(dhash, 16, hsh + 2);
         file_put_data(ef_pin, hsh, 2 + 32);
         low_flash_available();
+        get_info_invalidate();
 
         ret = check_mkek_encrypted(dhash);
         if (ret != PICOKEY_OK) {
@@ -447,13 +543,13 @@ int cbor_client_pin(const uint8_t *data, size_t len) {
         mbedtls_platform_zeroize(dhash, sizeof(dhash));
         goto err; //No return
     }
-    else if (subcommand == 0x4) { //changePIN
-        if (kax.present == false || kay.present == false || pinUvAuthProtocol == 0 ||
-            newPinEnc.present == false || pinUvAuthParam.present == false || alg == 0 ||
-            pinHashEnc.present == false) {
+    else if (req.subcommand == 0x4) { //changePIN
+        if (kax.present == false || kay.present == false || req.pinUvAuthProtocol == 0 ||
+            req.newPinEnc.present == false || req.pinUvAuthParam.present == false || alg == 0 ||
+            req.pinHashEnc.present == false) {
             CBOR_ERROR(CTAP2_ERR_MISSING_PARAMETER);
         }
-        if (pinUvAuthProtocol != 1 && pinUvAuthProtocol != 2) {
+        if (req.pinUvAuthProtocol != 1 && req.pinUvAuthProtocol != 2) {
             CBOR_ERROR(CTAP1_ERR_INVALID_PARAMETER);
         }
         if (!file_has_data(ef_pin)) {
@@ -462,9 +558,9 @@ int cbor_client_pin(const uint8_t *data, size_t len) {
         if (*file_get_data(ef_pin) == 0) {
             CBOR_ERROR(CTAP2_ERR_PIN_BLOCKED);
         }
-        if ((pinUvAuthProtocol == 1 && (newPinEnc.len != 64 || pinHashEnc.len != 16)) ||
-            (pinUvAuthProtocol == 2 &&
-             (newPinEnc.len != 64 + IV_SIZE || pinHashEnc.len != 16 + IV_SIZE))) {
+        if ((req.pinUvAuthProtocol == 1 && (req.newPinEnc.len != 64 || req.pinHashEnc.len != 16)) ||
+            (req.pinUvAuthProtocol == 2 &&
+             (req.newPinEnc.len != 64 + IV_SIZE || req.pinHashEnc.len != 16 + IV_SIZE))) {
             CBOR_ERROR(CTAP1_ERR_INVALID_PARAMETER);
         }
         if (mbedtls_mpi_read_binary(&hkey.ctx.mbed_ecdh.Qp.X, kax.data, kax.len) != 0) {
@@ -474,15 +570,15 @@ int cbor_client_pin(const uint8_t *data, size_t len) {
             CBOR_ERROR(CTAP1_ERR_INVALID_PARAMETER);
         }
         uint8_t sharedSecret[64];
-        int ret = ecdh((uint8_t)pinUvAuthProtocol, &hkey.ctx.mbed_ecdh.Qp, sharedSecret);
+        int ret = ecdh((uint8_t)req.pinUvAuthProtocol, &hkey.ctx.mbed_ecdh.Qp, sharedSecret);
         if (ret != 0) {
             mbedtls_platform_zeroize(sharedSecret, sizeof(sharedSecret));
             CBOR_ERROR(CTAP1_ERR_INVALID_PARAMETER);
         }
         uint8_t tmp[80 + 32];
-        memcpy(tmp, newPinEnc.data, newPinEnc.len);
-        memcpy(tmp + newPinEnc.len, pinHashEnc.data, pinHashEnc.len);
-        if (verify((uint8_t)pinUvAuthProtocol, sharedSecret, tmp, (uint16_t)(newPinEnc.len + pinHashEnc.len), pinUvAuthParam.data) != 0) {
+        memcpy(tmp, req.newPinEnc.data, req.newPinEnc.len);
+        memcpy(tmp + req.newPinEnc.len, req.pinHashEnc.data, req.pinHashEnc.len);
+        if (verify((uint8_t)req.pinUvAuthProtocol, sharedSecret, tmp, (uint16_t)(req.newPinEnc.len + req.pinHashEnc.len), req.pinUvAuthParam.data) != 0) {
             mbedtls_platform_zeroize(sharedSecret, sizeof(sharedSecret));
             CBOR_ERROR(CTAP2_ERR_PIN_AUTH_INVALID);
         }
@@ -493,7 +589,7 @@ int cbor_client_pin(const uint8_t *data, size_t len) {
         low_flash_available();
         uint8_t retries = pin_data[0];
         uint8_t paddedNewPin[64];
-        ret = decrypt((uint8_t)pinUvAuthProtocol, sharedSecret, pinHashEnc.data, (uint16_t)pinHashEnc.len, paddedNewPin);
+        ret = decrypt((uint8_t)req.pinUvAuthProtocol, sharedSecret, req.pinHashEnc.data, (uint16_t)req.pinHashEnc.len, paddedNewPin);
         if (ret != 0) {
             mbedtls_platform_zeroize(sharedSecret, sizeof(sharedSecret));
             CBOR_ERROR(CTAP2_ERR_PIN_AUTH_INVALID);
@@ -519,7 +615,7 @@ int cbor_client_pin(const uint8_t *data, size_t len) {
         file_put_data(ef_pin, pin_data, sizeof(pin_data));
         low_flash_available();
         new_pin_mismatches = 0;
-        ret = decrypt((uint8_t)pinUvAuthProtocol, sharedSecret, newPinEnc.data, (uint16_t)newPinEnc.len, paddedNewPin);
+        ret = decrypt((uint8_t)req.pinUvAuthProtocol, sharedSecret, req.newPinEnc.data, (uint16_t)req.newPinEnc.len, paddedNewPin);
         mbedtls_platform_zeroize(sharedSecret, sizeof(sharedSecret));
         if (ret != 0) {
             CBOR_ERROR(CTAP2_ERR_PIN_AUTH_INVALID);
@@ -570,32 +666,34 @@ int cbor_client_pin(const uint8_t *data, size_t len) {
         mbedtls_platform_zeroize(hsh, sizeof(hsh));
         mbedtls_platform_zeroize(dhash, sizeof(dhash));
         if (file_has_data(ef_minpin) && file_get_data(ef_minpin)[1] == 1) {
-            uint8_t *tmpf = (uint8_t *) calloc(1, file_get_size(ef_minpin));
-            memcpy(tmpf, file_get_data(ef_minpin), file_get_size(ef_minpin));
-            tmpf[1] = 0;
-            file_put_data(ef_minpin, tmpf, file_get_size(ef_minpin));
-            free(tmpf);
+            uint8_t *tmpf = (uint8_t *) cbor_arena_alloc(file_get_size(ef_minpin));
+            if (tmpf) {
+                memcpy(tmpf, file_get_data(ef_minpin), file_get_size(ef_minpin));
+                tmpf[1] = 0;
+                file_put_data(ef_minpin, tmpf, file_get_size(ef_minpin));
+                get_info_invalidate();
+            }
         }
         low_flash_available();
         resetPinUvAuthToken();
         goto err; // No return
     }
-    else if (subcommand == 0x9 || subcommand == 0x5) { //getPinUvAuthTokenUsingPinWithPermissions
-        if (kax.present == false || kay.present == false || pinUvAuthProtocol == 0 || alg == 0 ||
-            pinHashEnc.present == false) {
+    else if (req.subcommand == 0x9 || req.subcommand == 0x5) { //getPinUvAuthTokenUsingPinWithPermissions
+        if (kax.present == false || kay.present == false || req.pinUvAuthProtocol == 0 || alg == 0 ||
+            req.pinHashEnc.present == false) {
             CBOR_ERROR(CTAP2_ERR_MISSING_PARAMETER);
         }
-        if (pinUvAuthProtocol != 1 && pinUvAuthProtocol != 2) {
+        if (req.pinUvAuthProtocol != 1 && req.pinUvAuthProtocol != 2) {
             CBOR_ERROR(CTAP1_ERR_INVALID_PARAMETER);
         }
-        if (subcommand == 0x5 && (permissions != 0 || rpId.present == true)) {
+        if (req.subcommand == 0x5 && (req.permissions != 0 || req.rpId.present == true)) {
             CBOR_ERROR(CTAP1_ERR_INVALID_PARAMETER);
         }
-        if (subcommand == 0x9) {
-            if (permissions == 0) {
+        if (req.subcommand == 0x9) {
+            if (req.permissions == 0) {
                 CBOR_ERROR(CTAP1_ERR_INVALID_PARAMETER);
             }
-            if ((permissions & CTAP_PERMISSION_BE)) { // Not supported yet
+            if ((req.permissions & CTAP_PERMISSION_BE)) { // Not supported yet
                 CBOR_ERROR(CTAP2_ERR_UNAUTHORIZED_PERMISSION);
             }
 
@@ -613,7 +711,7 @@ int cbor_client_pin(const uint8_t *data, size_t len) {
             CBOR_ERROR(CTAP1_ERR_INVALID_PARAMETER);
         }
         uint8_t sharedSecret[64];
-        int ret = ecdh((uint8_t)pinUvAuthProtocol, &hkey.ctx.mbed_ecdh.Qp, sharedSecret);
+        int ret = ecdh((uint8_t)req.pinUvAuthProtocol, &hkey.ctx.mbed_ecdh.Qp, sharedSecret);
         if (ret != 0) {
             mbedtls_platform_zeroize(sharedSecret, sizeof(sharedSecret));
             CBOR_ERROR(CTAP1_ERR_INVALID_PARAMETER);
@@ -624,8 +722,8 @@ int cbor_client_pin(const uint8_t *data, size_t len) {
         file_put_data(ef_pin, pin_data, sizeof(pin_data));
         low_flash_available();
         uint8_t retries = pin_data[0];
-        uint8_t paddedNewPin[64], poff = ((uint8_t)pinUvAuthProtocol - 1) * IV_SIZE;
-        ret = decrypt((uint8_t)pinUvAuthProtocol, sharedSecret, pinHashEnc.data, (uint16_t)pinHashEnc.len, paddedNewPin);
+        uint8_t paddedNewPin[64], poff = ((uint8_t)req.pinUvAuthProtocol - 1) * IV_SIZE;
+        ret = decrypt((uint8_t)req.pinUvAuthProtocol, sharedSecret, req.pinHashEnc.data, (uint16_t)req.pinHashEnc.len, paddedNewPin);
         if (ret != 0) {
             mbedtls_platform_zeroize(sharedSecret, sizeof(sharedSecret));
             CBOR_ERROR(CTAP2_ERR_PIN_AUTH_INVALID);
@@ -666,19 +764,19 @@ int cbor_client_pin(const uint8_t *data, size_t len) {
         }
         resetPinUvAuthToken();
         beginUsingPinUvAuthToken(false);
-        if (subcommand == 0x05) {
-            permissions = CTAP_PERMISSION_MC | CTAP_PERMISSION_GA;
+        if (req.subcommand == 0x05) {
+            req.permissions = CTAP_PERMISSION_MC | CTAP_PERMISSION_GA;
         }
-        paut.permissions = (uint8_t)permissions;
-        if (rpId.present == true) {
-            mbedtls_sha256((uint8_t *) rpId.data, rpId.len, paut.rp_id_hash, 0);
+        paut.permissions = (uint8_t)req.permissions;
+        if (req.rpId.present == true) {
+            mbedtls_sha256((uint8_t *) req.rpId.data, req.rpId.len, paut.rp_id_hash, 0);
             paut.has_rp_id = true;
         }
         else {
             paut.has_rp_id = false;
         }
         uint8_t pinUvAuthToken_enc[32 + IV_SIZE];
-        encrypt((uint8_t)pinUvAuthProtocol, sharedSecret, paut.data, 32, pinUvAuthToken_enc);
+        encrypt((uint8_t)req.pinUvAuthProtocol, sharedSecret, paut.data, 32, pinUvAuthToken_enc);
         CBOR_CHECK(cbor_encoder_create_map(&encoder, &mapEncoder, 1));
         CBOR_CHECK(cbor_encode_uint(&mapEncoder, 0x02));
         CBOR_CHECK(cbor_encode_byte_string(&mapEncoder, pinUvAuthToken_enc, 32 + poff));
@@ -687,14 +785,14 @@ int cbor_client_pin(const uint8_t *data, size_t len) {
         CBOR_ERROR(CTAP2_ERR_UNSUPPORTED_OPTION);
     }
     CBOR_CHECK(cbor_encoder_close_container(&encoder, &mapEncoder));
-    resp_size = cbor_encoder_get_buffer_size(&encoder, ctap_resp->init.data + 1);
+    resp_size = cbor_encoder_get_buffer_size(&encoder, cbor_resp);
 err:
-    CBOR_FREE_BYTE_STRING(pinUvAuthParam);
-    CBOR_FREE_BYTE_STRING(newPinEnc);
-    CBOR_FREE_BYTE_STRING(pinHashEnc);
+    CBOR_FREE_BYTE_STRING(req.pinUvAuthParam);
+    CBOR_FREE_BYTE_STRING(req.newPinEnc);
+    CBOR_FREE_BYTE_STRING(req.pinHashEnc);
     CBOR_FREE_BYTE_STRING(kax);
     CBOR_FREE_BYTE_STRING(kay);
-    CBOR_FREE_BYTE_STRING(rpId);
+    CBOR_FREE_BYTE_STRING(req.rpId);
     if (error != CborNoError) {
         if (error == CborErrorImproperValue) {
             return CTAP2_ERR_CBOR_UNEXPECTED_TYPE;
@@ -15,7 +15,11 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define CBOR_FILE_ID 3
+
 #include "ctap2_cbor.h"
+#include "cbor_schema.h"
+#include "cbor_arena.h"
 #include "fido.h"
 #include "ctap.h"
 #include "hid/ctap_hid.h"
@@ -32,107 +36,116 @@
 extern uint8_t keydev_dec[32];
 extern bool has_keydev_dec;
 
+typedef struct ConfigRequest {
+    uint64_t subcommand;
+    CborSchemaValue subCommandParams;
+    uint64_t pinUvAuthProtocol;
+    CborByteString pinUvAuthParam;
+} ConfigRequest;
+
+static const cbor_schema_field_t config_schema[] = {
+    CBOR_SCHEMA_FIELD(0x01, UINT, true, ConfigRequest, subcommand),
+    CBOR_SCHEMA_FIELD(0x02, MAP, false, ConfigRequest, subCommandParams),
+    CBOR_SCHEMA_FIELD(0x03, UINT, false, ConfigRequest, pinUvAuthProtocol),
+    CBOR_SCHEMA_FIELD(0x04, BYTES, false, ConfigRequest, pinUvAuthParam),
+};
+
 int cbor_config(const uint8_t *data, size_t len) {
     CborParser parser;
-    CborValue map;
     CborError error = CborNoError;
-    uint64_t subcommand = 0, pinUvAuthProtocol = 0, vendorCommandId = 0, newMinPinLength = 0, vendorParam = 0;
-    CborByteString pinUvAuthParam = { 0 }, vendorAutCt = { 0 };
+    uint64_t vendorCommandId = 0, newMinPinLength = 0, vendorParam = 0;
+    CborByteString vendorAutCt = { 0 };
     CborCharString minPinLengthRPIDs[32] = { 0 };
     size_t resp_size = 0, raw_subpara_len = 0, minPinLengthRPIDs_len = 0;
     CborEncoder encoder;
     //CborEncoder mapEncoder;
-    uint8_t *raw_subpara = NULL;
+    const uint8_t *raw_subpara = NULL;
     const bool *forceChangePin = NULL;
+    ConfigRequest req = { 0 };
 
-    CBOR_CHECK(cbor_parser_init(data, len, 0, &parser, &map));
-    uint64_t val_c = 1;
-    CBOR_PARSE_MAP_START(map, 1)
-    {
-        uint64_t val_u = 0;
-        CBOR_FIELD_GET_UINT(val_u, 1);
-        if (val_c <= 1 && val_c != val_u) {
-            CBOR_ERROR(CTAP2_ERR_MISSING_PARAMETER);
-        }
-        if (val_u < val_c) {
-            CBOR_ERROR(CTAP2_ERR_INVALID_CBOR);
-        }
-        val_c = val_u + 1;
-        if (val_u == 0x01) {
-            CBOR_FIELD_GET_UINT(subcommand, 1);
-        }
-        else if (val_u == 0x02) {
-            uint64_t subpara = 0;
-            raw_subpara = (uint8_t *) cbor_value_get_next_byte(&_f1);
-            CBOR_PARSE_MAP_START(_f1, 2)
-            {
-                if (subcommand == 0x7f) { // Config Aut
-                    CBOR_FIELD_GET_UINT(subpara, 2);
-                    if (subpara == 0x01) {
-                        CBOR_FIELD_GET_UINT(vendorCommandId, 2);
-                    }
-                    else if (subpara == 0x02) {
-                        CBOR_FIELD_GET_BYTES(vendorAutCt, 2);
-                    }
+    CBOR_CHECK(cbor_schema_decode(&parser, data, len, config_schema, sizeof(config_schema) / sizeof(cbor_schema_field_t), &req));
+    if (req.subCommandParams.present == true) {
+        uint64_t subpara = 0;
+        CBOR_PARSE_MAP_START(req.subCommandParams.value, 2)
+        {
+            if (req.subcommand == 0x7f) { // Config Aut
+                CBOR_FIELD_GET_UINT(subpara, 2);
+                if (subpara == 0x01) {
+                    CBOR_FIELD_GET_UINT(vendorCommandId, 2);
                 }
-                else if (subcommand == 0x03) { // Extensions
-                    CBOR_FIELD_GET_UINT(subpara, 2);
-                    if (subpara == 0x01) {
-                        CBOR_FIELD_GET_UINT(newMinPinLength, 2);
-                    }
-                    else if (subpara == 0x02) {
-                        CBOR_PARSE_ARRAY_START(_f2, 3)
-                        {
-                            CBOR_FIELD_GET_TEXT(minPinLengthRPIDs[minPinLengthRPIDs_len], 3);
-                            minPinLengthRPIDs_len++;
-                            if (minPinLengthRPIDs_len >= 32) {
-                                CBOR_ERROR(CTAP2_ERR_KEY_STORE_FULL);
-                            }
+                else if (subpara == 0x02) {
+                    CBOR_FIELD_GET_BYTES(vendorAutCt, 2); // Owned, decrypted in place
+                }
+                else if (subpara == 0x03) {
+                    CBOR_FIELD_GET_UINT(vendorParam, 2);
+                }
+                else {
+                    CBOR_ADVANCE(2);
+                }
+            }
+            else if (req.subcommand == 0x03) { // Extensions
+                CBOR_FIELD_GET_UINT(subpara, 2);
+                if (subpara == 0x01) {
+                    CBOR_FIELD_GET_UINT(newMinPinLength, 2);
+                }
+                else if (subpara == 0x02) {
+                    CBOR_PARSE_ARRAY_START(_f2, 3)
+                    {
+                        CBOR_FIELD_BORROW_TEXT(minPinLengthRPIDs[minPinLengthRPIDs_len], 3);
+                        minPinLengthRPIDs_len++;
+                        if (minPinLengthRPIDs_len >= 32) {
+                            CBOR_ERROR(CTAP2_ERR_KEY_STORE_FULL);
                         }
-                        CBOR_PARSE_ARRAY_END(_f2, 3);
-                    }
-                    else if (subpara == 0x03) {
-                        CBOR_FIELD_GET_BOOL(forceChangePin, 2);
                     }
+                    CBOR_PARSE_ARRAY_END(_f2, 3);
                 }
-                else  if (subcommand == 0x1B) { // PHY
-                    CBOR_FIELD_GET_UINT(subpara, 2);
-                    if (subpara == 0x01) {
-                        CBOR_FIELD_GET_UINT(vendorCommandId, 2);
-                    }
-                    else if (subpara == 0x02) {
-                        CBOR_FIELD_GET_UINT(vendorParam, 2);
-                    }
+                else if (subpara == 0x03) {
+                    CBOR_FIELD_GET_BOOL(forceChangePin, 2);
+                }
+                else {
+                    CBOR_ADVANCE(2);
                 }
             }
-            CBOR_PARSE_MAP_END(_f1, 2);
-            raw_subpara_len = cbor_value_get_next_byte(&_f1) - raw_subpara;
-        }
-        else if (val_u == 0x03) {
-            CBOR_FIELD_GET_UINT(pinUvAuthProtocol, 1);
-        }
-        else if (val_u == 0x04) {
-            CBOR_FIELD_GET_BYTES(pinUvAuthParam, 1);
+            else  if (req.subcommand == 0x1B) { // PHY
+                CBOR_FIELD_GET_UINT(subpara, 2);
+                if (subpara == 0x01) {
+                    CBOR_FIELD_GET_UINT(vendorCommandId, 2);
+                }
+                else if (subpara == 0x02) {
+                    CBOR_FIELD_GET_UINT(vendorParam, 2);
+                }
+                else {
+                    CBOR_ADVANCE(2);
+                }
+            }
+            else {
+                CBOR_ADVANCE(2);
+                CBOR_ADVANCE(2);
+            }
         }
+        CBOR_PARSE_MAP_END(req.subCommandParams.value, 2);
+        raw_subpara = req.subCommandParams.raw;
+        raw_subpara_len = req.subCommandParams.raw_len;
     }
-    CBOR_PARSE_MAP_END(map, 1);
 
-    cbor_encoder_init(&encoder, ctap_resp->init.data + 1, CTAP_MAX_CBOR_PAYLOAD, 0);
+    cbor_encoder_init(&encoder, cbor_resp, cbor_resp_max, 0);
 
-    if (pinUvAuthParam.present == false) {
+    if (req.pinUvAuthParam.present == false) {
         CBOR_ERROR(CTAP2_ERR_PUAT_REQUIRED);
     }
-    if (pinUvAuthProtocol  == 0) {
+    if (req.pinUvAuthProtocol  == 0) {
         CBOR_ERROR(CTAP2_ERR_MISSING_PARAMETER);
     }
 
-    uint8_t *verify_payload = (uint8_t *) calloc(1, 32 + 1 + 1 + raw_subpara_len);
+    uint8_t *verify_payload = (uint8_t *) cbor_arena_alloc(32 + 1 + 1 + raw_subpara_len);
+    if (!verify_payload) {
+        CBOR_ERROR(CTAP1_ERR_OTHER);
+    }
     memset(verify_payload, 0xff, 32);
     verify_payload[32] = 0x0d;
-    verify_payload[33] = (uint8_t)subcommand;
+    verify_payload[33] = (uint8_t)req.subcommand;
     memcpy(verify_payload + 34, raw_subpara, raw_subpara_len);
-    error = verify((uint8_t)pinUvAuthProtocol, paut.data, verify_payload, (uint16_t)(32 + 1 + 1 + raw_subpara_len), pinUvAuthParam.data);
-    free(verify_payload);
+    error = verify((uint8_t)req.pinUvAuthProtocol, paut.data, verify_payload, (uint16_t)(32 + 1 + 1 + raw_subpara_len), req.pinUvAuthParam.data);
     if (error != CborNoError) {
         CBOR_ERROR(CTAP2_ERR_PIN_AUTH_INVALID);
     }
@@ -141,7 +154,7 @@ int cbor_config(const uint8_t *data, size_t len) {
         CBOR_ERROR(CTAP2_ERR_PIN_AUTH_INVALID);
     }
 
-    if (subcommand == 0x7f) {
+    if (req.subcommand == 0x7f) {
         if (vendorCommandId == CTAP_CONFIG_AUT_DISABLE) {
             if (!file_has_data(ef_keydev_enc)) {
                 CBOR_ERROR(CTAP2_ERR_NOT_ALLOWED);
@@ -184,12 +197,21 @@ int cbor_config(const uint8_t *data, size_t len) {
             file_put_data(ef_keydev, NULL, 0); // Set ef to 0 bytes
             low_flash_available();
         }
+        else if (vendorCommandId == CTAP_CONFIG_UP_CACHE) {
+            if (vendorParam > MAX_UP_CACHE_WINDOW) {
+                CBOR_ERROR(CTAP1_ERR_INVALID_PARAMETER);
+            }
+            up_cache_window = (uint8_t)vendorParam;
+            user_present_time_limit = 0;
+            file_put_data(search_by_fid(EF_UP_CACHE, NULL, SPECIFY_EF), &up_cache_window, sizeof(up_cache_window));
+            low_flash_available();
+        }
         else {
             CBOR_ERROR(CTAP2_ERR_INVALID_SUBCOMMAND);
         }
         goto err;
     }
-    else if (subcommand == 0x03) {
+    else if (req.subcommand == 0x03) {
         uint8_t currentMinPinLen = 4;
         file_t *ef_minpin = search_by_fid(EF_MINPINLEN, NULL, SPECIFY_EF);
         if (file_has_data(ef_minpin)) {
@@ -207,7 +229,10 @@ int cbor_config(const uint8_t *data, size_t len) {
         if (file_has_data(ef_pin) && file_get_data(ef_pin)[1] < newMinPinLength) {
             forceChangePin = ptrue;
         }
-        uint8_t *dataf = (uint8_t *) calloc(1, 2 + minPinLengthRPIDs_len * 32);
+        uint8_t *dataf = (uint8_t *) cbor_arena_alloc(2 + minPinLengthRPIDs_len * 32);
+        if (!dataf) {
+            CBOR_ERROR(CTAP1_ERR_OTHER);
+        }
         dataf[0] = (uint8_t)newMinPinLength;
         dataf[1] = forceChangePin == ptrue ? 1 : 0;
         for (size_t m = 0; m < minPinLengthRPIDs_len; m++) {
@@ -215,15 +240,15 @@ int cbor_config(const uint8_t *data, size_t len) {
         }
         file_put_data(ef_minpin, dataf, (uint16_t)(2 + minPinLengthRPIDs_len * 32));
         low_flash_available();
-        free(dataf);
+        get_info_invalidate();
         goto err; //No return
     }
-    else if (subcommand == 0x01) {
+    else if (req.subcommand == 0x01) {
         set_opts(get_opts() | FIDO2_OPT_EA);
         goto err;
     }
 #ifndef ENABLE_EMULATION
-    else if (subcommand == 0x1B) {
+    else if (req.subcommand == 0x1B) {
         if (vendorParam == 0) {
             CBOR_ERROR(CTAP2_ERR_MISSING_PARAMETER);
         }
@@ -255,10 +280,10 @@ int cbor_config(const uint8_t *data, size_t len) {
         CBOR_ERROR(CTAP2_ERR_UNSUPPORTED_OPTION);
     }
     //CBOR_CHECK(cbor_encoder_close_container(&encoder, &mapEncoder));
-    //resp_size = cbor_encoder_get_buffer_size(&encoder, ctap_resp->init.data + 1);
+    //resp_size = cbor_encoder_get_buffer_size(&encoder, cbor_resp);
 
 err:
-    CBOR_FREE_BYTE_STRING(pinUvAuthParam);
+    CBOR_FREE_BYTE_STRING(req.pinUvAuthParam);
     CBOR_FREE_BYTE_STRING(vendorAutCt);
     for (size_t i = 0; i < minPinLengthRPIDs_len; i++) {
         CBOR_FREE_BYTE_STRING(minPinLengthRPIDs[i]);
@@ -15,6 +15,11 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define CBOR_FILE_ID 4
+
+#include "ctap2_cbor.h"
+#include "cbor_schema.h"
+#include "cbor_arena.h"
 #include "fido.h"
 #include "ctap.h"
 #include "hid/ctap_hid.h"
@@ -30,12 +35,25 @@ uint8_t cred_counter = 1;
 uint8_t cred_total = 0;
 CborByteString rpIdHashx = { 0 };
 
+typedef struct CredMgmtRequest {
+    uint64_t subcommand;
+    CborSchemaValue subCommandParams;
+    uint64_t pinUvAuthProtocol;
+    CborByteString pinUvAuthParam;
+} CredMgmtRequest;
+
+static const cbor_schema_field_t cred_mgmt_schema[] = {
+    CBOR_SCHEMA_FIELD(0x01, UINT, true, CredMgmtRequest, subcommand),
+    CBOR_SCHEMA_FIELD(0x02, MAP, false, CredMgmtRequest, subCommandParams),
+    CBOR_SCHEMA_FIELD(0x03, UINT, false, CredMgmtRequest, pinUvAuthProtocol),
+    CBOR_SCHEMA_FIELD(0x04, BYTES, false, CredMgmtRequest, pinUvAuthParam),
+};
+
 int cbor_cred_mgmt(const uint8_t *data, size_t len) {
     CborParser parser;
-    CborValue map;
     CborError error = CborNoError;
-    uint64_t subcommand = 0, pinUvAuthProtocol = 0;
-    CborByteString pinUvAuthParam = { 0 }, rpIdHash = { 0 };
+    CredMgmtRequest req = { 0 };
+    CborByteString rpIdHash = { 0 };
     PublicKeyCredentialDescriptor credentialId = { 0 };
     PublicKeyCredentialUserEntity user = { 0 };
     size_t resp_size = 0;
@@ -44,85 +62,70 @@ int cbor_cred_mgmt(const uint8_t *data, size_t len) {
     size_t raw_subpara_len = 0;
     bool asserted = false, is_preview = *(data - 1) == 0x41; // Backwards compatibility
 
-    CBOR_CHECK(cbor_parser_init(data, len, 0, &parser, &map));
-    uint64_t val_c = 1;
-    CBOR_PARSE_MAP_START(map, 1)
-    {
-        uint64_t val_u = 0;
-        CBOR_FIELD_GET_UINT(val_u, 1);
-        if (val_c <= 1 && val_c != val_u) {
-            CBOR_ERROR(CTAP2_ERR_MISSING_PARAMETER);
-        }
-        if (val_u < val_c) {
-            CBOR_ERROR(CTAP2_ERR_INVALID_CBOR);
-        }
-        val_c = val_u + 1;
-        if (val_u == 0x01) {
-            CBOR_FIELD_GET_UINT(subcommand, 1);
-        }
-        else if (val_u == 0x02) {
-            uint64_t subpara = 0;
-            raw_subpara = (uint8_t *) cbor_value_get_next_byte(&_f1);
-            CBOR_PARSE_MAP_START(_f1, 2)
-            {
-                CBOR_FIELD_GET_UINT(subpara, 2);
-                if (subpara == 0x01) {
-                    CBOR_FIELD_GET_BYTES(rpIdHash, 2);
-                }
-                else if (subpara == 0x02) {
-
-                    CBOR_PARSE_MAP_START(_f2, 3)
-                    {
-                        CBOR_FIELD_GET_KEY_TEXT(3);
-                        CBOR_FIELD_KEY_TEXT_VAL_BYTES(3, "id", credentialId.id);
-                        CBOR_FIELD_KEY_TEXT_VAL_TEXT(3, "type", credentialId.type);
-                        if (strcmp(_fd3, "transports") == 0) {
-                            CBOR_PARSE_ARRAY_START(_f3, 4)
-                            {
-                                CBOR_FIELD_GET_TEXT(credentialId.transports[credentialId.
-                                                                            transports_len], 4);
-                                credentialId.transports_len++;
+    CBOR_CHECK(cbor_schema_decode(&parser, data, len, cred_mgmt_schema, sizeof(cred_mgmt_schema) / sizeof(cbor_schema_field_t), &req));
+    if (req.subCommandParams.present) {
+        uint64_t subpara = 0;
+        raw_subpara = (uint8_t *) req.subCommandParams.raw;
+        raw_subpara_len = req.subCommandParams.raw_len;
+        CBOR_PARSE_MAP_START(req.subCommandParams.value, 2)
+        {
+            CBOR_FIELD_GET_UINT(subpara, 2);
+            if (subpara == 0x01) {
+                CBOR_FIELD_GET_BYTES(rpIdHash, 2); // Owned, kept in rpIdHashx across calls
+            }
+            else if (subpara == 0x02) {
+                CBOR_PARSE_MAP_START(_f2, 3)
+                {
+                    CBOR_FIELD_GET_KEY_TEXT(3);
+                    CBOR_FIELD_KEY_TEXT_VAL_BORROW_BYTES(3, "id", credentialId.id);
+                    CBOR_FIELD_KEY_TEXT_VAL_BORROW_TEXT(3, "type", credentialId.type);
+                    if (CBOR_KEY_TEXT_IS(3, "transports")) {
+                        CBOR_PARSE_ARRAY_START(_f3, 4)
+                        {
+                            if (credentialId.transports_len >= sizeof(credentialId.transports) / sizeof(credentialId.transports[0])) {
+                                CBOR_ERROR(CTAP2_ERR_LIMIT_EXCEEDED);
                             }
-                            CBOR_PARSE_ARRAY_END(_f3, 4);
+                            CBOR_FIELD_BORROW_TEXT(credentialId.transports[credentialId.transports_len], 4);
+                            credentialId.transports_len++;
                         }
+                        CBOR_PARSE_ARRAY_END(_f3, 4);
                     }
-                    CBOR_PARSE_MAP_END(_f2, 3);
-                }
-                else if (subpara == 0x03) {
-                    CBOR_PARSE_MAP_START(_f1, 3)
-                    {
-                        CBOR_FIELD_GET_KEY_TEXT(3);
-                        CBOR_FIELD_KEY_TEXT_VAL_BYTES(3, "id", user.id);
-                        CBOR_FIELD_KEY_TEXT_VAL_TEXT(3, "name", user.parent.name);
-                        CBOR_FIELD_KEY_TEXT_VAL_TEXT(3, "displayName", user.displayName);
+                    else {
+                        CBOR_ADVANCE(3);
                     }
-                    CBOR_PARSE_MAP_END(_f1, 3);
                 }
+                CBOR_PARSE_MAP_END(_f2, 3);
+            }
+            else if (subpara == 0x03) {
+                CBOR_PARSE_MAP_START(_f2, 3)
+                {
+                    CBOR_FIELD_GET_KEY_TEXT(3);
+                    CBOR_FIELD_KEY_TEXT_VAL_BORROW_BYTES(3, "id", user.id);
+                    CBOR_FIELD_KEY_TEXT_VAL_BORROW_TEXT(3, "name", user.parent.name);
+                    CBOR_FIELD_KEY_TEXT_VAL_BORROW_TEXT(3, "displayName", user.displayName);
+                    CBOR_ADVANCE(3);
+                }
+                CBOR_PARSE_MAP_END(_f2, 3);
+            }
+            else {
+                CBOR_ADVANCE(2);
             }
-            CBOR_PARSE_MAP_END(_f1, 2);
-            raw_subpara_len = cbor_value_get_next_byte(&_f1) - raw_subpara;
-        }
-        else if (val_u == 0x03) {
-            CBOR_FIELD_GET_UINT(pinUvAuthProtocol, 1);
-        }
-        else if (val_u == 0x04) { // pubKeyCredParams
-            CBOR_FIELD_GET_BYTES(pinUvAuthParam, 1);
         }
+        CBOR_PARSE_MAP_END(req.subCommandParams.value, 2);
     }
-    CBOR_PARSE_MAP_END(map, 1);
 
-    if (subcommand != 0x03 && subcommand != 0x05) {
-        if (pinUvAuthParam.present == false) {
+    if (req.subcommand != 0x03 && req.subcommand != 0x05) {
+        if (req.pinUvAuthParam.present == false) {
             CBOR_ERROR(CTAP2_ERR_PUAT_REQUIRED);
         }
-        if (pinUvAuthProtocol != 1 && pinUvAuthProtocol != 2) {
+        if (req.pinUvAuthProtocol != 1 && req.pinUvAuthProtocol != 2) {
             CBOR_ERROR(CTAP1_ERR_INVALID_PARAMETER);
         }
     }
 
-    cbor_encoder_init(&encoder, ctap_resp->init.data + 1, CTAP_MAX_CBOR_PAYLOAD, 0);
-    if (subcommand == 0x01) {
-        if (verify((uint8_t)pinUvAuthProtocol, paut.data, (const uint8_t *) "\x01", 1, pinUvAuthParam.data) != CborNoError) {
+    cbor_encoder_init(&encoder, cbor_resp, cbor_resp_max, 0);
+    if (req.subcommand == 0x01) {
+        if (verify((uint8_t)req.pinUvAuthProtocol, paut.data, (const uint8_t *) "\x01", 1, req.pinUvAuthParam.data) != CborNoError) {
             CBOR_ERROR(CTAP2_ERR_PIN_AUTH_INVALID);
         }
         if (is_preview == false &&
@@ -141,10 +144,10 @@ int cbor_cred_mgmt(const uint8_t *data, size_t len) {
         CBOR_CHECK(cbor_encode_uint(&mapEncoder, 0x02));
         CBOR_CHECK(cbor_encode_uint(&mapEncoder, MAX_RESIDENT_CREDENTIALS - existing));
     }
-    else if (subcommand == 0x02 || subcommand == 0x03) {
+    else if (req.subcommand == 0x02 || req.subcommand == 0x03) {
         file_t *rp_ef = NULL;
-        if (subcommand == 0x02) {
-            if (verify((uint8_t)pinUvAuthProtocol, paut.data, (const uint8_t *) "\x02", 1, pinUvAuthParam.data) != CborNoError) {
+        if (req.subcommand == 0x02) {
+            if (verify((uint8_t)req.pinUvAuthProtocol, paut.data, (const uint8_t *) "\x02", 1, req.pinUvAuthParam.data) != CborNoError) {
                 CBOR_ERROR(CTAP2_ERR_PIN_AUTH_INVALID);
             }
             if (is_preview == false && (!(paut.permissions & CTAP_PERMISSION_CM) || paut.has_rp_id == true)) {
@@ -166,11 +169,11 @@ int cbor_cred_mgmt(const uint8_t *data, size_t len) {
                     if (rp_ef == NULL) {
                         rp_ef = tef;
                     }
-                    if (subcommand == 0x03) {
+                    if (req.subcommand == 0x03) {
                         break;
                     }
                 }
-                if (subcommand == 0x02) {
+                if (req.subcommand == 0x02) {
                     rp_total++;
                 }
             }
@@ -179,7 +182,7 @@ int cbor_cred_mgmt(const uint8_t *data, size_t len) {
             CBOR_ERROR(CTAP2_ERR_NO_CREDENTIALS);
         }
         rp_counter++;
-        CBOR_CHECK(cbor_encoder_create_map(&encoder, &mapEncoder, subcommand == 0x02 ? 3 : 2));
+        CBOR_CHECK(cbor_encoder_create_map(&encoder, &mapEncoder, req.subcommand == 0x02 ? 3 : 2));
         CBOR_CHECK(cbor_encode_uint(&mapEncoder, 0x03));
         CBOR_CHECK(cbor_encoder_create_map(&mapEncoder, &mapEncoder2, 1));
         CBOR_CHECK(cbor_encode_text_stringz(&mapEncoder2, "id"));
@@ -188,18 +191,18 @@ int cbor_cred_mgmt(const uint8_t *data, size_t len) {
         CBOR_CHECK(cbor_encoder_close_container(&mapEncoder, &mapEncoder2));
         CBOR_CHECK(cbor_encode_uint(&mapEncoder, 0x04));
         CBOR_CHECK(cbor_encode_byte_string(&mapEncoder, file_get_data(rp_ef) + 1, 32));
-        if (subcommand == 0x02) {
+        if (req.subcommand == 0x02) {
             CBOR_CHECK(cbor_encode_uint(&mapEncoder, 0x05));
             CBOR_CHECK(cbor_encode_uint(&mapEncoder, rp_total));
         }
     }
-    else if (subcommand == 0x04 || subcommand == 0x05) {
-        if (subcommand == 0x04 && rpIdHash.present == false) {
+    else if (req.subcommand == 0x04 || req.subcommand == 0x05) {
+        if (req.subcommand == 0x04 && rpIdHash.present == false) {
             CBOR_ERROR(CTAP2_ERR_MISSING_PARAMETER);
         }
-        if (subcommand == 0x04) {
+        if (req.subcommand == 0x04) {
             *(raw_subpara - 1) = 0x04;
-            if (verify((uint8_t)pinUvAuthProtocol, paut.data, raw_subpara - 1, (uint16_t)(raw_subpara_len + 1), pinUvAuthParam.data) != CborNoError) {
+            if (verify((uint8_t)req.pinUvAuthProtocol, paut.data, raw_subpara - 1, (uint16_t)(raw_subpara_len + 1), req.pinUvAuthParam.data) != CborNoError) {
                 CBOR_ERROR(CTAP2_ERR_PIN_AUTH_INVALID);
             }
             if (is_preview == false &&
@@ -225,11 +228,11 @@ int cbor_cred_mgmt(const uint8_t *data, size_t len) {
                     if (cred_ef == NULL) {
                         cred_ef = tef;
                     }
-                    if (subcommand == 0x05) {
+                    if (req.subcommand == 0x05) {
                         break;
                     }
                 }
-                if (subcommand == 0x04) {
+                if (req.subcommand == 0x04) {
                     cred_total++;
                 }
             }
@@ -254,7 +257,7 @@ int cbor_cred_mgmt(const uint8_t *data, size_t len) {
         cred_counter++;
 
         uint8_t l = 4;
-        if (subcommand == 0x04) {
+        if (req.subcommand == 0x04) {
             l++;
         }
         if (cred.extensions.present == true) {
@@ -304,7 +307,7 @@ int cbor_cred_mgmt(const uint8_t *data, size_t len) {
         CBOR_CHECK(cbor_encode_uint(&mapEncoder, 0x08));
         CBOR_CHECK(COSE_key(&key, &mapEncoder, &mapEncoder2));
 
-        if (subcommand == 0x04) {
+        if (req.subcommand == 0x04) {
             CBOR_CHECK(cbor_encode_uint(&mapEncoder, 0x09));
             CBOR_CHECK(cbor_encode_uint(&mapEncoder, cred_total));
         }
@@ -337,12 +340,12 @@ int cbor_cred_mgmt(const uint8_t *data, size_t len) {
         credential_free(&cred);
         mbedtls_ecp_keypair_free(&key);
     }
-    else if (subcommand == 0x06) {
+    else if (req.subcommand == 0x06) {
         if (credentialId.id.present == false) {
             CBOR_ERROR(CTAP2_ERR_MISSING_PARAMETER);
         }
         *(raw_subpara - 1) = 0x06;
-        if (verify((uint8_t)pinUvAuthProtocol, paut.data, raw_subpara - 1, (uint16_t)(raw_subpara_len + 1), pinUvAuthParam.data) != CborNoError) {
+        if (verify((uint8_t)req.pinUvAuthProtocol, paut.data, raw_subpara - 1, (uint16_t)(raw_subpara_len + 1), req.pinUvAuthParam.data) != CborNoError) {
             CBOR_ERROR(CTAP2_ERR_PIN_AUTH_INVALID);
         }
         if (is_preview == false &&
@@ -360,7 +363,10 @@ int cbor_cred_mgmt(const uint8_t *data, size_t len) {
                 for (int j = 0; j < MAX_RESIDENT_CREDENTIALS; j++) {
                     file_t *rp_ef = search_dynamic_file((uint16_t)(EF_RP + j));
                     if (file_has_data(rp_ef) && memcmp(file_get_data(rp_ef) + 1, rp_id_hash, 32) == 0) {
-                        uint8_t *rp_data = (uint8_t *) calloc(1, file_get_size(rp_ef));
+                        uint8_t *rp_data = (uint8_t *) cbor_arena_alloc(file_get_size(rp_ef));
+                        if (!rp_data) {
+                            CBOR_ERROR(CTAP1_ERR_OTHER);
+                        }
                         memcpy(rp_data, file_get_data(rp_ef), file_get_size(rp_ef));
                         rp_data[0] -= 1;
                         if (rp_data[0] == 0) {
@@ -369,7 +375,6 @@ int cbor_cred_mgmt(const uint8_t *data, size_t len) {
                         else {
                             file_put_data(rp_ef, rp_data, file_get_size(rp_ef));
                         }
-                        free(rp_data);
                         break;
                     }
                 }
@@ -379,12 +384,12 @@ int cbor_cred_mgmt(const uint8_t *data, size_t len) {
         }
         CBOR_ERROR(CTAP2_ERR_NO_CREDENTIALS);
     }
-    else if (subcommand == 0x07) {
+    else if (req.subcommand == 0x07) {
         if (credentialId.id.present == false || user.id.present == false) {
             CBOR_ERROR(CTAP2_ERR_MISSING_PARAMETER);
         }
         *(raw_subpara - 1) = 0x07;
-        if (verify((uint8_t)pinUvAuthProtocol, paut.data, raw_subpara - 1, (uint16_t)(raw_subpara_len + 1), pinUvAuthParam.data) != CborNoError) {
+        if (verify((uint8_t)req.pinUvAuthProtocol, paut.data, raw_subpara - 1, (uint16_t)(raw_subpara_len + 1), req.pinUvAuthParam.data) != CborNoError) {
             CBOR_ERROR(CTAP2_ERR_PIN_AUTH_INVALID);
         }
         if (is_preview == false &&
@@ -404,9 +409,9 @@ int cbor_cred_mgmt(const uint8_t *data, size_t len) {
                     credential_free(&cred);
                     CBOR_ERROR(CTAP1_ERR_INVALID_PARAMETER);
                 }
-                uint8_t newcred[MAX_CRED_ID_LENGTH];
+                uint8_t *newcred = (uint8_t *) cbor_arena_alloc(MAX_CRED_ID_LENGTH);
                 size_t newcred_len = 0;
-                if (credential_create(&cred.rpId, &cred.userId, &user.parent.name,
+                if (!newcred || credential_create(&cred.rpId, &cred.userId, &user.parent.name,
                                       &user.displayName, &cred.opts, &cred.extensions,
                                       cred.use_sign_count, (int)cred.alg,
                                       (int)cred.curve, newcred, &newcred_len) != 0) {
@@ -424,9 +429,9 @@ int cbor_cred_mgmt(const uint8_t *data, size_t len) {
         CBOR_ERROR(CTAP2_ERR_NO_CREDENTIALS);
     }
     CBOR_CHECK(cbor_encoder_close_container(&encoder, &mapEncoder));
-    resp_size = cbor_encoder_get_buffer_size(&encoder, ctap_resp->init.data + 1);
+    resp_size = cbor_encoder_get_buffer_size(&encoder, cbor_resp);
 err:
-    CBOR_FREE_BYTE_STRING(pinUvAuthParam);
+    CBOR_FREE_BYTE_STRING(req.pinUvAuthParam);
 
     if (asserted == false) {
         CBOR_FREE_BYTE_STRING(rpIdHash);
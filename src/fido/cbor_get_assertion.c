@@ -15,7 +15,12 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define CBOR_FILE_ID 5
+
 #include "cbor.h"
+#include "ctap2_cbor.h"
+#include "cbor_schema.h"
+#include "cbor_arena.h"
 #include "ctap.h"
 #if !defined(ENABLE_EMULATION) && !defined(ESP_PLATFORM)
 #include "bsp/board.h"
@@ -31,45 +36,74 @@
 #include "mbedtls/sha256.h"
 #include "random.h"
 
-int cbor_get_assertion(const uint8_t *data, size_t len, bool next);
+int cbor_get_assertion(const uint8_t *data, size_t len);
+
+#define GA_NO_SLOT 0xFFFF
+
+// Pending credentials of a multi-credential getAssertion, newest first, plus the
+// already verified request parameters. Resident credentials are reloaded from
+// their EF_CRED slot, allowList ones from their id.
+typedef struct GetAssertionNext {
+    uint16_t slot[MAX_CREDENTIAL_COUNT_IN_LIST];
+    CborByteString id[MAX_CREDENTIAL_COUNT_IN_LIST];
+    uint8_t rp_id_hash[32];
+    CborByteString clientDataHash;
+    CredExtensions extensions;
+    const bool *credBlob;
+    uint8_t hmacSecretPinUvAuthProtocol;
+    size_t salt_len;
+    uint8_t salt_dec[64];
+    uint8_t sharedSecret[64];
+    size_t allowList_len;
+    uint8_t flags;
+    bool resident;
+    uint8_t numberOfCredentials;
+    uint8_t counter;
+    uint32_t timer;
+} GetAssertionNext;
+
+static GetAssertionNext gan = { 0 };
 
-bool residentx = false;
-Credential credsx[MAX_CREDENTIAL_COUNT_IN_LIST] = { 0 };
-uint8_t credentialCounter = 1;
-uint8_t numberOfCredentialsx = 0;
-uint8_t flagsx = 0;
-uint32_t timerx = 0;
-uint8_t *datax = NULL;
-size_t lenx = 0;
+static void get_assertion_next_clear() {
+    for (int i = 0; i < MAX_CREDENTIAL_COUNT_IN_LIST; i++) {
+        CBOR_FREE_BYTE_STRING(gan.id[i]);
+    }
+    CBOR_FREE_BYTE_STRING(gan.clientDataHash);
+    mbedtls_platform_zeroize(&gan, sizeof(gan));
+}
+
+static int get_assertion_encode(Credential *selcred, const uint8_t *clientDataHash, size_t clientDataHash_len, bool next);
 
 int cbor_get_next_assertion(const uint8_t *data, size_t len) {
     (void) data;
     (void) len;
     CborError error = CborNoError;
-    if (credentialCounter >= numberOfCredentialsx) {
+    Credential cred = { 0 };
+    if (gan.counter >= gan.numberOfCredentials) {
+        CBOR_ERROR(CTAP2_ERR_NOT_ALLOWED);
+    }
+    if ((int32_t)(fido_millis() - (gan.timer + 30 * 1000)) > 0) {
         CBOR_ERROR(CTAP2_ERR_NOT_ALLOWED);
     }
-    if (timerx + 30 * 1000 < board_millis()) {
+    if (gan.slot[gan.counter] != GA_NO_SLOT) {
+        file_t *ef = search_dynamic_file((uint16_t)(EF_CRED + gan.slot[gan.counter]));
+        if (!file_has_data(ef) || memcmp(file_get_data(ef), gan.rp_id_hash, 32) != 0) {
+            CBOR_ERROR(CTAP2_ERR_NOT_ALLOWED);
+        }
+        if (credential_load(file_get_data(ef) + 32, file_get_size(ef) - 32, gan.rp_id_hash, &cred) != 0) {
+            CBOR_ERROR(CTAP2_ERR_NOT_ALLOWED);
+        }
+    }
+    else if (credential_load(gan.id[gan.counter].data, gan.id[gan.counter].len, gan.rp_id_hash, &cred) != 0) {
         CBOR_ERROR(CTAP2_ERR_NOT_ALLOWED);
     }
-    CBOR_CHECK(cbor_get_assertion(datax, lenx, true));
-    timerx = board_millis();
-    credentialCounter++;
+    CBOR_CHECK(get_assertion_encode(&cred, gan.clientDataHash.data, gan.clientDataHash.len, true));
+    gan.timer = fido_millis();
+    gan.counter++;
 err:
-    if (error != CborNoError || credentialCounter == numberOfCredentialsx) {
-        for (int i = 0; i < MAX_CREDENTIAL_COUNT_IN_LIST; i++) {
-            credential_free(&credsx[i]);
-        }
-        if (datax) {
-            free(datax);
-            datax = NULL;
-        }
-        lenx = 0;
-        residentx = false;
-        timerx = 0;
-        flagsx = 0;
-        credentialCounter = 0;
-        numberOfCredentialsx = 0;
+    credential_free(&cred);
+    if (error != CborNoError || gan.counter == gan.numberOfCredentials) {
+        get_assertion_next_clear();
         if (error == CborErrorImproperValue) {
             return CTAP2_ERR_CBOR_UNEXPECTED_TYPE;
         }
@@ -78,382 +112,454 @@ err:
     return 0;
 }
 
-int cbor_get_assertion(const uint8_t *data, size_t len, bool next) {
-    size_t resp_size = 0;
-    uint64_t pinUvAuthProtocol = 0, hmacSecretPinUvAuthProtocol = 1;
+typedef struct GetAssertionRequest {
+    CborCharString rpId;
+    CborByteString clientDataHash;
+    CborSchemaValue allowList;
+    CborSchemaValue extensions;
+    CborSchemaValue options;
+    CborByteString pinUvAuthParam;
+    uint64_t pinUvAuthProtocol;
+} GetAssertionRequest;
+
+static const cbor_schema_field_t get_assertion_schema[] = {
+    CBOR_SCHEMA_FIELD(0x01, TEXT, true, GetAssertionRequest, rpId),
+    CBOR_SCHEMA_FIELD(0x02, BYTES, true, GetAssertionRequest, clientDataHash),
+    CBOR_SCHEMA_FIELD(0x03, ARRAY, false, GetAssertionRequest, allowList),
+    CBOR_SCHEMA_FIELD(0x04, MAP, false, GetAssertionRequest, extensions),
+    CBOR_SCHEMA_FIELD(0x05, MAP, false, GetAssertionRequest, options),
+    CBOR_SCHEMA_FIELD(0x06, BYTES, false, GetAssertionRequest, pinUvAuthParam),
+    CBOR_SCHEMA_FIELD(0x07, UINT, false, GetAssertionRequest, pinUvAuthProtocol),
+};
+
+int cbor_get_assertion(const uint8_t *data, size_t len) {
+    uint64_t hmacSecretPinUvAuthProtocol = 1;
     CredOptions options = { 0 };
     CredExtensions extensions = { 0 };
     CborParser parser;
-    CborEncoder encoder, mapEncoder, mapEncoder2;
-    CborValue map;
     CborError error = CborNoError;
-    CborByteString pinUvAuthParam = { 0 }, clientDataHash = { 0 };
-    CborCharString rpId = { 0 };
+    GetAssertionRequest req = { 0 };
     PublicKeyCredentialDescriptor allowList[MAX_CREDENTIAL_COUNT_IN_LIST] = { 0 };
     Credential creds[MAX_CREDENTIAL_COUNT_IN_LIST] = { 0 };
+    uint16_t creds_slot[MAX_CREDENTIAL_COUNT_IN_LIST] = { 0 };
     size_t allowList_len = 0, creds_len = 0;
-    uint8_t *aut_data = NULL;
-    bool asserted = false, up = false, uv = false;
+    bool up = false, uv = false;
     int64_t kty = 2, alg = 0, crv = 0;
     CborByteString kax = { 0 }, kay = { 0 }, salt_enc = { 0 }, salt_auth = { 0 };
     const bool *credBlob = NULL;
 
-    CBOR_CHECK(cbor_parser_init(data, len, 0, &parser, &map));
-    uint64_t val_c = 1;
-    CBOR_PARSE_MAP_START(map, 1)
-    {
-        uint64_t val_u = 0;
-        CBOR_FIELD_GET_UINT(val_u, 1);
-        if (val_c <= 2 && val_c != val_u) {
-            CBOR_ERROR(CTAP2_ERR_MISSING_PARAMETER);
-        }
-        if (val_u < val_c) {
-            CBOR_ERROR(CTAP2_ERR_INVALID_CBOR);
-        }
-        val_c = val_u + 1;
-        if (val_u == 0x01) {
-            CBOR_FIELD_GET_TEXT(rpId, 1);
-        }
-        else if (val_u == 0x02) {
-            CBOR_FIELD_GET_BYTES(clientDataHash, 1);
-        }
-        else if (val_u == 0x03) { // excludeList
-            CBOR_PARSE_ARRAY_START(_f1, 2)
+    get_assertion_next_clear();
+
+    CBOR_CHECK(cbor_schema_decode(&parser, data, len, get_assertion_schema, sizeof(get_assertion_schema) / sizeof(cbor_schema_field_t), &req));
+    if (req.allowList.present) {
+        CBOR_PARSE_ARRAY_START(req.allowList.value, 2)
+        {
+            if (allowList_len >= MAX_CREDENTIAL_COUNT_IN_LIST) {
+                CBOR_ERROR(CTAP2_ERR_LIMIT_EXCEEDED);
+            }
+            PublicKeyCredentialDescriptor *pc = &allowList[allowList_len];
+            CBOR_PARSE_MAP_START(_f2, 3)
             {
-                PublicKeyCredentialDescriptor *pc = &allowList[allowList_len];
-                CBOR_PARSE_MAP_START(_f2, 3)
-                {
-                    CBOR_FIELD_GET_KEY_TEXT(3);
-                    CBOR_FIELD_KEY_TEXT_VAL_BYTES(3, "id", pc->id);
-                    CBOR_FIELD_KEY_TEXT_VAL_TEXT(3, "type", pc->type);
-                    if (strcmp(_fd3, "transports") == 0) {
-                        CBOR_PARSE_ARRAY_START(_f3, 4)
-                        {
-                            CBOR_FIELD_GET_TEXT(pc->transports[pc->transports_len], 4);
-                            pc->transports_len++;
+                CBOR_FIELD_GET_KEY_TEXT(3);
+                CBOR_FIELD_KEY_TEXT_VAL_BORROW_BYTES(3, "id", pc->id);
+                CBOR_FIELD_KEY_TEXT_VAL_BORROW_TEXT(3, "type", pc->type);
+                if (CBOR_KEY_TEXT_IS(3, "transports")) {
+                    CBOR_PARSE_ARRAY_START(_f3, 4)
+                    {
+                        if (pc->transports_len >= sizeof(pc->transports) / sizeof(pc->transports[0])) {
+                            CBOR_ERROR(CTAP2_ERR_LIMIT_EXCEEDED);
                         }
-                        CBOR_PARSE_ARRAY_END(_f3, 4);
+                        CBOR_FIELD_BORROW_TEXT(pc->transports[pc->transports_len], 4);
+                        pc->transports_len++;
                     }
+                    CBOR_PARSE_ARRAY_END(_f3, 4);
+                }
+                else {
+                    CBOR_ADVANCE(3);
                 }
-                CBOR_PARSE_MAP_END(_f2, 3);
-                allowList_len++;
             }
-            CBOR_PARSE_ARRAY_END(_f1, 2);
+            CBOR_PARSE_MAP_END(_f2, 3);
+            allowList_len++;
         }
-        else if (val_u == 0x04) { // extensions
-            extensions.present = true;
-            CBOR_PARSE_MAP_START(_f1, 2)
-            {
-                CBOR_FIELD_GET_KEY_TEXT(2);
-                if (strcmp(_fd2, "hmac-secret") == 0) {
-                    extensions.hmac_secret = ptrue;
-                    uint64_t ukey = 0;
-                    CBOR_PARSE_MAP_START(_f2, 3)
-                    {
-                        CBOR_FIELD_GET_UINT(ukey, 3);
-                        if (ukey == 0x01) {
-                            CBOR_CHECK(COSE_read_key(&_f3, &kty, &alg, &crv, &kax, &kay));
-                        }
-                        else if (ukey == 0x02) {
-                            CBOR_FIELD_GET_BYTES(salt_enc, 3);
-                        }
-                        else if (ukey == 0x03) {
-                            CBOR_FIELD_GET_BYTES(salt_auth, 3);
-                        }
-                        else if (ukey == 0x04) {
-                            CBOR_FIELD_GET_UINT(hmacSecretPinUvAuthProtocol, 3);
-                        }
-                        else {
-                            CBOR_ADVANCE(3);
-                        }
+        CBOR_PARSE_ARRAY_END(req.allowList.value, 2);
+    }
+    extensions.present = req.extensions.present;
+    if (req.extensions.present) {
+        CBOR_PARSE_MAP_START(req.extensions.value, 2)
+        {
+            CBOR_FIELD_GET_KEY_TEXT(2);
+            if (CBOR_KEY_TEXT_IS(2, "hmac-secret")) {
+                extensions.hmac_secret = ptrue;
+                uint64_t ukey = 0;
+                CBOR_PARSE_MAP_START(_f2, 3)
+                {
+                    CBOR_FIELD_GET_UINT(ukey, 3);
+                    if (ukey == 0x01) {
+                        CBOR_CHECK(COSE_read_key(&_f3, &kty, &alg, &crv, &kax, &kay));
+                    }
+                    else if (ukey == 0x02) {
+                        CBOR_FIELD_BORROW_BYTES(salt_enc, 3);
+                    }
+                    else if (ukey == 0x03) {
+                        CBOR_FIELD_BORROW_BYTES(salt_auth, 3);
+                    }
+                    else if (ukey == 0x04) {
+                        CBOR_FIELD_GET_UINT(hmacSecretPinUvAuthProtocol, 3);
+                    }
+                    else {
+                        CBOR_ADVANCE(3);
                     }
-                    CBOR_PARSE_MAP_END(_f2, 3);
-                    continue;
                 }
-                CBOR_FIELD_KEY_TEXT_VAL_BOOL(2, "credBlob", credBlob);
-                CBOR_FIELD_KEY_TEXT_VAL_BOOL(2, "largeBlobKey", extensions.largeBlobKey);
-                CBOR_FIELD_KEY_TEXT_VAL_BOOL(2, "thirdPartyPayment", extensions.thirdPartyPayment);
-                CBOR_ADVANCE(2);
-            }
-            CBOR_PARSE_MAP_END(_f1, 2);
-        }
-        else if (val_u == 0x05) { // options
-            options.present = true;
-            CBOR_PARSE_MAP_START(_f1, 2)
-            {
-                CBOR_FIELD_GET_KEY_TEXT(2);
-                CBOR_FIELD_KEY_TEXT_VAL_BOOL(2, "rk", options.rk);
-                CBOR_FIELD_KEY_TEXT_VAL_BOOL(2, "up", options.up);
-                CBOR_FIELD_KEY_TEXT_VAL_BOOL(2, "uv", options.uv);
-                CBOR_ADVANCE(2);
+                CBOR_PARSE_MAP_END(_f2, 3);
+                continue;
             }
-            CBOR_PARSE_MAP_END(_f1, 2);
-        }
-        else if (val_u == 0x06) { // pinUvAuthParam
-            CBOR_FIELD_GET_BYTES(pinUvAuthParam, 1);
-        }
-        else if (val_u == 0x07) { // pinUvAuthProtocol
-            CBOR_FIELD_GET_UINT(pinUvAuthProtocol, 1);
+            CBOR_FIELD_KEY_TEXT_VAL_BOOL(2, "credBlob", credBlob);
+            CBOR_FIELD_KEY_TEXT_VAL_BOOL(2, "largeBlobKey", extensions.largeBlobKey);
+            CBOR_FIELD_KEY_TEXT_VAL_BOOL(2, "thirdPartyPayment", extensions.thirdPartyPayment);
+            CBOR_ADVANCE(2);
         }
+        CBOR_PARSE_MAP_END(req.extensions.value, 2);
+    }
+    options.present = req.options.present;
+    if (req.options.present) {
+        CBOR_PARSE_MAP_START(req.options.value, 2)
+        {
+            CBOR_FIELD_GET_KEY_TEXT(2);
+            CBOR_FIELD_KEY_TEXT_VAL_BOOL(2, "rk", options.rk);
+            CBOR_FIELD_KEY_TEXT_VAL_BOOL(2, "up", options.up);
+            CBOR_FIELD_KEY_TEXT_VAL_BOOL(2, "uv", options.uv);
+            CBOR_ADVANCE(2);
+        }
+        CBOR_PARSE_MAP_END(req.options.value, 2);
     }
-    CBOR_PARSE_MAP_END(map, 1);
 
-    if (rpId.present == false || clientDataHash.present == false) {
+    if (req.rpId.present == false || req.clientDataHash.present == false) {
         CBOR_ERROR(CTAP2_ERR_MISSING_PARAMETER);
     }
 
     uint8_t flags = 0;
     uint8_t rp_id_hash[32] = {0};
-    mbedtls_sha256((uint8_t *) rpId.data, rpId.len, rp_id_hash, 0);
+    mbedtls_sha256((uint8_t *) req.rpId.data, req.rpId.len, rp_id_hash, 0);
 
     bool resident = false;
     uint8_t numberOfCredentials = 0;
     Credential *selcred = NULL;
-    if (next == false) {
-        if (pinUvAuthParam.present == true) {
-            if (pinUvAuthParam.len == 0 || pinUvAuthParam.data == NULL) {
-                if (check_user_presence() == false) {
-                    CBOR_ERROR(CTAP2_ERR_OPERATION_DENIED);
-                }
-                if (!file_has_data(ef_pin)) {
-                    CBOR_ERROR(CTAP2_ERR_PIN_NOT_SET);
-                }
-                else {
-                    CBOR_ERROR(CTAP2_ERR_PIN_AUTH_INVALID);
-                }
-            }
-            else {
-                if (pinUvAuthProtocol == 0) {
-                    CBOR_ERROR(CTAP2_ERR_MISSING_PARAMETER);
-                }
-                if (pinUvAuthProtocol != 1 && pinUvAuthProtocol != 2) {
-                    CBOR_ERROR(CTAP1_ERR_INVALID_PARAMETER);
-                }
-            }
-        }
-        if (options.present) {
-            if (options.uv == ptrue) { //4.3
-                CBOR_ERROR(CTAP2_ERR_INVALID_OPTION);
-            }
-            if (options.uv == NULL || pinUvAuthParam.present == true) {
-                uv = false;
-            }
-            else {
-                uv = *options.uv;
-            }
-            //if (options.up != NULL) { //4.5
-            //    CBOR_ERROR(CTAP2_ERR_INVALID_OPTION);
-            //}
-            if (options.rk != NULL) {
-                CBOR_ERROR(CTAP2_ERR_UNSUPPORTED_OPTION);
+    if (req.pinUvAuthParam.present == true) {
+        if (req.pinUvAuthParam.len == 0 || req.pinUvAuthParam.data == NULL) {
+            if (check_user_presence(NULL) == false) {
+                CBOR_ERROR(CTAP2_ERR_OPERATION_DENIED);
             }
-            //else if (options.up == NULL) //5.7
-            //rup = ptrue;
-            if (options.up != NULL) {
-                up = *options.up;
+            if (!file_has_data(ef_pin)) {
+                CBOR_ERROR(CTAP2_ERR_PIN_NOT_SET);
             }
             else {
-                up = true;
-            }
-        }
-
-        if (pinUvAuthParam.present == true) { //6.1
-            int ret = verify((uint8_t)pinUvAuthProtocol, paut.data, clientDataHash.data, (uint16_t)clientDataHash.len, pinUvAuthParam.data);
-            if (ret != CborNoError) {
-                CBOR_ERROR(CTAP2_ERR_PIN_AUTH_INVALID);
-            }
-            if (getUserVerifiedFlagValue() == false) {
-                CBOR_ERROR(CTAP2_ERR_PIN_AUTH_INVALID);
-            }
-            if (!(paut.permissions & CTAP_PERMISSION_GA)) {
                 CBOR_ERROR(CTAP2_ERR_PIN_AUTH_INVALID);
             }
-            if (paut.has_rp_id == true && memcmp(paut.rp_id_hash, rp_id_hash, 32) != 0) {
-                CBOR_ERROR(CTAP2_ERR_PIN_AUTH_INVALID);
-            }
-            flags |= FIDO2_AUT_FLAG_UV;
-            // Check pinUvAuthToken permissions. See 6.2.2.4
         }
-        if (extensions.present == true && extensions.hmac_secret == ptrue) {
-            if (kax.present == false || kay.present == false || crv == 0 || alg == 0 ||
-                salt_enc.present == false || salt_auth.present == false) {
+        else {
+            if (req.pinUvAuthProtocol == 0) {
                 CBOR_ERROR(CTAP2_ERR_MISSING_PARAMETER);
             }
-            if (salt_enc.len != 32 + (hmacSecretPinUvAuthProtocol - 1) * IV_SIZE &&
-                salt_enc.len != 64 + (hmacSecretPinUvAuthProtocol - 1) * IV_SIZE) {
-                CBOR_ERROR(CTAP1_ERR_INVALID_LEN);
+            if (req.pinUvAuthProtocol != 1 && req.pinUvAuthProtocol != 2) {
+                CBOR_ERROR(CTAP1_ERR_INVALID_PARAMETER);
             }
         }
+    }
+    if (options.present) {
+        if (options.uv == ptrue) { //4.3
+            CBOR_ERROR(CTAP2_ERR_INVALID_OPTION);
+        }
+        if (options.uv == NULL || req.pinUvAuthParam.present == true) {
+            uv = false;
+        }
+        else {
+            uv = *options.uv;
+        }
+        //if (options.up != NULL) { //4.5
+        //    CBOR_ERROR(CTAP2_ERR_INVALID_OPTION);
+        //}
+        if (options.rk != NULL) {
+            CBOR_ERROR(CTAP2_ERR_UNSUPPORTED_OPTION);
+        }
+        //else if (options.up == NULL) //5.7
+        //rup = ptrue;
+        if (options.up != NULL) {
+            up = *options.up;
+        }
+        else {
+            up = true;
+        }
+    }
 
-        bool silent = (up == false && uv == false);
+    if (req.pinUvAuthParam.present == true) { //6.1
+        int ret = verify((uint8_t)req.pinUvAuthProtocol, paut.data, req.clientDataHash.data, (uint16_t)req.clientDataHash.len, req.pinUvAuthParam.data);
+        if (ret != CborNoError) {
+            CBOR_ERROR(CTAP2_ERR_PIN_AUTH_INVALID);
+        }
+        if (getUserVerifiedFlagValue() == false) {
+            CBOR_ERROR(CTAP2_ERR_PIN_AUTH_INVALID);
+        }
+        if (!(paut.permissions & CTAP_PERMISSION_GA)) {
+            CBOR_ERROR(CTAP2_ERR_PIN_AUTH_INVALID);
+        }
+        if (paut.has_rp_id == true && memcmp(paut.rp_id_hash, rp_id_hash, 32) != 0) {
+            CBOR_ERROR(CTAP2_ERR_PIN_AUTH_INVALID);
+        }
+        flags |= FIDO2_AUT_FLAG_UV;
+        // Check pinUvAuthToken permissions. See 6.2.2.4
+    }
+    if (extensions.present == true && extensions.hmac_secret == ptrue) {
+        if (kax.present == false || kay.present == false || crv == 0 || alg == 0 ||
+            salt_enc.present == false || salt_auth.present == false) {
+            CBOR_ERROR(CTAP2_ERR_MISSING_PARAMETER);
+        }
+        if (salt_enc.len != 32 + (hmacSecretPinUvAuthProtocol - 1) * IV_SIZE &&
+            salt_enc.len != 64 + (hmacSecretPinUvAuthProtocol - 1) * IV_SIZE) {
+            CBOR_ERROR(CTAP1_ERR_INVALID_LEN);
+        }
+    }
 
-        if (allowList_len > 0) {
-            for (size_t e = 0; e < allowList_len; e++) {
-                if (allowList[e].type.present == false || allowList[e].id.present == false) {
-                    CBOR_ERROR(CTAP2_ERR_MISSING_PARAMETER);
-                }
-                if (strcmp(allowList[e].type.data, "public-key") != 0) {
-                    continue;
-                }
-                if (credential_load(allowList[e].id.data, allowList[e].id.len, rp_id_hash, &creds[creds_len]) != 0) {
-                    credential_free(&creds[creds_len]);
-                }
-                else {
-                    creds_len++;
-                    silent = false; // If we are able to load a credential, we are not silent
-                    // Even we provide allowList, we need to check if the credential is resident
-                    if (!resident) {
-                        for (int i = 0; i < MAX_RESIDENT_CREDENTIALS && creds_len < MAX_CREDENTIAL_COUNT_IN_LIST; i++) {
-                            file_t *ef = search_dynamic_file((uint16_t)(EF_CRED + i));
-                            if (!file_has_data(ef) || memcmp(file_get_data(ef), rp_id_hash, 32) != 0) {
-                                continue;
-                            }
-                            if (memcmp(file_get_data(ef) + 32, allowList[e].id.data, allowList[e].id.len) == 0) {
-                                resident = true;
-                                break;
-                            }
+    bool silent = (up == false && uv == false);
+
+    if (allowList_len > 0) {
+        for (size_t e = 0; e < allowList_len; e++) {
+            if (allowList[e].type.present == false || allowList[e].id.present == false) {
+                CBOR_ERROR(CTAP2_ERR_MISSING_PARAMETER);
+            }
+            if (!CBOR_TEXT_EQUAL(allowList[e].type, "public-key")) {
+                continue;
+            }
+            if (credential_load(allowList[e].id.data, allowList[e].id.len, rp_id_hash, &creds[creds_len]) != 0) {
+                credential_free(&creds[creds_len]);
+            }
+            else {
+                creds_slot[creds_len] = GA_NO_SLOT;
+                creds_len++;
+                silent = false; // If we are able to load a credential, we are not silent
+                // Even we provide allowList, we need to check if the credential is resident
+                if (!resident) {
+                    for (int i = 0; i < MAX_RESIDENT_CREDENTIALS && creds_len < MAX_CREDENTIAL_COUNT_IN_LIST; i++) {
+                        file_t *ef = search_dynamic_file((uint16_t)(EF_CRED + i));
+                        if (!file_has_data(ef) || memcmp(file_get_data(ef), rp_id_hash, 32) != 0) {
+                            continue;
                         }
-                        if (resident) {
+                        if (memcmp(file_get_data(ef) + 32, allowList[e].id.data, allowList[e].id.len) == 0) {
+                            resident = true;
                             break;
                         }
                     }
+                    if (resident) {
+                        break;
+                    }
                 }
             }
         }
-        else {
-            for (int i = 0; i < MAX_RESIDENT_CREDENTIALS && creds_len < MAX_CREDENTIAL_COUNT_IN_LIST; i++) {
-                file_t *ef = search_dynamic_file((uint16_t)(EF_CRED + i));
-                if (!file_has_data(ef) || memcmp(file_get_data(ef), rp_id_hash, 32) != 0) {
+    }
+    else {
+        for (int i = 0; i < MAX_RESIDENT_CREDENTIALS && creds_len < MAX_CREDENTIAL_COUNT_IN_LIST; i++) {
+            file_t *ef = search_dynamic_file((uint16_t)(EF_CRED + i));
+            if (!file_has_data(ef) || memcmp(file_get_data(ef), rp_id_hash, 32) != 0) {
+                continue;
+            }
+            int ret = credential_load(file_get_data(ef) + 32, file_get_size(ef) - 32, rp_id_hash,  &creds[creds_len]);
+            if (ret != 0) {
+                credential_free(&creds[creds_len]);
+            }
+            else {
+                creds_slot[creds_len] = (uint16_t)i;
+                creds_len++;
+                silent = false; // If we are able to load a credential, we are not silent
+            }
+        }
+        resident = true;
+    }
+    for (size_t i = 0; i < creds_len; i++) {
+        if (creds[i].present == true) {
+            if (creds[i].extensions.present == true) {
+                if (creds[i].extensions.credProtect == CRED_PROT_UV_REQUIRED && !(flags & FIDO2_AUT_FLAG_UV)) {
+                    credential_free(&creds[i]);
                     continue;
                 }
-                int ret = credential_load(file_get_data(ef) + 32, file_get_size(ef) - 32, rp_id_hash,  &creds[creds_len]);
-                if (ret != 0) {
-                    credential_free(&creds[creds_len]);
-                }
-                else {
-                    creds_len++;
-                    silent = false; // If we are able to load a credential, we are not silent
+                else if (creds[i].extensions.credProtect == CRED_PROT_UV_OPTIONAL_WITH_LIST &&
+                         resident == true && !(flags & FIDO2_AUT_FLAG_UV)) {
+                    credential_free(&creds[i]);
+                    continue;
                 }
             }
-            resident = true;
+            if (numberOfCredentials != i) {
+                creds[numberOfCredentials] = creds[i];
+                creds_slot[numberOfCredentials] = creds_slot[i];
+                memset(&creds[i], 0, sizeof(Credential));
+            }
+            numberOfCredentials++;
         }
-        for (size_t i = 0; i < creds_len; i++) {
-            if (creds[i].present == true) {
-                if (creds[i].extensions.present == true) {
-                    if (creds[i].extensions.credProtect == CRED_PROT_UV_REQUIRED && !(flags & FIDO2_AUT_FLAG_UV)) {
-                        credential_free(&creds[i]);
-                    }
-                    else if (creds[i].extensions.credProtect == CRED_PROT_UV_OPTIONAL_WITH_LIST &&
-                             resident == true && !(flags & FIDO2_AUT_FLAG_UV)) {
-                        credential_free(&creds[i]);
-                    }
-                    else {
-                        if (numberOfCredentials != i) {
-                            creds[numberOfCredentials++] = creds[i];
-                        }
-                        else {
-                            numberOfCredentials++;
-                        }
-                    }
+    }
+    if (numberOfCredentials == 0) {
+        if (silent && allowList_len > 0) {
+            for (size_t e = 0; e < allowList_len; e++) {
+                if (allowList[e].type.present == false || allowList[e].id.present == false) {
+                    CBOR_ERROR(CTAP2_ERR_MISSING_PARAMETER);
                 }
-                else {
-                    if (numberOfCredentials != i) {
-                        creds[numberOfCredentials++] = creds[i];
-                    }
-                    else {
-                        numberOfCredentials++;
-                    }
+                if (!CBOR_TEXT_EQUAL(allowList[e].type, "public-key")) {
+                    continue;
+                }
+                if (credential_verify(allowList[e].id.data, allowList[e].id.len, rp_id_hash, true) == 0) {
+                    numberOfCredentials++;
                 }
             }
         }
         if (numberOfCredentials == 0) {
-            if (silent && allowList_len > 0) {
-                for (size_t e = 0; e < allowList_len; e++) {
-                    if (allowList[e].type.present == false || allowList[e].id.present == false) {
-                        CBOR_ERROR(CTAP2_ERR_MISSING_PARAMETER);
-                    }
-                    if (strcmp(allowList[e].type.data, "public-key") != 0) {
-                        continue;
-                    }
-                    if (credential_verify(allowList[e].id.data, allowList[e].id.len, rp_id_hash, true) == 0) {
-                        numberOfCredentials++;
-                    }
-                }
-            }
-            if (numberOfCredentials == 0) {
-                CBOR_ERROR(CTAP2_ERR_NO_CREDENTIALS);
-            }
+            CBOR_ERROR(CTAP2_ERR_NO_CREDENTIALS);
         }
+    }
 
-        if (!silent) {
-            for (int i = 0; i < numberOfCredentials; i++) {
-                for (int j = i + 1; j < numberOfCredentials; j++) {
-                    if (creds[j].creation > creds[i].creation) {
-                        Credential tmp = creds[j];
-                        creds[j] = creds[i];
-                        creds[i] = tmp;
-                    }
+    if (!silent) {
+        for (int i = 0; i < numberOfCredentials; i++) {
+            for (int j = i + 1; j < numberOfCredentials; j++) {
+                if (creds[j].creation > creds[i].creation) {
+                    Credential tmp = creds[j];
+                    creds[j] = creds[i];
+                    creds[i] = tmp;
+                    uint16_t tmp_slot = creds_slot[j];
+                    creds_slot[j] = creds_slot[i];
+                    creds_slot[i] = tmp_slot;
                 }
             }
         }
+    }
 
-        if (options.up == ptrue || options.present == false || options.up == NULL) { //9.1
-            if (pinUvAuthParam.present == true) {
-                if (getUserPresentFlagValue() == false) {
-                    if (check_user_presence() == false) {
-                        CBOR_ERROR(CTAP2_ERR_OPERATION_DENIED);
-                    }
+    if (options.up == ptrue || options.present == false || options.up == NULL) { //9.1
+        if (req.pinUvAuthParam.present == true) {
+            if (getUserPresentFlagValue() == false) {
+                if (check_user_presence(rp_id_hash) == false) {
+                    CBOR_ERROR(CTAP2_ERR_OPERATION_DENIED);
                 }
             }
-            else {
-                if (!(flags & FIDO2_AUT_FLAG_UP)) {
-                    if (check_user_presence() == false) {
-                        CBOR_ERROR(CTAP2_ERR_OPERATION_DENIED);
-                    }
+        }
+        else {
+            if (!(flags & FIDO2_AUT_FLAG_UP)) {
+                if (check_user_presence(rp_id_hash) == false) {
+                    CBOR_ERROR(CTAP2_ERR_OPERATION_DENIED);
                 }
             }
-            flags |= FIDO2_AUT_FLAG_UP;
-            clearUserPresentFlag();
-            clearUserVerifiedFlag();
-            clearPinUvAuthTokenPermissionsExceptLbw();
         }
+        flags |= FIDO2_AUT_FLAG_UP;
+        clearUserPresentFlag();
+        clearUserVerifiedFlag();
+        clearPinUvAuthTokenPermissionsExceptLbw();
+    }
 
-        if (extensions.largeBlobKey == pfalse) {
-            CBOR_ERROR(CTAP2_ERR_INVALID_OPTION);
-        }
+    if (extensions.largeBlobKey == pfalse) {
+        CBOR_ERROR(CTAP2_ERR_INVALID_OPTION);
+    }
+
+    if (silent && !resident) {
+        // Silent authentication, do nothing
+    }
+    else {
+        selcred = &creds[0];
+    }
 
-        if (silent && !resident) {
-            // Silent authentication, do nothing
+    memcpy(gan.rp_id_hash, rp_id_hash, 32);
+    gan.flags = flags;
+    gan.resident = resident;
+    gan.numberOfCredentials = numberOfCredentials;
+    gan.allowList_len = allowList_len;
+    gan.extensions = extensions;
+    gan.credBlob = credBlob;
+    if (options.up == pfalse) {
+        gan.extensions.hmac_secret = NULL;
+    }
+    if (selcred && gan.extensions.present == true && gan.extensions.hmac_secret == ptrue) {
+        mbedtls_ecp_point Qp;
+        mbedtls_ecp_point_init(&Qp);
+        mbedtls_mpi_lset(&Qp.Z, 1);
+        if (mbedtls_mpi_read_binary(&Qp.X, kax.data, kax.len) != 0) {
+            mbedtls_ecp_point_free(&Qp);
+            CBOR_ERROR(CTAP1_ERR_INVALID_PARAMETER);
+        }
+        if (mbedtls_mpi_read_binary(&Qp.Y, kay.data, kay.len) != 0) {
+            mbedtls_ecp_point_free(&Qp);
+            CBOR_ERROR(CTAP1_ERR_INVALID_PARAMETER);
+        }
+        int ret = ecdh((uint8_t)hmacSecretPinUvAuthProtocol, &Qp, gan.sharedSecret);
+        mbedtls_ecp_point_free(&Qp);
+        if (ret != 0) {
+            CBOR_ERROR(CTAP1_ERR_INVALID_PARAMETER);
         }
-        else {
-            selcred = &creds[0];
-            if (numberOfCredentials > 1) {
-                asserted = true;
-                residentx = resident;
-                for (int i = 0; i < MAX_CREDENTIAL_COUNT_IN_LIST; i++) {
-                    credsx[i] = creds[i];
-                }
-                numberOfCredentialsx = numberOfCredentials;
-                datax = (uint8_t *) calloc(1, len);
-                memcpy(datax, data, len);
-                lenx = len;
-                flagsx = flags;
-                timerx = board_millis();
-                credentialCounter = 1;
-            }
+        if (verify((uint8_t)hmacSecretPinUvAuthProtocol, gan.sharedSecret, salt_enc.data, (uint16_t)salt_enc.len, salt_auth.data) != 0) {
+            CBOR_ERROR(CTAP2_ERR_EXTENSION_FIRST);
         }
+        if (decrypt((uint8_t)hmacSecretPinUvAuthProtocol, gan.sharedSecret, salt_enc.data, (uint16_t)salt_enc.len, gan.salt_dec) != 0) {
+            CBOR_ERROR(CTAP1_ERR_INVALID_PARAMETER);
+        }
+        gan.hmacSecretPinUvAuthProtocol = (uint8_t)hmacSecretPinUvAuthProtocol;
+        gan.salt_len = salt_enc.len;
+    }
+
+    CBOR_CHECK(get_assertion_encode(selcred, req.clientDataHash.data, req.clientDataHash.len, false));
+
+    if (selcred && numberOfCredentials > 1) {
+        // Keep only where to reload the remaining credentials from
+        for (int i = 1; i < numberOfCredentials; i++) {
+            gan.slot[i] = creds_slot[i];
+            if (creds_slot[i] == GA_NO_SLOT) {
+                gan.id[i] = creds[i].id;
+                memset(&creds[i].id, 0, sizeof(creds[i].id));
+            }
+        }
+        gan.clientDataHash.data = (uint8_t *) calloc(1, req.clientDataHash.len);
+        if (!gan.clientDataHash.data) {
+            CBOR_ERROR(CTAP1_ERR_OTHER);
+        }
+        memcpy(gan.clientDataHash.data, req.clientDataHash.data, req.clientDataHash.len);
+        gan.clientDataHash.len = req.clientDataHash.len;
+        gan.clientDataHash.present = true;
+        gan.counter = 1;
+        gan.timer = fido_millis();
     }
     else {
-        resident = residentx;
-        numberOfCredentials = numberOfCredentialsx;
-        flags = flagsx;
-        selcred = &credsx[credentialCounter];
+        get_assertion_next_clear();
+    }
+err:
+    CBOR_FREE_BYTE_STRING(req.clientDataHash);
+    CBOR_FREE_BYTE_STRING(req.pinUvAuthParam);
+    CBOR_FREE_BYTE_STRING(req.rpId);
+    CBOR_FREE_BYTE_STRING(kax);
+    CBOR_FREE_BYTE_STRING(kay);
+    CBOR_FREE_BYTE_STRING(salt_enc);
+    CBOR_FREE_BYTE_STRING(salt_auth);
+    for (int i = 0; i < MAX_CREDENTIAL_COUNT_IN_LIST; i++) {
+        credential_free(&creds[i]);
     }
 
+    for (size_t m = 0; m < MAX_CREDENTIAL_COUNT_IN_LIST; m++) {
+        CBOR_FREE_BYTE_STRING(allowList[m].type);
+        CBOR_FREE_BYTE_STRING(allowList[m].id);
+        for (size_t n = 0; n < 8; n++) {
+            CBOR_FREE_BYTE_STRING(allowList[m].transports[n]);
+        }
+    }
+    if (error != CborNoError) {
+        get_assertion_next_clear();
+        if (error == CborErrorImproperValue) {
+            return CTAP2_ERR_CBOR_UNEXPECTED_TYPE;
+        }
+        return error;
+    }
+    return 0;
+}
+
+static int get_assertion_encode(Credential *selcred, const uint8_t *clientDataHash, size_t clientDataHash_len, bool next) {
+    size_t resp_size = 0;
+    CborEncoder encoder, mapEncoder, mapEncoder2;
+    CborError error = CborNoError;
+    uint8_t *aut_data = NULL;
+    uint8_t flags = gan.flags;
     int ret = 0;
     uint8_t largeBlobKey[32] = {0};
     if (selcred) {
-        if (extensions.largeBlobKey == ptrue && selcred->extensions.largeBlobKey == ptrue) {
+        if (gan.extensions.largeBlobKey == ptrue && selcred->extensions.largeBlobKey == ptrue) {
             ret = credential_derive_large_blob_key(selcred->id.data, selcred->id.len, largeBlobKey);
             if (ret != 0) {
                 CBOR_ERROR(CTAP2_ERR_PROCESSING);
@@ -461,26 +567,28 @@ int cbor_get_assertion(const uint8_t *data, size_t len, bool next) {
         }
     }
 
-    size_t ext_len = 0;
-    uint8_t ext[512] = {0};
-    if (selcred && extensions.present == true) {
-        cbor_encoder_init(&encoder, ext, sizeof(ext), 0);
+    // authData is laid out in place: rpIdHash | flags | signCount | extensions
+    const size_t aut_data_max = 32 + 1 + 4 + 512;
+    size_t aut_data_len = 32 + 1 + 4;
+    aut_data = (uint8_t *) cbor_arena_alloc(aut_data_max + clientDataHash_len);
+    if (!aut_data) {
+        CBOR_ERROR(CTAP1_ERR_OTHER);
+    }
+    if (selcred && gan.extensions.present == true) {
+        cbor_encoder_init(&encoder, aut_data + aut_data_len, aut_data_max - aut_data_len, 0);
         int l = 0;
-        if (options.up == pfalse) {
-            extensions.hmac_secret = NULL;
-        }
-        if (extensions.hmac_secret == ptrue) {
+        if (gan.extensions.hmac_secret == ptrue) {
             l++;
         }
-        if (credBlob == ptrue) {
+        if (gan.credBlob == ptrue) {
             l++;
         }
-        if (extensions.thirdPartyPayment == ptrue) {
+        if (gan.extensions.thirdPartyPayment == ptrue) {
             l++;
         }
         if (l > 0) {
             CBOR_CHECK(cbor_encoder_create_map(&encoder, &mapEncoder, l));
-            if (credBlob == ptrue) {
+            if (gan.credBlob == ptrue) {
                 CBOR_CHECK(cbor_encode_text_stringz(&mapEncoder, "credBlob"));
                 if (selcred->extensions.credBlob.present == true) {
                     CBOR_CHECK(cbor_encode_byte_string(&mapEncoder, selcred->extensions.credBlob.data,
@@ -490,42 +598,11 @@ int cbor_get_assertion(const uint8_t *data, size_t len, bool next) {
                     CBOR_CHECK(cbor_encode_byte_string(&mapEncoder, NULL, 0));
                 }
             }
-            if (extensions.hmac_secret == ptrue) {
-
+            if (gan.extensions.hmac_secret == ptrue) {
                 CBOR_CHECK(cbor_encode_text_stringz(&mapEncoder, "hmac-secret"));
-
-                uint8_t sharedSecret[64] = {0};
-                mbedtls_ecp_point Qp;
-                mbedtls_ecp_point_init(&Qp);
-                mbedtls_mpi_lset(&Qp.Z, 1);
-                if (mbedtls_mpi_read_binary(&Qp.X, kax.data, kax.len) != 0) {
-                    mbedtls_ecp_point_free(&Qp);
-                    CBOR_ERROR(CTAP1_ERR_INVALID_PARAMETER);
-                }
-                if (mbedtls_mpi_read_binary(&Qp.Y, kay.data, kay.len) != 0) {
-                    mbedtls_ecp_point_free(&Qp);
-                    CBOR_ERROR(CTAP1_ERR_INVALID_PARAMETER);
-                }
-                ret = ecdh((uint8_t)hmacSecretPinUvAuthProtocol, &Qp, sharedSecret);
-                mbedtls_ecp_point_free(&Qp);
-                if (ret != 0) {
-                    mbedtls_platform_zeroize(sharedSecret, sizeof(sharedSecret));
-                    CBOR_ERROR(CTAP1_ERR_INVALID_PARAMETER);
-                }
-                if (verify((uint8_t)hmacSecretPinUvAuthProtocol, sharedSecret, salt_enc.data, (uint16_t)salt_enc.len, salt_auth.data) != 0) {
-                    mbedtls_platform_zeroize(sharedSecret, sizeof(sharedSecret));
-                    CBOR_ERROR(CTAP2_ERR_EXTENSION_FIRST);
-                }
-                uint8_t salt_dec[64] = {0}, poff = ((uint8_t)hmacSecretPinUvAuthProtocol - 1) * IV_SIZE;
-                ret = decrypt((uint8_t)hmacSecretPinUvAuthProtocol, sharedSecret, salt_enc.data, (uint16_t)salt_enc.len, salt_dec);
-                if (ret != 0) {
-                    mbedtls_platform_zeroize(sharedSecret, sizeof(sharedSecret));
-                    CBOR_ERROR(CTAP1_ERR_INVALID_PARAMETER);
-                }
-                uint8_t cred_random[64] = {0}, *crd = NULL;
+                uint8_t cred_random[64] = {0}, *crd = NULL, poff = (gan.hmacSecretPinUvAuthProtocol - 1) * IV_SIZE;
                 ret = credential_derive_hmac_key(selcred->id.data, selcred->id.len, cred_random);
                 if (ret != 0) {
-                    mbedtls_platform_zeroize(sharedSecret, sizeof(sharedSecret));
                     CBOR_ERROR(CTAP1_ERR_INVALID_PARAMETER);
                 }
                 if (flags & FIDO2_AUT_FLAG_UV) {
@@ -535,14 +612,14 @@ int cbor_get_assertion(const uint8_t *data, size_t len, bool next) {
                     crd = cred_random;
                 }
                 uint8_t out1[64] = {0}, hmac_res[80] = {0};
-                mbedtls_md_hmac(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), crd, 32, salt_dec, 32, out1);
-                if ((uint8_t)salt_enc.len == 64 + poff) {
-                    mbedtls_md_hmac(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), crd, 32, salt_dec + 32, 32, out1 + 32);
+                mbedtls_md_hmac(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), crd, 32, gan.salt_dec, 32, out1);
+                if ((uint8_t)gan.salt_len == 64 + poff) {
+                    mbedtls_md_hmac(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), crd, 32, gan.salt_dec + 32, 32, out1 + 32);
                 }
-                encrypt((uint8_t)hmacSecretPinUvAuthProtocol, sharedSecret, out1, (uint16_t)(salt_enc.len - poff), hmac_res);
-                CBOR_CHECK(cbor_encode_byte_string(&mapEncoder, hmac_res, salt_enc.len));
+                encrypt(gan.hmacSecretPinUvAuthProtocol, gan.sharedSecret, out1, (uint16_t)(gan.salt_len - poff), hmac_res);
+                CBOR_CHECK(cbor_encode_byte_string(&mapEncoder, hmac_res, gan.salt_len));
             }
-            if (extensions.thirdPartyPayment == ptrue) {
+            if (gan.extensions.thirdPartyPayment == ptrue) {
                 CBOR_CHECK(cbor_encode_text_stringz(&mapEncoder, "thirdPartyPayment"));
                 if (selcred->extensions.thirdPartyPayment == ptrue) {
                     CBOR_CHECK(cbor_encode_boolean(&mapEncoder, true));
@@ -553,56 +630,42 @@ int cbor_get_assertion(const uint8_t *data, size_t len, bool next) {
             }
 
             CBOR_CHECK(cbor_encoder_close_container(&encoder, &mapEncoder));
-            ext_len = cbor_encoder_get_buffer_size(&encoder, ext);
+            aut_data_len += cbor_encoder_get_buffer_size(&encoder, aut_data + aut_data_len);
             flags |= FIDO2_AUT_FLAG_ED;
         }
     }
 
     uint32_t ctr = get_sign_counter();
 
-    size_t aut_data_len = 32 + 1 + 4 + ext_len;
-    aut_data = (uint8_t *) calloc(1, aut_data_len + clientDataHash.len);
     uint8_t *pa = aut_data;
-    memcpy(pa, rp_id_hash, 32); pa += 32;
+    memcpy(pa, gan.rp_id_hash, 32); pa += 32;
     *pa++ = flags;
     pa += put_uint32_t_be(ctr, pa);
-    memcpy(pa, ext, ext_len); pa += ext_len;
-    if ((size_t)(pa - aut_data) != aut_data_len) {
-        CBOR_ERROR(CTAP1_ERR_OTHER);
-    }
 
-    memcpy(pa, clientDataHash.data, clientDataHash.len);
     uint8_t hash[64] = {0}, sig[MBEDTLS_ECDSA_MAX_LEN] = {0};
-    const mbedtls_md_info_t *md = mbedtls_md_info_from_type(MBEDTLS_MD_SHA256);
+    const mbedtls_md_info_t *md = NULL;
     mbedtls_ecp_keypair ekey;
     mbedtls_ecp_keypair_init(&ekey);
     size_t olen = 0;
     if (selcred) {
         ret = fido_load_key((int)selcred->curve, selcred->id.data, &ekey);
         if (ret != 0) {
-            if (derive_key(rp_id_hash, false, selcred->id.data, MBEDTLS_ECP_DP_SECP256R1, &ekey) != 0) {
+            if (derive_key(gan.rp_id_hash, false, selcred->id.data, MBEDTLS_ECP_DP_SECP256R1, &ekey) != 0) {
                 mbedtls_ecp_keypair_free(&ekey);
                 CBOR_ERROR(CTAP1_ERR_OTHER);
             }
         }
-        if (ekey.grp.id == MBEDTLS_ECP_DP_SECP384R1) {
-            md = mbedtls_md_info_from_type(MBEDTLS_MD_SHA384);
-        }
-        else if (ekey.grp.id == MBEDTLS_ECP_DP_SECP521R1) {
-            md = mbedtls_md_info_from_type(MBEDTLS_MD_SHA512);
-        }
-#ifdef MBEDTLS_EDDSA_C
-        else if (ekey.grp.id == MBEDTLS_ECP_DP_ED25519) {
-            md = NULL;
-        }
-#endif
+        md = fido_sig_md(ekey.grp.id);
         if (md != NULL) {
-            ret = mbedtls_md(md, aut_data, aut_data_len + clientDataHash.len, hash);
-            ret = mbedtls_ecdsa_write_signature(&ekey, mbedtls_md_get_type(md), hash, mbedtls_md_get_size(md), sig, sizeof(sig), &olen, random_gen, NULL);
+            ret = fido_sig_hash(md, aut_data, aut_data_len, clientDataHash, clientDataHash_len, hash);
+            if (ret == 0) {
+                ret = mbedtls_ecdsa_write_signature(&ekey, mbedtls_md_get_type(md), hash, mbedtls_md_get_size(md), sig, sizeof(sig), &olen, random_gen, NULL);
+            }
         }
 #ifdef MBEDTLS_EDDSA_C
         else {
-            ret = mbedtls_eddsa_write_signature(&ekey, aut_data, aut_data_len + clientDataHash.len, sig, sizeof(sig), &olen, MBEDTLS_EDDSA_PURE, NULL, 0, random_gen, NULL);
+            memcpy(aut_data + aut_data_len, clientDataHash, clientDataHash_len);
+            ret = mbedtls_eddsa_write_signature(&ekey, aut_data, aut_data_len + clientDataHash_len, sig, sizeof(sig), &olen, MBEDTLS_EDDSA_PURE, NULL, 0, random_gen, NULL);
         }
 #endif
     }
@@ -620,13 +683,13 @@ int cbor_get_assertion(const uint8_t *data, size_t len, bool next) {
     if (selcred && selcred->opts.present == true && selcred->opts.rk == ptrue) {
         lfields++;
     }
-    if (numberOfCredentials > 1 && next == false && (!resident || allowList_len <= 1)) {
+    if (gan.numberOfCredentials > 1 && next == false && (!gan.resident || gan.allowList_len <= 1)) {
         lfields++;
     }
-    if (selcred && extensions.largeBlobKey == ptrue && selcred->extensions.largeBlobKey == ptrue) {
+    if (selcred && gan.extensions.largeBlobKey == ptrue && selcred->extensions.largeBlobKey == ptrue) {
         lfields++;
     }
-    cbor_encoder_init(&encoder, ctap_resp->init.data + 1, CTAP_MAX_CBOR_PAYLOAD, 0);
+    cbor_encoder_init(&encoder, cbor_resp, cbor_resp_max, 0);
     CBOR_CHECK(cbor_encoder_create_map(&encoder, &mapEncoder, lfields));
 
     CBOR_CHECK(cbor_encode_uint(&mapEncoder, 0x01));
@@ -650,7 +713,7 @@ int cbor_get_assertion(const uint8_t *data, size_t len, bool next) {
     if (selcred && selcred->opts.present == true && selcred->opts.rk == ptrue) {
         CBOR_CHECK(cbor_encode_uint(&mapEncoder, 0x04));
         uint8_t lu = 1;
-        if (numberOfCredentials > 1 && allowList_len == 0) {
+        if (gan.numberOfCredentials > 1 && gan.allowList_len == 0) {
             if (selcred->userName.present == true) {
                 lu++;
             }
@@ -662,7 +725,7 @@ int cbor_get_assertion(const uint8_t *data, size_t len, bool next) {
         CBOR_CHECK(cbor_encode_text_stringz(&mapEncoder2, "id"));
         CBOR_CHECK(cbor_encode_byte_string(&mapEncoder2, selcred->userId.data,
                                            selcred->userId.len));
-        if (numberOfCredentials > 1 && allowList_len == 0) {
+        if (gan.numberOfCredentials > 1 && gan.allowList_len == 0) {
             if (selcred->userName.present == true) {
                 CBOR_CHECK(cbor_encode_text_stringz(&mapEncoder2, "name"));
                 CBOR_CHECK(cbor_encode_text_stringz(&mapEncoder2, selcred->userName.data));
@@ -674,44 +737,22 @@ int cbor_get_assertion(const uint8_t *data, size_t len, bool next) {
         }
         CBOR_CHECK(cbor_encoder_close_container(&mapEncoder, &mapEncoder2));
     }
-    if (numberOfCredentials > 1 && next == false && (!resident || allowList_len <= 1)) {
+    if (gan.numberOfCredentials > 1 && next == false && (!gan.resident || gan.allowList_len <= 1)) {
         CBOR_CHECK(cbor_encode_uint(&mapEncoder, 0x05));
-        CBOR_CHECK(cbor_encode_uint(&mapEncoder, numberOfCredentials));
+        CBOR_CHECK(cbor_encode_uint(&mapEncoder, gan.numberOfCredentials));
     }
-    if (selcred && extensions.largeBlobKey == ptrue && selcred->extensions.largeBlobKey == ptrue) {
+    if (selcred && gan.extensions.largeBlobKey == ptrue && selcred->extensions.largeBlobKey == ptrue) {
         CBOR_CHECK(cbor_encode_uint(&mapEncoder, 0x07));
         CBOR_CHECK(cbor_encode_byte_string(&mapEncoder, largeBlobKey, sizeof(largeBlobKey)));
     }
     mbedtls_platform_zeroize(largeBlobKey, sizeof(largeBlobKey));
     CBOR_CHECK(cbor_encoder_close_container(&encoder, &mapEncoder));
-    resp_size = cbor_encoder_get_buffer_size(&encoder, ctap_resp->init.data + 1);
+    resp_size = cbor_encoder_get_buffer_size(&encoder, cbor_resp);
     ctr++;
     file_put_data(ef_counter, (uint8_t *) &ctr, sizeof(ctr));
     low_flash_available();
 err:
-    CBOR_FREE_BYTE_STRING(clientDataHash);
-    CBOR_FREE_BYTE_STRING(pinUvAuthParam);
-    CBOR_FREE_BYTE_STRING(rpId);
-    CBOR_FREE_BYTE_STRING(kax);
-    CBOR_FREE_BYTE_STRING(kay);
-    CBOR_FREE_BYTE_STRING(salt_enc);
-    CBOR_FREE_BYTE_STRING(salt_auth);
-    if (asserted == false) {
-        for (int i = 0; i < MAX_CREDENTIAL_COUNT_IN_LIST; i++) {
-            credential_free(&creds[i]);
-        }
-    }
-
-    for (size_t m = 0; m < MAX_CREDENTIAL_COUNT_IN_LIST; m++) {
-        CBOR_FREE_BYTE_STRING(allowList[m].type);
-        CBOR_FREE_BYTE_STRING(allowList[m].id);
-        for (size_t n = 0; n < 8; n++) {
-            CBOR_FREE_BYTE_STRING(allowList[m].transports[n]);
-        }
-    }
-    if (aut_data) {
-        free(aut_data);
-    }
+    mbedtls_platform_zeroize(largeBlobKey, sizeof(largeBlobKey));
     if (error != CborNoError) {
         if (error == CborErrorImproperValue) {
             return CTAP2_ERR_CBOR_UNEXPECTED_TYPE;
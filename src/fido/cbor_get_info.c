@@ -15,6 +15,8 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define CBOR_FILE_ID 6
+
 #include "ctap2_cbor.h"
 #include "hid/ctap_hid.h"
 #include "fido.h"
@@ -23,10 +25,32 @@
 #include "apdu.h"
 #include "version.h"
 
+#ifndef GET_INFO_CACHE_SIZE
+#define GET_INFO_CACHE_SIZE 512
+#endif
+
+static uint8_t get_info_cache[GET_INFO_CACHE_SIZE];
+static uint16_t get_info_cache_len = 0, get_info_auv_off = 0;
+
+void get_info_invalidate() {
+    get_info_cache_len = 0;
+}
+
+static bool get_info_always_uv() {
+    return file_has_data(ef_pin) && (get_opts() & FIDO2_OPT_AUV || !getUserVerifiedFlagValue());
+}
+
 int cbor_get_info() {
+    if (get_info_cache_len > 0 && get_info_cache_len <= cbor_resp_max) {
+        memcpy(cbor_resp, get_info_cache, get_info_cache_len);
+        // alwaysUv follows the volatile UV flag, the rest only changes through get_info_invalidate()
+        cbor_resp[get_info_auv_off] = get_info_always_uv() ? 0xF5 : 0xF4;
+        res_APDU_size = get_info_cache_len;
+        return 0;
+    }
     CborEncoder encoder, mapEncoder, arrayEncoder, mapEncoder2;
     CborError error = CborNoError;
-    cbor_encoder_init(&encoder, ctap_resp->init.data + 1, CTAP_MAX_CBOR_PAYLOAD, 0);
+    cbor_encoder_init(&encoder, cbor_resp, cbor_resp_max, 0);
     CBOR_CHECK(cbor_encoder_create_map(&encoder, &mapEncoder, 15));
 
     CBOR_CHECK(cbor_encode_uint(&mapEncoder, 0x01));
@@ -56,12 +80,8 @@ int cbor_get_info() {
     CBOR_CHECK(cbor_encode_text_stringz(&arrayEncoder, "rk"));
     CBOR_CHECK(cbor_encode_boolean(&arrayEncoder, true));
     CBOR_CHECK(cbor_encode_text_stringz(&arrayEncoder, "alwaysUv"));
-    if (file_has_data(ef_pin) && (get_opts() & FIDO2_OPT_AUV || !getUserVerifiedFlagValue())) {
-        CBOR_CHECK(cbor_encode_boolean(&arrayEncoder, true));
-    }
-    else {
-        CBOR_CHECK(cbor_encode_boolean(&arrayEncoder, false));
-    }
+    get_info_auv_off = (uint16_t)cbor_encoder_get_buffer_size(&arrayEncoder, cbor_resp);
+    CBOR_CHECK(cbor_encode_boolean(&arrayEncoder, get_info_always_uv()));
     CBOR_CHECK(cbor_encode_text_stringz(&arrayEncoder, "credMgmt"));
     CBOR_CHECK(cbor_encode_boolean(&arrayEncoder, true));
     CBOR_CHECK(cbor_encode_text_stringz(&arrayEncoder, "authnrCfg"));
@@ -162,6 +182,10 @@ err:
     if (error != CborNoError) {
         return -CTAP2_ERR_INVALID_CBOR;
     }
-    res_APDU_size = (uint16_t)cbor_encoder_get_buffer_size(&encoder, ctap_resp->init.data + 1);
+    res_APDU_size = (uint16_t)cbor_encoder_get_buffer_size(&encoder, cbor_resp);
+    if (res_APDU_size <= sizeof(get_info_cache)) {
+        memcpy(get_info_cache, cbor_resp, res_APDU_size);
+        get_info_cache_len = res_APDU_size;
+    }
     return 0;
 }
@@ -15,7 +15,10 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define CBOR_FILE_ID 7
+
 #include "ctap2_cbor.h"
+#include "cbor_schema.h"
 #include "fido.h"
 #include "ctap.h"
 #include "hid/ctap_hid.h"
@@ -27,124 +30,108 @@
 static uint64_t expectedLength = 0, expectedNextOffset = 0;
 uint8_t temp_lba[MAX_LARGE_BLOB_SIZE];
 
+typedef struct LargeBlobsRequest {
+    uint64_t get;
+    CborByteString set;
+    uint64_t offset;
+    uint64_t length;
+    CborByteString pinUvAuthParam;
+    uint64_t pinUvAuthProtocol;
+} LargeBlobsRequest;
+
+static const cbor_schema_field_t large_blobs_schema[] = {
+    CBOR_SCHEMA_FIELD(0x01, UINT, false, LargeBlobsRequest, get),
+    CBOR_SCHEMA_FIELD(0x02, BYTES, false, LargeBlobsRequest, set),
+    CBOR_SCHEMA_FIELD(0x03, UINT, false, LargeBlobsRequest, offset),
+    CBOR_SCHEMA_FIELD(0x04, UINT, false, LargeBlobsRequest, length),
+    CBOR_SCHEMA_FIELD(0x05, BYTES, false, LargeBlobsRequest, pinUvAuthParam),
+    CBOR_SCHEMA_FIELD(0x06, UINT, false, LargeBlobsRequest, pinUvAuthProtocol),
+};
+
 int cbor_large_blobs(const uint8_t *data, size_t len) {
     CborParser parser;
-    CborValue map;
     CborEncoder encoder, mapEncoder;
     CborError error = CborNoError;
-    uint64_t get = 0, offset = UINT64_MAX, length = 0, pinUvAuthProtocol = 0;
-    CborByteString set = { 0 }, pinUvAuthParam = { 0 };
+    LargeBlobsRequest req = { .offset = UINT64_MAX };
 
-    CBOR_CHECK(cbor_parser_init(data, len, 0, &parser, &map));
-    uint64_t val_c = 1;
-    CBOR_PARSE_MAP_START(map, 1)
-    {
-        uint64_t val_u = 0;
-        CBOR_FIELD_GET_UINT(val_u, 1);
-        if (val_c <= 0 && val_c != val_u) {
-            CBOR_ERROR(CTAP2_ERR_MISSING_PARAMETER);
-        }
-        if (val_u < val_c) {
-            CBOR_ERROR(CTAP2_ERR_INVALID_CBOR);
-        }
-        val_c = val_u + 1;
-        if (val_u == 0x01) {
-            CBOR_FIELD_GET_UINT(get, 1);
-        }
-        else if (val_u == 0x02) {
-            CBOR_FIELD_GET_BYTES(set, 1);
-        }
-        else if (val_u == 0x03) {
-            CBOR_FIELD_GET_UINT(offset, 1);
-        }
-        else if (val_u == 0x04) {
-            CBOR_FIELD_GET_UINT(length, 1);
-        }
-        else if (val_u == 0x05) {
-            CBOR_FIELD_GET_BYTES(pinUvAuthParam, 1);
-        }
-        else if (val_u == 0x06) {
-            CBOR_FIELD_GET_UINT(pinUvAuthProtocol, 1);
-        }
-    }
-    CBOR_PARSE_MAP_END(map, 1);
+    CBOR_CHECK(cbor_schema_decode(&parser, data, len, large_blobs_schema, sizeof(large_blobs_schema) / sizeof(cbor_schema_field_t), &req));
 
-    if (offset == UINT64_MAX) {
+    if (req.offset == UINT64_MAX) {
         CBOR_ERROR(CTAP1_ERR_INVALID_PARAMETER);
     }
-    if (get == 0 && set.present == false) {
+    if (req.get == 0 && req.set.present == false) {
         CBOR_ERROR(CTAP1_ERR_INVALID_PARAMETER);
     }
-    if (get != 0 && set.present == true) {
+    if (req.get != 0 && req.set.present == true) {
         CBOR_ERROR(CTAP1_ERR_INVALID_PARAMETER);
     }
 
-    cbor_encoder_init(&encoder, ctap_resp->init.data + 1, CTAP_MAX_CBOR_PAYLOAD, 0);
-    if (get > 0) {
-        if (length != 0) {
+    cbor_encoder_init(&encoder, cbor_resp, cbor_resp_max, 0);
+    if (req.get > 0) {
+        if (req.length != 0) {
             CBOR_ERROR(CTAP1_ERR_INVALID_PARAMETER);
         }
-        if (length > MAX_FRAGMENT_LENGTH) {
+        if (req.length > MAX_FRAGMENT_LENGTH) {
             CBOR_ERROR(CTAP1_ERR_INVALID_LEN);
         }
-        if (offset > file_get_size(ef_largeblob)) {
+        if (req.offset > file_get_size(ef_largeblob)) {
             CBOR_ERROR(CTAP1_ERR_INVALID_PARAMETER);
         }
         CBOR_CHECK(cbor_encoder_create_map(&encoder, &mapEncoder, 1));
         CBOR_CHECK(cbor_encode_uint(&mapEncoder, 0x01));
-        CBOR_CHECK(cbor_encode_byte_string(&mapEncoder, file_get_data(ef_largeblob) + offset,
-                                           MIN(get, file_get_size(ef_largeblob) - offset)));
+        CBOR_CHECK(cbor_encode_byte_string(&mapEncoder, file_get_data(ef_largeblob) + req.offset,
+                                           MIN(req.get, file_get_size(ef_largeblob) - req.offset)));
     }
     else {
-        if (set.len > MAX_FRAGMENT_LENGTH) {
+        if (req.set.len > MAX_FRAGMENT_LENGTH) {
             CBOR_ERROR(CTAP1_ERR_INVALID_LEN);
         }
-        if (offset == 0) {
-            if (length == 0) {
+        if (req.offset == 0) {
+            if (req.length == 0) {
                 CBOR_ERROR(CTAP1_ERR_INVALID_PARAMETER);
             }
-            if (length > MAX_LARGE_BLOB_SIZE) {
+            if (req.length > MAX_LARGE_BLOB_SIZE) {
                 CBOR_ERROR(CTAP2_ERR_LARGE_BLOB_STORAGE_FULL);
             }
-            if (length < 17) {
+            if (req.length < 17) {
                 CBOR_ERROR(CTAP1_ERR_INVALID_PARAMETER);
             }
-            expectedLength = length;
+            expectedLength = req.length;
             expectedNextOffset = 0;
         }
         else {
-            if (length != 0) {
+            if (req.length != 0) {
                 CBOR_ERROR(CTAP1_ERR_INVALID_PARAMETER);
             }
         }
-        if (offset != expectedNextOffset) {
+        if (req.offset != expectedNextOffset) {
             CBOR_ERROR(CTAP1_ERR_INVALID_SEQ);
         }
-        if (pinUvAuthParam.present == false) {
+        if (req.pinUvAuthParam.present == false) {
             CBOR_ERROR(CTAP2_ERR_PUAT_REQUIRED);
         }
-        if (pinUvAuthProtocol == 0) {
+        if (req.pinUvAuthProtocol == 0) {
             CBOR_ERROR(CTAP2_ERR_MISSING_PARAMETER);
         }
         uint8_t verify_data[70] = { 0 };
         memset(verify_data, 0xff, 32);
         verify_data[32] = 0x0C;
-        put_uint32_t_le(offset, verify_data + 34);
-        mbedtls_sha256(set.data, set.len, verify_data + 38, 0);
-        if (verify((uint8_t)pinUvAuthProtocol, paut.data, verify_data, (uint16_t)sizeof(verify_data), pinUvAuthParam.data) != 0) {
+        put_uint32_t_le(req.offset, verify_data + 34);
+        mbedtls_sha256(req.set.data, req.set.len, verify_data + 38, 0);
+        if (verify((uint8_t)req.pinUvAuthProtocol, paut.data, verify_data, (uint16_t)sizeof(verify_data), req.pinUvAuthParam.data) != 0) {
             CBOR_ERROR(CTAP2_ERR_PIN_AUTH_INVALID);
         }
         if (!(paut.permissions & CTAP_PERMISSION_LBW)) {
             CBOR_ERROR(CTAP2_ERR_PIN_AUTH_INVALID);
         }
-        if (offset + set.len > expectedLength) {
+        if (req.offset + req.set.len > expectedLength) {
             CBOR_ERROR(CTAP1_ERR_INVALID_PARAMETER);
         }
-        if (offset == 0) {
+        if (req.offset == 0) {
             memset(temp_lba, 0, sizeof(temp_lba));
         }
-        memcpy(temp_lba + expectedNextOffset, set.data, set.len);
-        expectedNextOffset += set.len;
+        memcpy(temp_lba + expectedNextOffset, req.set.data, req.set.len);
+        expectedNextOffset += req.set.len;
         if (expectedNextOffset == expectedLength) {
             uint8_t sha[32];
             mbedtls_sha256(temp_lba, expectedLength - 16, sha, 0);
@@ -159,11 +146,11 @@ int cbor_large_blobs(const uint8_t *data, size_t len) {
     CBOR_CHECK(cbor_encoder_close_container(&encoder, &mapEncoder));
 
 err:
-    CBOR_FREE_BYTE_STRING(pinUvAuthParam);
-    CBOR_FREE_BYTE_STRING(set);
+    CBOR_FREE_BYTE_STRING(req.pinUvAuthParam);
+    CBOR_FREE_BYTE_STRING(req.set);
     if (error != CborNoError) {
         return -CTAP2_ERR_INVALID_CBOR;
     }
-    res_APDU_size = (uint16_t)cbor_encoder_get_buffer_size(&encoder, ctap_resp->init.data + 1);
+    res_APDU_size = (uint16_t)cbor_encoder_get_buffer_size(&encoder, cbor_resp);
     return 0;
 }
@@ -15,8 +15,12 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define CBOR_FILE_ID 8
+
 #include "cbor_make_credential.h"
 #include "ctap2_cbor.h"
+#include "cbor_schema.h"
+#include "cbor_arena.h"
 #include "hid/ctap_hid.h"
 #include "fido.h"
 #include "ctap.h"
@@ -27,11 +31,36 @@
 #include "random.h"
 #include "pico_keys.h"
 
+typedef struct MakeCredentialRequest {
+    CborByteString clientDataHash;
+    CborSchemaValue rp;
+    CborSchemaValue user;
+    CborSchemaValue pubKeyCredParams;
+    CborSchemaValue excludeList;
+    CborSchemaValue extensions;
+    CborSchemaValue options;
+    CborByteString pinUvAuthParam;
+    uint64_t pinUvAuthProtocol;
+    uint64_t enterpriseAttestation;
+} MakeCredentialRequest;
+
+static const cbor_schema_field_t make_credential_schema[] = {
+    CBOR_SCHEMA_FIELD(0x01, BYTES, true, MakeCredentialRequest, clientDataHash),
+    CBOR_SCHEMA_FIELD(0x02, MAP, true, MakeCredentialRequest, rp),
+    CBOR_SCHEMA_FIELD(0x03, MAP, true, MakeCredentialRequest, user),
+    CBOR_SCHEMA_FIELD(0x04, ARRAY, true, MakeCredentialRequest, pubKeyCredParams),
+    CBOR_SCHEMA_FIELD(0x05, ARRAY, false, MakeCredentialRequest, excludeList),
+    CBOR_SCHEMA_FIELD(0x06, MAP, false, MakeCredentialRequest, extensions),
+    CBOR_SCHEMA_FIELD(0x07, MAP, false, MakeCredentialRequest, options),
+    CBOR_SCHEMA_FIELD(0x08, BYTES, false, MakeCredentialRequest, pinUvAuthParam),
+    CBOR_SCHEMA_FIELD(0x09, UINT, false, MakeCredentialRequest, pinUvAuthProtocol),
+    CBOR_SCHEMA_FIELD(0x0A, UINT, false, MakeCredentialRequest, enterpriseAttestation),
+};
+
 int cbor_make_credential(const uint8_t *data, size_t len) {
     CborParser parser;
-    CborValue map;
     CborError error = CborNoError;
-    CborByteString clientDataHash = { 0 }, pinUvAuthParam = { 0 };
+    MakeCredentialRequest req = { 0 };
     PublicKeyCredentialRpEntity rp = { 0 };
     PublicKeyCredentialUserEntity user = { 0 };
     PublicKeyCredentialParameters pubKeyCredParams[MAX_CREDENTIAL_COUNT_IN_LIST] = { 0 };
@@ -39,7 +68,6 @@ int cbor_make_credential(const uint8_t *data, size_t len) {
     PublicKeyCredentialDescriptor excludeList[MAX_CREDENTIAL_COUNT_IN_LIST] = { 0 };
     size_t excludeList_len = 0;
     CredOptions options = { 0 };
-    uint64_t pinUvAuthProtocol = 0, enterpriseAttestation = 0;
     uint8_t *aut_data = NULL;
     size_t resp_size = 0;
     CredExtensions extensions = { 0 };
@@ -48,126 +76,114 @@ int cbor_make_credential(const uint8_t *data, size_t len) {
     options.uv = pfalse;
     //options.rk = pfalse;
 
-    CBOR_CHECK(cbor_parser_init(data, len, 0, &parser, &map));
-    uint64_t val_c = 1;
-    CBOR_PARSE_MAP_START(map, 1)
-    {
-        uint64_t val_u = 0;
-        CBOR_FIELD_GET_UINT(val_u, 1);
-        if (val_c <= 4 && val_c != val_u) {
-            CBOR_ERROR(CTAP2_ERR_MISSING_PARAMETER);
-        }
-        if (val_u < val_c) {
-            CBOR_ERROR(CTAP2_ERR_INVALID_CBOR);
-        }
-        val_c = val_u + 1;
-        if (val_u == 0x01) { // clientDataHash
-            CBOR_FIELD_GET_BYTES(clientDataHash, 1);
-        }
-        else if (val_u == 0x02) { // rp
-            CBOR_PARSE_MAP_START(_f1, 2)
-            {
-                CBOR_FIELD_GET_KEY_TEXT(2);
-                CBOR_FIELD_KEY_TEXT_VAL_TEXT(2, "id", rp.id);
-                CBOR_FIELD_KEY_TEXT_VAL_TEXT(2, "name", rp.parent.name);
+    CBOR_CHECK(cbor_schema_decode(&parser, data, len, make_credential_schema, sizeof(make_credential_schema) / sizeof(cbor_schema_field_t), &req));
+    if (req.rp.present) {
+        CBOR_PARSE_MAP_START(req.rp.value, 2)
+        {
+            CBOR_FIELD_GET_KEY_TEXT(2);
+            CBOR_FIELD_KEY_TEXT_VAL_BORROW_TEXT(2, "id", rp.id);
+            CBOR_FIELD_KEY_TEXT_VAL_BORROW_TEXT(2, "name", rp.parent.name);
+            CBOR_ADVANCE(2);
+        }
+        CBOR_PARSE_MAP_END(req.rp.value, 2);
+    }
+    if (req.user.present) {
+        CBOR_PARSE_MAP_START(req.user.value, 2)
+        {
+            CBOR_FIELD_GET_KEY_TEXT(2);
+            CBOR_FIELD_KEY_TEXT_VAL_BORROW_BYTES(2, "id", user.id);
+            CBOR_FIELD_KEY_TEXT_VAL_BORROW_TEXT(2, "name", user.parent.name);
+            CBOR_FIELD_KEY_TEXT_VAL_BORROW_TEXT(2, "displayName", user.displayName);
+            CBOR_ADVANCE(2);
+        }
+        CBOR_PARSE_MAP_END(req.user.value, 2);
+    }
+    if (req.pubKeyCredParams.present) {
+        CBOR_PARSE_ARRAY_START(req.pubKeyCredParams.value, 2)
+        {
+            if (pubKeyCredParams_len >= MAX_CREDENTIAL_COUNT_IN_LIST) {
+                CBOR_ERROR(CTAP2_ERR_LIMIT_EXCEEDED);
             }
-            CBOR_PARSE_MAP_END(_f1, 2);
-        }
-        else if (val_u == 0x03) { // user
-            CBOR_PARSE_MAP_START(_f1, 2)
+            PublicKeyCredentialParameters *pk = &pubKeyCredParams[pubKeyCredParams_len];
+            CBOR_PARSE_MAP_START(_f2, 3)
             {
-                CBOR_FIELD_GET_KEY_TEXT(2);
-                CBOR_FIELD_KEY_TEXT_VAL_BYTES(2, "id", user.id);
-                CBOR_FIELD_KEY_TEXT_VAL_TEXT(2, "name", user.parent.name);
-                CBOR_FIELD_KEY_TEXT_VAL_TEXT(2, "displayName", user.displayName);
-                CBOR_ADVANCE(2);
+                CBOR_FIELD_GET_KEY_TEXT(3);
+                CBOR_FIELD_KEY_TEXT_VAL_BORROW_TEXT(3, "type", pk->type);
+                CBOR_FIELD_KEY_TEXT_VAL_INT(3, "alg", pk->alg);
+                CBOR_ADVANCE(3);
             }
-            CBOR_PARSE_MAP_END(_f1, 2);
+            CBOR_PARSE_MAP_END(_f2, 3);
+            pubKeyCredParams_len++;
         }
-        else if (val_u == 0x04) { // pubKeyCredParams
-            CBOR_PARSE_ARRAY_START(_f1, 2)
-            {
-                PublicKeyCredentialParameters *pk = &pubKeyCredParams[pubKeyCredParams_len];
-                CBOR_PARSE_MAP_START(_f2, 3)
-                {
-                    CBOR_FIELD_GET_KEY_TEXT(3);
-                    CBOR_FIELD_KEY_TEXT_VAL_TEXT(3, "type", pk->type);
-                    CBOR_FIELD_KEY_TEXT_VAL_INT(3, "alg", pk->alg);
-                }
-                CBOR_PARSE_MAP_END(_f2, 3);
-                pubKeyCredParams_len++;
+        CBOR_PARSE_ARRAY_END(req.pubKeyCredParams.value, 2);
+    }
+    if (req.excludeList.present) {
+        CBOR_PARSE_ARRAY_START(req.excludeList.value, 2)
+        {
+            if (excludeList_len >= MAX_CREDENTIAL_COUNT_IN_LIST) {
+                CBOR_ERROR(CTAP2_ERR_LIMIT_EXCEEDED);
             }
-            CBOR_PARSE_ARRAY_END(_f1, 2);
-        }
-        else if (val_u == 0x05) { // excludeList
-            CBOR_PARSE_ARRAY_START(_f1, 2)
+            PublicKeyCredentialDescriptor *pc = &excludeList[excludeList_len];
+            CBOR_PARSE_MAP_START(_f2, 3)
             {
-                PublicKeyCredentialDescriptor *pc = &excludeList[excludeList_len];
-                CBOR_PARSE_MAP_START(_f2, 3)
-                {
-                    CBOR_FIELD_GET_KEY_TEXT(3);
-                    CBOR_FIELD_KEY_TEXT_VAL_BYTES(3, "id", pc->id);
-                    CBOR_FIELD_KEY_TEXT_VAL_TEXT(3, "type", pc->type);
-                    if (strcmp(_fd3, "transports") == 0) {
-                        CBOR_PARSE_ARRAY_START(_f3, 4)
-                        {
-                            CBOR_FIELD_GET_TEXT(pc->transports[pc->transports_len], 4);
-                            pc->transports_len++;
+                CBOR_FIELD_GET_KEY_TEXT(3);
+                CBOR_FIELD_KEY_TEXT_VAL_BORROW_BYTES(3, "id", pc->id);
+                CBOR_FIELD_KEY_TEXT_VAL_BORROW_TEXT(3, "type", pc->type);
+                if (CBOR_KEY_TEXT_IS(3, "transports")) {
+                    CBOR_PARSE_ARRAY_START(_f3, 4)
+                    {
+                        if (pc->transports_len >= sizeof(pc->transports) / sizeof(pc->transports[0])) {
+                            CBOR_ERROR(CTAP2_ERR_LIMIT_EXCEEDED);
                         }
-                        CBOR_PARSE_ARRAY_END(_f3, 4);
+                        CBOR_FIELD_BORROW_TEXT(pc->transports[pc->transports_len], 4);
+                        pc->transports_len++;
                     }
+                    CBOR_PARSE_ARRAY_END(_f3, 4);
+                }
+                else {
+                    CBOR_ADVANCE(3);
                 }
-                CBOR_PARSE_MAP_END(_f2, 3);
-                excludeList_len++;
-            }
-            CBOR_PARSE_ARRAY_END(_f1, 2);
-        }
-        else if (val_u == 0x06) { // extensions
-            extensions.present = true;
-            CBOR_PARSE_MAP_START(_f1, 2)
-            {
-                CBOR_FIELD_GET_KEY_TEXT(2);
-                CBOR_FIELD_KEY_TEXT_VAL_BOOL(2, "hmac-secret", extensions.hmac_secret);
-                CBOR_FIELD_KEY_TEXT_VAL_UINT(2, "credProtect", extensions.credProtect);
-                CBOR_FIELD_KEY_TEXT_VAL_BOOL(2, "minPinLength", extensions.minPinLength);
-                CBOR_FIELD_KEY_TEXT_VAL_BYTES(2, "credBlob", extensions.credBlob);
-                CBOR_FIELD_KEY_TEXT_VAL_BOOL(2, "largeBlobKey", extensions.largeBlobKey);
-                CBOR_FIELD_KEY_TEXT_VAL_BOOL(2, "thirdPartyPayment", extensions.thirdPartyPayment);
-                CBOR_ADVANCE(2);
-            }
-            CBOR_PARSE_MAP_END(_f1, 2);
-        }
-        else if (val_u == 0x07) { // options
-            options.present = true;
-            CBOR_PARSE_MAP_START(_f1, 2)
-            {
-                CBOR_FIELD_GET_KEY_TEXT(2);
-                CBOR_FIELD_KEY_TEXT_VAL_BOOL(2, "rk", options.rk);
-                CBOR_FIELD_KEY_TEXT_VAL_BOOL(2, "up", options.up);
-                CBOR_FIELD_KEY_TEXT_VAL_BOOL(2, "uv", options.uv);
-                CBOR_ADVANCE(2);
             }
-            CBOR_PARSE_MAP_END(_f1, 2);
-        }
-        else if (val_u == 0x08) { // pinUvAuthParam
-            CBOR_FIELD_GET_BYTES(pinUvAuthParam, 1);
-        }
-        else if (val_u == 0x09) { // pinUvAuthProtocol
-            CBOR_FIELD_GET_UINT(pinUvAuthProtocol, 1);
-        }
-        else if (val_u == 0x0A) { // enterpriseAttestation
-            CBOR_FIELD_GET_UINT(enterpriseAttestation, 1);
-        }
+            CBOR_PARSE_MAP_END(_f2, 3);
+            excludeList_len++;
+        }
+        CBOR_PARSE_ARRAY_END(req.excludeList.value, 2);
+    }
+    extensions.present = req.extensions.present;
+    if (req.extensions.present) {
+        CBOR_PARSE_MAP_START(req.extensions.value, 2)
+        {
+            CBOR_FIELD_GET_KEY_TEXT(2);
+            CBOR_FIELD_KEY_TEXT_VAL_BOOL(2, "hmac-secret", extensions.hmac_secret);
+            CBOR_FIELD_KEY_TEXT_VAL_UINT(2, "credProtect", extensions.credProtect);
+            CBOR_FIELD_KEY_TEXT_VAL_BOOL(2, "minPinLength", extensions.minPinLength);
+            CBOR_FIELD_KEY_TEXT_VAL_BORROW_BYTES(2, "credBlob", extensions.credBlob);
+            CBOR_FIELD_KEY_TEXT_VAL_BOOL(2, "largeBlobKey", extensions.largeBlobKey);
+            CBOR_FIELD_KEY_TEXT_VAL_BOOL(2, "thirdPartyPayment", extensions.thirdPartyPayment);
+            CBOR_ADVANCE(2);
+        }
+        CBOR_PARSE_MAP_END(req.extensions.value, 2);
+    }
+    options.present = req.options.present;
+    if (req.options.present) {
+        CBOR_PARSE_MAP_START(req.options.value, 2)
+        {
+            CBOR_FIELD_GET_KEY_TEXT(2);
+            CBOR_FIELD_KEY_TEXT_VAL_BOOL(2, "rk", options.rk);
+            CBOR_FIELD_KEY_TEXT_VAL_BOOL(2, "up", options.up);
+            CBOR_FIELD_KEY_TEXT_VAL_BOOL(2, "uv", options.uv);
+            CBOR_ADVANCE(2);
+        }
+        CBOR_PARSE_MAP_END(req.options.value, 2);
     }
-    CBOR_PARSE_MAP_END(map, 1);
 
     uint8_t flags = FIDO2_AUT_FLAG_AT;
     uint8_t rp_id_hash[32] = {0};
     mbedtls_sha256((uint8_t *) rp.id.data, rp.id.len, rp_id_hash, 0);
 
-    if (pinUvAuthParam.present == true) {
-        if (pinUvAuthParam.len == 0 || pinUvAuthParam.data == NULL) {
-            if (check_user_presence() == false) {
+    if (req.pinUvAuthParam.present == true) {
+        if (req.pinUvAuthParam.len == 0 || req.pinUvAuthParam.data == NULL) {
+            if (check_user_presence(NULL) == false) {
                 CBOR_ERROR(CTAP2_ERR_OPERATION_DENIED);
             }
             if (!file_has_data(ef_pin)) {
@@ -178,10 +194,10 @@ int cbor_make_credential(const uint8_t *data, size_t len) {
             }
         }
         else {
-            if (pinUvAuthProtocol == 0) {
+            if (req.pinUvAuthProtocol == 0) {
                 CBOR_ERROR(CTAP2_ERR_MISSING_PARAMETER);
             }
-            if (pinUvAuthProtocol != 1 && pinUvAuthProtocol != 2) {
+            if (req.pinUvAuthProtocol != 1 && req.pinUvAuthProtocol != 2) {
                 CBOR_ERROR(CTAP1_ERR_INVALID_PARAMETER);
             }
         }
@@ -199,7 +215,7 @@ int cbor_make_credential(const uint8_t *data, size_t len) {
         if (pubKeyCredParams[i].alg == 0) {
             CBOR_ERROR(CTAP2_ERR_INVALID_CBOR);
         }
-        if (strcmp(pubKeyCredParams[i].type.data, "public-key") != 0) {
+        if (!CBOR_TEXT_EQUAL(pubKeyCredParams[i].type, "public-key")) {
             CBOR_ERROR(CTAP2_ERR_CBOR_UNEXPECTED_TYPE);
         }
         if (pubKeyCredParams[i].alg == FIDO2_ALG_ES256) {
@@ -257,20 +273,20 @@ int cbor_make_credential(const uint8_t *data, size_t len) {
         //else if (options.up == NULL) //5.7
         //rup = ptrue;
     }
-    if (pinUvAuthParam.present == false && options.uv == pfalse && file_has_data(ef_pin)) { //8.1
+    if (req.pinUvAuthParam.present == false && options.uv == pfalse && file_has_data(ef_pin)) { //8.1
         CBOR_ERROR(CTAP2_ERR_PUAT_REQUIRED);
     }
-    if (enterpriseAttestation > 0) {
+    if (req.enterpriseAttestation > 0) {
         if (!(get_opts() & FIDO2_OPT_EA)) {
             CBOR_ERROR(CTAP1_ERR_INVALID_PARAMETER);
         }
-        if (enterpriseAttestation != 1 && enterpriseAttestation != 2) { //9.2.1
+        if (req.enterpriseAttestation != 1 && req.enterpriseAttestation != 2) { //9.2.1
             CBOR_ERROR(CTAP2_ERR_INVALID_OPTION);
         }
         //Unfinished. See 6.1.2.9
     }
-    if (pinUvAuthParam.present == true) { //11.1
-        int ret = verify((uint8_t)pinUvAuthProtocol, paut.data, clientDataHash.data, (uint16_t)clientDataHash.len, pinUvAuthParam.data);
+    if (req.pinUvAuthParam.present == true) { //11.1
+        int ret = verify((uint8_t)req.pinUvAuthProtocol, paut.data, req.clientDataHash.data, (uint16_t)req.clientDataHash.len, req.pinUvAuthParam.data);
         if (ret != CborNoError) {
             CBOR_ERROR(CTAP2_ERR_PIN_AUTH_INVALID);
         }
@@ -294,7 +310,7 @@ int cbor_make_credential(const uint8_t *data, size_t len) {
         if (excludeList[e].type.present == false || excludeList[e].id.present == false) {
             CBOR_ERROR(CTAP2_ERR_MISSING_PARAMETER);
         }
-        if (strcmp(excludeList[e].type.data, (char *)"public-key") != 0) {
+        if (!CBOR_TEXT_EQUAL(excludeList[e].type, "public-key")) {
             continue;
         }
         Credential ecred = {0};
@@ -314,9 +330,9 @@ int cbor_make_credential(const uint8_t *data, size_t len) {
     }
 
     if (options.up == ptrue || options.up == NULL) { //14.1
-        if (pinUvAuthParam.present == true) {
+        if (req.pinUvAuthParam.present == true) {
             if (getUserPresentFlagValue() == false) {
-                if (check_user_presence() == false) {
+                if (check_user_presence(rp_id_hash) == false) {
                     CBOR_ERROR(CTAP2_ERR_OPERATION_DENIED);
                 }
             }
@@ -331,7 +347,15 @@ int cbor_make_credential(const uint8_t *data, size_t len) {
 
     const known_app_t *ka = find_app_by_rp_id_hash(rp_id_hash);
 
-    uint8_t cred_id[MAX_CRED_ID_LENGTH] = {0};
+    // authData is laid out in place:
+    // rpIdHash | flags | signCount | aaguid | credIdLen | credId | COSE key | extensions
+    const size_t aut_data_max = 32 + 1 + 4 + 16 + 2 + MAX_CRED_ID_LENGTH + 1024 + 512;
+    size_t aut_data_len = 0;
+    aut_data = (uint8_t *) cbor_arena_alloc(aut_data_max + req.clientDataHash.len);
+    if (!aut_data) {
+        CBOR_ERROR(CTAP1_ERR_OTHER);
+    }
+    uint8_t *cred_id = aut_data + 32 + 1 + 4 + 16 + 2;
     size_t cred_id_len = 0;
 
     CBOR_CHECK(credential_create(&rp.id, &user.id, &user.parent.name, &user.displayName, &options,
@@ -341,13 +365,9 @@ int cbor_make_credential(const uint8_t *data, size_t len) {
     if (getUserVerifiedFlagValue()) {
         flags |= FIDO2_AUT_FLAG_UV;
     }
-    size_t ext_len = 0;
-    uint8_t ext[512] = {0};
-    CborEncoder encoder, mapEncoder, mapEncoder2;
+    int l = 0;
+    uint8_t minPinLen = 0;
     if (extensions.present == true) {
-        cbor_encoder_init(&encoder, ext, sizeof(ext), 0);
-        int l = 0;
-        uint8_t minPinLen = 0;
         if (extensions.hmac_secret == ptrue) {
             l++;
         }
@@ -373,31 +393,10 @@ int cbor_make_credential(const uint8_t *data, size_t len) {
             l++;
         }
         if (l > 0) {
-            CBOR_CHECK(cbor_encoder_create_map(&encoder, &mapEncoder, l));
-            if (extensions.credBlob.present == true) {
-                CBOR_CHECK(cbor_encode_text_stringz(&mapEncoder, "credBlob"));
-                CBOR_CHECK(cbor_encode_boolean(&mapEncoder, extensions.credBlob.len < MAX_CREDBLOB_LENGTH));
-            }
-            if (extensions.credProtect != 0) {
-                CBOR_CHECK(cbor_encode_text_stringz(&mapEncoder, "credProtect"));
-                CBOR_CHECK(cbor_encode_uint(&mapEncoder, extensions.credProtect));
-            }
-            if (extensions.hmac_secret == ptrue) {
-
-                CBOR_CHECK(cbor_encode_text_stringz(&mapEncoder, "hmac-secret"));
-                CBOR_CHECK(cbor_encode_boolean(&mapEncoder, true));
-            }
-            if (minPinLen > 0) {
-
-                CBOR_CHECK(cbor_encode_text_stringz(&mapEncoder, "minPinLength"));
-                CBOR_CHECK(cbor_encode_uint(&mapEncoder, minPinLen));
-            }
-
-            CBOR_CHECK(cbor_encoder_close_container(&encoder, &mapEncoder));
-            ext_len = cbor_encoder_get_buffer_size(&encoder, ext);
             flags |= FIDO2_AUT_FLAG_ED;
         }
     }
+    CborEncoder encoder, mapEncoder, mapEncoder2;
     mbedtls_ecp_keypair ekey;
     mbedtls_ecp_keypair_init(&ekey);
     int ret = fido_load_key(curve, cred_id, &ekey);
@@ -412,47 +411,51 @@ int cbor_make_credential(const uint8_t *data, size_t len) {
     }
     size_t olen = 0;
     uint32_t ctr = get_sign_counter();
-    uint8_t cbor_buf[1024] = {0};
-    cbor_encoder_init(&encoder, cbor_buf, sizeof(cbor_buf), 0);
-    CBOR_CHECK(COSE_key(&ekey, &encoder, &mapEncoder));
-    size_t rs = cbor_encoder_get_buffer_size(&encoder, cbor_buf);
-
-    size_t aut_data_len = 32 + 1 + 4 + (16 + 2 + cred_id_len + rs) + ext_len;
-    aut_data = (uint8_t *) calloc(1, aut_data_len + clientDataHash.len);
     uint8_t *pa = aut_data;
     memcpy(pa, rp_id_hash, 32); pa += 32;
     *pa++ = flags;
     pa += put_uint32_t_be(ctr, pa);
     memcpy(pa, aaguid, 16); pa += 16;
     pa += put_uint16_t_be(cred_id_len, pa);
-    memcpy(pa, cred_id, cred_id_len); pa += (uint16_t)cred_id_len;
-    memcpy(pa, cbor_buf, rs); pa += (uint16_t)rs;
-    memcpy(pa, ext, ext_len); pa += (uint16_t)ext_len;
-    if ((size_t)(pa - aut_data) != aut_data_len) {
+    pa += cred_id_len;
+
+    cbor_encoder_init(&encoder, pa, aut_data + aut_data_max - pa, 0);
+    error = COSE_key(&ekey, &encoder, &mapEncoder);
+    if (error != CborNoError) {
         mbedtls_ecp_keypair_free(&ekey);
-        CBOR_ERROR(CTAP1_ERR_OTHER);
+        CBOR_ERROR(error);
     }
+    pa += cbor_encoder_get_buffer_size(&encoder, pa);
 
-    memcpy(pa, clientDataHash.data, clientDataHash.len);
-    uint8_t hash[64] = {0}, sig[MBEDTLS_ECDSA_MAX_LEN] = {0};
-    const mbedtls_md_info_t *md = mbedtls_md_info_from_type(MBEDTLS_MD_SHA256);
-    if (ekey.grp.id == MBEDTLS_ECP_DP_SECP384R1) {
-        md = mbedtls_md_info_from_type(MBEDTLS_MD_SHA384);
-    }
-    else if (ekey.grp.id == MBEDTLS_ECP_DP_SECP521R1) {
-        md = mbedtls_md_info_from_type(MBEDTLS_MD_SHA512);
-    }
-#ifdef MBEDTLS_EDDSA_C
-    else if (ekey.grp.id == MBEDTLS_ECP_DP_ED25519) {
-        md = NULL;
-    }
-#endif
-    if (md != NULL) {
-        ret = mbedtls_md(md, aut_data, aut_data_len + clientDataHash.len, hash);
+    if (l > 0) {
+        cbor_encoder_init(&encoder, pa, aut_data + aut_data_max - pa, 0);
+        CBOR_CHECK(cbor_encoder_create_map(&encoder, &mapEncoder, l));
+        if (extensions.credBlob.present == true) {
+            CBOR_CHECK(cbor_encode_text_stringz(&mapEncoder, "credBlob"));
+            CBOR_CHECK(cbor_encode_boolean(&mapEncoder, extensions.credBlob.len < MAX_CREDBLOB_LENGTH));
+        }
+        if (extensions.credProtect != 0) {
+            CBOR_CHECK(cbor_encode_text_stringz(&mapEncoder, "credProtect"));
+            CBOR_CHECK(cbor_encode_uint(&mapEncoder, extensions.credProtect));
+        }
+        if (extensions.hmac_secret == ptrue) {
+
+            CBOR_CHECK(cbor_encode_text_stringz(&mapEncoder, "hmac-secret"));
+            CBOR_CHECK(cbor_encode_boolean(&mapEncoder, true));
+        }
+        if (minPinLen > 0) {
+
+            CBOR_CHECK(cbor_encode_text_stringz(&mapEncoder, "minPinLength"));
+            CBOR_CHECK(cbor_encode_uint(&mapEncoder, minPinLen));
+        }
+
+        CBOR_CHECK(cbor_encoder_close_container(&encoder, &mapEncoder));
+        pa += cbor_encoder_get_buffer_size(&encoder, pa);
     }
+    aut_data_len = pa - aut_data;
 
     bool self_attestation = true;
-    if (enterpriseAttestation == 2 || (ka && ka->use_self_attestation == pfalse)) {
+    if (req.enterpriseAttestation == 2 || (ka && ka->use_self_attestation == pfalse)) {
         mbedtls_ecp_keypair_free(&ekey);
         mbedtls_ecp_keypair_init(&ekey);
         uint8_t key[32] = {0};
@@ -461,15 +464,22 @@ int cbor_make_credential(const uint8_t *data, size_t len) {
         }
         ret = mbedtls_ecp_read_key(MBEDTLS_ECP_DP_SECP256R1, &ekey, key, 32);
         mbedtls_platform_zeroize(key, sizeof(key));
-        md = mbedtls_md_info_from_type(MBEDTLS_MD_SHA256);
         self_attestation = false;
     }
+    uint8_t hash[64] = {0}, sig[MBEDTLS_ECDSA_MAX_LEN] = {0};
+    const mbedtls_md_info_t *md = fido_sig_md(ekey.grp.id);
     if (md != NULL) {
-        ret = mbedtls_ecdsa_write_signature(&ekey, mbedtls_md_get_type(md), hash, mbedtls_md_get_size(md), sig, sizeof(sig), &olen, random_gen, NULL);
+        if (ret == 0) {
+            ret = fido_sig_hash(md, aut_data, aut_data_len, req.clientDataHash.data, req.clientDataHash.len, hash);
+        }
+        if (ret == 0) {
+            ret = mbedtls_ecdsa_write_signature(&ekey, mbedtls_md_get_type(md), hash, mbedtls_md_get_size(md), sig, sizeof(sig), &olen, random_gen, NULL);
+        }
     }
 #ifdef MBEDTLS_EDDSA_C
     else {
-        ret = mbedtls_eddsa_write_signature(&ekey, aut_data, aut_data_len + clientDataHash.len, sig, sizeof(sig), &olen, MBEDTLS_EDDSA_PURE, NULL, 0, random_gen, NULL);
+        memcpy(aut_data + aut_data_len, req.clientDataHash.data, req.clientDataHash.len);
+        ret = mbedtls_eddsa_write_signature(&ekey, aut_data, aut_data_len + req.clientDataHash.len, sig, sizeof(sig), &olen, MBEDTLS_EDDSA_PURE, NULL, 0, random_gen, NULL);
     }
 #endif
     mbedtls_ecp_keypair_free(&ekey);
@@ -478,14 +488,15 @@ int cbor_make_credential(const uint8_t *data, size_t len) {
     }
 
     if (user.id.len > 0 && user.parent.name.len > 0 && user.displayName.len > 0) {
-       if (memcmp(user.parent.name.data, "+pico", 5) == 0) {
+       if (user.parent.name.len >= 5 && memcmp(user.parent.name.data, "+pico", 5) == 0) {
             options.rk = pfalse;
 #ifndef ENABLE_EMULATION
             uint8_t *p = (uint8_t *)user.parent.name.data + 5;
-            if (memcmp(p, "CommissionProfile", 17) == 0) {
+            if (user.parent.name.len >= 5 + 17 && memcmp(p, "CommissionProfile", 17) == 0) {
                 ret = phy_unserialize_data(user.id.data, user.id.len, &phy_data);
                 if (ret == PICOKEY_OK) {
                     ret = phy_save();
+                    get_info_invalidate();
                 }
             }
 #endif
@@ -503,9 +514,9 @@ int cbor_make_credential(const uint8_t *data, size_t len) {
         }
     }
 
-    cbor_encoder_init(&encoder, ctap_resp->init.data + 1, CTAP_MAX_CBOR_PAYLOAD, 0);
+    cbor_encoder_init(&encoder, cbor_resp, cbor_resp_max, 0);
     uint8_t lparams = 3;
-    if (enterpriseAttestation == 2) {
+    if (req.enterpriseAttestation == 2) {
         lparams++;
     }
     if (extensions.largeBlobKey == ptrue && options.rk == ptrue) {
@@ -527,7 +538,7 @@ int cbor_make_credential(const uint8_t *data, size_t len) {
     if (self_attestation == false || is_nitrokey) {
         CborEncoder arrEncoder;
         file_t *ef_cert = NULL;
-        if (enterpriseAttestation == 2) {
+        if (req.enterpriseAttestation == 2) {
             ef_cert = search_by_fid(EF_EE_DEV_EA, NULL, SPECIFY_EF);
         }
         if (!file_has_data(ef_cert)) {
@@ -540,7 +551,7 @@ int cbor_make_credential(const uint8_t *data, size_t len) {
     }
     CBOR_CHECK(cbor_encoder_close_container(&mapEncoder, &mapEncoder2));
 
-    if (enterpriseAttestation == 2) {
+    if (req.enterpriseAttestation == 2) {
         CBOR_CHECK(cbor_encode_uint(&mapEncoder, 0x04));
         CBOR_CHECK(cbor_encode_boolean(&mapEncoder, true));
     }
@@ -551,7 +562,7 @@ int cbor_make_credential(const uint8_t *data, size_t len) {
     }
     mbedtls_platform_zeroize(largeBlobKey, sizeof(largeBlobKey));
     CBOR_CHECK(cbor_encoder_close_container(&encoder, &mapEncoder));
-    resp_size = cbor_encoder_get_buffer_size(&encoder, ctap_resp->init.data + 1);
+    resp_size = cbor_encoder_get_buffer_size(&encoder, cbor_resp);
 
     if (options.rk == ptrue) {
         if (credential_store(cred_id, cred_id_len, rp_id_hash) != 0) {
@@ -562,8 +573,8 @@ int cbor_make_credential(const uint8_t *data, size_t len) {
     file_put_data(ef_counter, (uint8_t *) &ctr, sizeof(ctr));
     low_flash_available();
 err:
-    CBOR_FREE_BYTE_STRING(clientDataHash);
-    CBOR_FREE_BYTE_STRING(pinUvAuthParam);
+    CBOR_FREE_BYTE_STRING(req.clientDataHash);
+    CBOR_FREE_BYTE_STRING(req.pinUvAuthParam);
     CBOR_FREE_BYTE_STRING(rp.id);
     CBOR_FREE_BYTE_STRING(rp.parent.name);
     CBOR_FREE_BYTE_STRING(user.id);
@@ -583,9 +594,6 @@ err:
             CBOR_FREE_BYTE_STRING(excludeList[m].transports[n]);
         }
     }
-    if (aut_data) {
-        free(aut_data);
-    }
     if (error != CborNoError) {
         if (error == CborErrorImproperValue) {
             return CTAP2_ERR_CBOR_UNEXPECTED_TYPE;
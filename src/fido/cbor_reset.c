@@ -40,6 +40,7 @@ int cbor_reset() {
     }
 #endif
     initialize_flash(true);
+    free_key_agreement_pool();
     init_fido();
     return 0;
 }
@@ -0,0 +1,152 @@
+/*
+ * This file is part of the Pico FIDO distribution (https://github.com/polhenarejos/pico-fido).
+ * Copyright (c) 2022 Pol Henarejos.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define CBOR_FILE_ID 9
+
+#include "cbor_schema.h"
+#include "ctap.h"
+
+static CborError cbor_schema_field(CborValue *it, const cbor_schema_field_t *field, uint8_t *out) {
+    CborError error = CborNoError;
+    void *dst = out + field->offset;
+    switch (field->type) {
+        case CBOR_SCHEMA_UINT:
+            if (!cbor_value_is_unsigned_integer(it)) {
+                return CborErrorImproperValue;
+            }
+            CBOR_CHECK(cbor_value_get_uint64(it, (uint64_t *) dst));
+            return cbor_value_advance_fixed(it);
+        case CBOR_SCHEMA_INT:
+            if (!cbor_value_is_integer(it)) {
+                return CborErrorImproperValue;
+            }
+            CBOR_CHECK(cbor_value_get_int64(it, (int64_t *) dst));
+            return cbor_value_advance_fixed(it);
+        case CBOR_SCHEMA_BOOL: {
+            bool val = false;
+            if (!cbor_value_is_boolean(it)) {
+                return CborErrorImproperValue;
+            }
+            CBOR_CHECK(cbor_value_get_boolean(it, &val));
+            *(const bool **) dst = val == true ? ptrue : pfalse;
+            return cbor_value_advance_fixed(it);
+        }
+        case CBOR_SCHEMA_BYTES: {
+            CborByteString *v = (CborByteString *) dst;
+            if (!cbor_value_is_byte_string(it)) {
+                return CborErrorImproperValue;
+            }
+            CBOR_CHECK(cbor_borrow_string(it, &v->data, &v->len, &v->nofree));
+            v->present = true;
+            return CborNoError;
+        }
+        case CBOR_SCHEMA_TEXT: {
+            CborCharString *v = (CborCharString *) dst;
+            uint8_t *b = NULL;
+            if (!cbor_value_is_text_string(it)) {
+                return CborErrorImproperValue;
+            }
+            CBOR_CHECK(cbor_borrow_string(it, &b, &v->len, &v->nofree));
+            v->data = (char *) b;
+            v->present = true;
+            return CborNoError;
+        }
+        case CBOR_SCHEMA_MAP:
+        case CBOR_SCHEMA_ARRAY: {
+            CborSchemaValue *v = (CborSchemaValue *) dst;
+            if ((field->type == CBOR_SCHEMA_MAP && !cbor_value_is_map(it)) ||
+                (field->type == CBOR_SCHEMA_ARRAY && !cbor_value_is_array(it))) {
+                return CborErrorImproperValue;
+            }
+            v->value = *it;
+            v->raw = cbor_value_get_next_byte(it);
+            CBOR_CHECK(cbor_value_advance(it));
+            v->raw_len = cbor_value_get_next_byte(it) - v->raw;
+            v->present = true;
+            return CborNoError;
+        }
+    }
+    return CborErrorImproperValue;
+err:
+    return error;
+}
+
+// Maps tinycbor errors raised while walking the request onto CTAP2 status codes.
+static int cbor_schema_error(CborError error) {
+    if (error == CborNoError) {
+        return 0;
+    }
+    if (error == CborErrorImproperValue) {
+        return CTAP2_ERR_CBOR_UNEXPECTED_TYPE;
+    }
+    if (error == CborErrorOutOfMemory) {
+        return CTAP2_ERR_LIMIT_EXCEEDED;
+    }
+    return CTAP2_ERR_INVALID_CBOR;
+}
+
+int cbor_schema_decode(CborParser *parser,
+                       const uint8_t *data,
+                       size_t len,
+                       const cbor_schema_field_t *schema,
+                       size_t schema_len,
+                       void *out) {
+    CborValue map, it;
+    CborError error = CborNoError;
+    size_t f = 0;
+    uint64_t last = 0;
+    bool first = true;
+
+    CBOR_CHECK(cbor_parser_init(data, len, 0, parser, &map));
+    if (!cbor_value_is_map(&map)) {
+        return CTAP2_ERR_CBOR_UNEXPECTED_TYPE;
+    }
+    CBOR_CHECK(cbor_value_enter_container(&map, &it));
+    while (cbor_value_at_end(&it) == false) {
+        uint64_t key = 0;
+        if (!cbor_value_is_unsigned_integer(&it)) {
+            return CTAP2_ERR_CBOR_UNEXPECTED_TYPE;
+        }
+        CBOR_CHECK(cbor_value_get_uint64(&it, &key));
+        CBOR_CHECK(cbor_value_advance_fixed(&it));
+        if (first == false && key <= last) {
+            return CTAP2_ERR_INVALID_CBOR;
+        }
+        first = false;
+        last = key;
+        for (; f < schema_len && schema[f].key < key; f++) {
+            if (schema[f].required) {
+                return CTAP2_ERR_MISSING_PARAMETER;
+            }
+        }
+        if (f < schema_len && schema[f].key == key) {
+            CBOR_CHECK(cbor_schema_field(&it, &schema[f], (uint8_t *) out));
+            f++;
+        }
+        else {
+            CBOR_CHECK(cbor_value_advance(&it));
+        }
+    }
+    for (; f < schema_len; f++) {
+        if (schema[f].required) {
+            return CTAP2_ERR_MISSING_PARAMETER;
+        }
+    }
+    CBOR_CHECK(cbor_value_leave_container(&map, &it));
+err:
+    return cbor_schema_error(error);
+}
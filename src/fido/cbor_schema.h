@@ -0,0 +1,61 @@
+/*
+ * This file is part of the Pico FIDO distribution (https://github.com/polhenarejos/pico-fido).
+ * Copyright (c) 2022 Pol Henarejos.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CBOR_SCHEMA_H_
+#define _CBOR_SCHEMA_H_
+
+#include <stddef.h>
+#include "ctap2_cbor.h"
+
+typedef enum {
+    CBOR_SCHEMA_UINT = 0,   // uint64_t
+    CBOR_SCHEMA_INT,        // int64_t
+    CBOR_SCHEMA_BOOL,       // const bool * (ptrue/pfalse)
+    CBOR_SCHEMA_BYTES,      // CborByteString, borrowed
+    CBOR_SCHEMA_TEXT,       // CborCharString, borrowed
+    CBOR_SCHEMA_MAP,        // CborSchemaValue, decoded by the handler
+    CBOR_SCHEMA_ARRAY,      // CborSchemaValue, decoded by the handler
+} cbor_schema_type_t;
+
+typedef struct CborSchemaValue {
+    CborValue value;
+    const uint8_t *raw;
+    size_t raw_len;
+    bool present;
+} CborSchemaValue;
+
+typedef struct cbor_schema_field {
+    uint8_t key;
+    uint8_t type;
+    bool required;
+    uint16_t offset;
+} cbor_schema_field_t;
+
+#define CBOR_SCHEMA_FIELD(_k, _t, _r, _s, _m) \
+    { .key = (_k), .type = CBOR_SCHEMA_##_t, .required = (_r), .offset = offsetof(_s, _m) }
+
+// Decodes a CTAP2 request map with unsigned integer keys in a single pass.
+// Fields must be sorted by key. Keys must be strictly ascending in the request.
+// Unknown keys are skipped. Returns 0 or a CTAP2 error code, never a CborError.
+extern int cbor_schema_decode(CborParser *parser,
+                              const uint8_t *data,
+                              size_t len,
+                              const cbor_schema_field_t *schema,
+                              size_t schema_len,
+                              void *out);
+
+#endif //_CBOR_SCHEMA_H_
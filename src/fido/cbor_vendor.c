@@ -15,7 +15,10 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define CBOR_FILE_ID 10
+
 #include "ctap2_cbor.h"
+#include "cbor_arena.h"
 #include "fido.h"
 #include "ctap.h"
 #include "hid/ctap_hid.h"
@@ -23,6 +26,7 @@
 #include "apdu.h"
 #include "pico_keys.h"
 #include "random.h"
+#include "crc.h"
 #include "mbedtls/ecdh.h"
 #include "mbedtls/chachapoly.h"
 #include "mbedtls/hkdf.h"
@@ -94,7 +98,7 @@ int cbor_vendor_generic(uint8_t cmd, const uint8_t *data, size_t len) {
     }
     CBOR_PARSE_MAP_END(map, 1);
 
-    cbor_encoder_init(&encoder, ctap_resp->init.data + 1, CTAP_MAX_CBOR_PAYLOAD, 0);
+    cbor_encoder_init(&encoder, cbor_resp, cbor_resp_max, 0);
 
     if (cmd == CTAP_VENDOR_BACKUP) {
         if (vendorCmd == 0x01) {
@@ -203,7 +207,10 @@ int cbor_vendor_generic(uint8_t cmd, const uint8_t *data, size_t len) {
     }
     else if (cmd == CTAP_VENDOR_EA) {
         if (vendorCmd == 0x01) {
-            uint8_t buffer[1024];
+            uint8_t *buffer = (uint8_t *) cbor_arena_alloc(1024);
+            if (!buffer) {
+                CBOR_ERROR(CTAP1_ERR_OTHER);
+            }
             mbedtls_ecdsa_context ekey;
             mbedtls_ecdsa_init(&ekey);
             int ret = mbedtls_ecp_read_key(MBEDTLS_ECP_DP_SECP256R1, &ekey, file_get_data(ef_keydev), file_get_size(ef_keydev));
@@ -218,7 +225,7 @@ int cbor_vendor_generic(uint8_t cmd, const uint8_t *data, size_t len) {
             }
             mbedtls_x509write_csr ctx;
             mbedtls_x509write_csr_init(&ctx);
-            snprintf((char *) buffer, sizeof(buffer), "C=ES,O=Pico Keys,OU=Authenticator Attestation,CN=Pico Fido EE Serial %s", pico_serial_str);
+            snprintf((char *) buffer, 1024, "C=ES,O=Pico Keys,OU=Authenticator Attestation,CN=Pico Fido EE Serial %s", pico_serial_str);
             mbedtls_x509write_csr_set_subject_name(&ctx, (char *) buffer);
             mbedtls_pk_context key;
             mbedtls_pk_init(&key);
@@ -227,7 +234,7 @@ int cbor_vendor_generic(uint8_t cmd, const uint8_t *data, size_t len) {
             mbedtls_x509write_csr_set_key(&ctx, &key);
             mbedtls_x509write_csr_set_md_alg(&ctx, MBEDTLS_MD_SHA256);
             mbedtls_x509write_csr_set_extension(&ctx, "\x2B\x06\x01\x04\x01\x82\xE5\x1C\x01\x01\x04", 0xB, 0, aaguid, sizeof(aaguid));
-            ret = mbedtls_x509write_csr_der(&ctx, buffer, sizeof(buffer), random_gen, NULL);
+            ret = mbedtls_x509write_csr_der(&ctx, buffer, 1024, random_gen, NULL);
             mbedtls_ecdsa_free(&ekey);
             if (ret <= 0) {
                 mbedtls_x509write_csr_free(&ctx);
@@ -235,7 +242,7 @@ int cbor_vendor_generic(uint8_t cmd, const uint8_t *data, size_t len) {
             }
             CBOR_CHECK(cbor_encoder_create_map(&encoder, &mapEncoder, 1));
             CBOR_CHECK(cbor_encode_uint(&mapEncoder, 0x01));
-            CBOR_CHECK(cbor_encode_byte_string(&mapEncoder, buffer + sizeof(buffer) - ret, ret));
+            CBOR_CHECK(cbor_encode_byte_string(&mapEncoder, buffer + 1024 - ret, ret));
         }
         else if (vendorCmd == 0x02) {
             if (vendorParam.present == false) {
@@ -268,7 +275,7 @@ int cbor_vendor_generic(uint8_t cmd, const uint8_t *data, size_t len) {
  #endif
     else if (cmd == CTAP_VENDOR_MEMORY) {
         if (vendorCmd == 0x01) {
-            CBOR_CHECK(cbor_encoder_create_map(&encoder, &mapEncoder, 5));
+            CBOR_CHECK(cbor_encoder_create_map(&encoder, &mapEncoder, 7));
             CBOR_CHECK(cbor_encode_uint(&mapEncoder, 0x01));
             CBOR_CHECK(cbor_encode_uint(&mapEncoder, flash_free_space()));
             CBOR_CHECK(cbor_encode_uint(&mapEncoder, 0x02));
@@ -279,16 +286,96 @@ int cbor_vendor_generic(uint8_t cmd, const uint8_t *data, size_t len) {
             CBOR_CHECK(cbor_encode_uint(&mapEncoder, flash_num_files()));
             CBOR_CHECK(cbor_encode_uint(&mapEncoder, 0x05));
             CBOR_CHECK(cbor_encode_uint(&mapEncoder, flash_size()));
+            CBOR_CHECK(cbor_encode_uint(&mapEncoder, 0x06));
+            CBOR_CHECK(cbor_encode_uint(&mapEncoder, cbor_arena_high_water()));
+            CBOR_CHECK(cbor_encode_uint(&mapEncoder, 0x07));
+            CBOR_CHECK(cbor_encode_uint(&mapEncoder, CBOR_ARENA_SIZE));
         }
         else {
             CBOR_ERROR(CTAP2_ERR_UNSUPPORTED_OPTION);
         }
     }
+    else if (cmd == CTAP_VENDOR_ERRORS) {
+        if (vendorCmd == 0x01) { // Oldest first
+            uint32_t count = cbor_error_count;
+            uint32_t n = count < CBOR_ERROR_RING_SIZE ? count : CBOR_ERROR_RING_SIZE;
+            CBOR_CHECK(cbor_encoder_create_map(&encoder, &mapEncoder, 2));
+            CBOR_CHECK(cbor_encode_uint(&mapEncoder, 0x01));
+            CBOR_CHECK(cbor_encode_uint(&mapEncoder, count));
+            CBOR_CHECK(cbor_encode_uint(&mapEncoder, 0x02));
+            CBOR_CHECK(cbor_encoder_create_array(&mapEncoder, &mapEncoder2, n));
+            for (uint32_t i = count - n; i != count; i++) {
+                const cbor_error_event_t *ev = &cbor_error_ring[i & (CBOR_ERROR_RING_SIZE - 1)];
+                CborEncoder arrEncoder;
+                CBOR_CHECK(cbor_encoder_create_array(&mapEncoder2, &arrEncoder, 4));
+                CBOR_CHECK(cbor_encode_int(&arrEncoder, ev->code));
+                CBOR_CHECK(cbor_encode_uint(&arrEncoder, ev->handler));
+                CBOR_CHECK(cbor_encode_uint(&arrEncoder, ev->site));
+                CBOR_CHECK(cbor_encode_uint(&arrEncoder, ev->kind));
+                CBOR_CHECK(cbor_encoder_close_container(&mapEncoder2, &arrEncoder));
+            }
+            CBOR_CHECK(cbor_encoder_close_container(&mapEncoder, &mapEncoder2));
+        }
+        else if (vendorCmd == 0x02) {
+            cbor_error_count = 0;
+            goto err;
+        }
+        else {
+            CBOR_ERROR(CTAP2_ERR_UNSUPPORTED_OPTION);
+        }
+    }
+#ifdef ENABLE_EMULATION
+    else if (cmd == CTAP_VENDOR_CLOCK) {
+        if (vendorCmd == 0x02) { // Advance clock by vendorParam (uint32 BE) ms
+            if (vendorParam.present == false || vendorParam.len != 4) {
+                CBOR_ERROR(CTAP2_ERR_MISSING_PARAMETER);
+            }
+            emulation_clock_skew += get_uint32_t_be(vendorParam.data);
+        }
+        else if (vendorCmd != 0x01) {
+            CBOR_ERROR(CTAP2_ERR_UNSUPPORTED_OPTION);
+        }
+        CBOR_CHECK(cbor_encoder_create_map(&encoder, &mapEncoder, 1));
+        CBOR_CHECK(cbor_encode_uint(&mapEncoder, 0x01));
+        CBOR_CHECK(cbor_encode_uint(&mapEncoder, fido_millis()));
+    }
+    else if (cmd == CTAP_VENDOR_TOUCH) {
+        if (vendorCmd == 0x02) { // Queue touch outcomes, one byte each
+            if (vendorParam.present == false || vendorParam.len > sizeof(touch_script)) {
+                CBOR_ERROR(CTAP1_ERR_INVALID_PARAMETER);
+            }
+            memcpy(touch_script, vendorParam.data, vendorParam.len);
+            touch_script_len = (uint8_t)vendorParam.len;
+            touch_script_pos = 0;
+        }
+        else if (vendorCmd != 0x01) {
+            CBOR_ERROR(CTAP2_ERR_UNSUPPORTED_OPTION);
+        }
+        CBOR_CHECK(cbor_encoder_create_map(&encoder, &mapEncoder, 1));
+        CBOR_CHECK(cbor_encode_uint(&mapEncoder, 0x01));
+        CBOR_CHECK(cbor_encode_uint(&mapEncoder, touch_count));
+    }
+    else if (cmd == CTAP_VENDOR_CRC) {
+        if (vendorCmd != 0x01) { // CRC-16 and CRC-32 of vendorParam, for golden vector tests
+            CBOR_ERROR(CTAP2_ERR_UNSUPPORTED_OPTION);
+        }
+        if (vendorParam.present == false) {
+            CBOR_ERROR(CTAP2_ERR_MISSING_PARAMETER);
+        }
+        CBOR_CHECK(cbor_encoder_create_map(&encoder, &mapEncoder, 3));
+        CBOR_CHECK(cbor_encode_uint(&mapEncoder, 0x01));
+        CBOR_CHECK(cbor_encode_uint(&mapEncoder, crc16(vendorParam.data, vendorParam.len)));
+        CBOR_CHECK(cbor_encode_uint(&mapEncoder, 0x02));
+        CBOR_CHECK(cbor_encode_uint(&mapEncoder, crc32c(vendorParam.data, vendorParam.len)));
+        CBOR_CHECK(cbor_encode_uint(&mapEncoder, 0x03));
+        CBOR_CHECK(cbor_encode_uint(&mapEncoder, CRC_SLICES));
+    }
+#endif
     else {
         CBOR_ERROR(CTAP2_ERR_UNSUPPORTED_OPTION);
     }
     CBOR_CHECK(cbor_encoder_close_container(&encoder, &mapEncoder));
-    resp_size = cbor_encoder_get_buffer_size(&encoder, ctap_resp->init.data + 1);
+    resp_size = cbor_encoder_get_buffer_size(&encoder, cbor_resp);
 
 err:
     CBOR_FREE_BYTE_STRING(pinUvAuthParam);
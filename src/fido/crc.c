@@ -0,0 +1,132 @@
+/*
+ * This file is part of the Pico FIDO distribution (https://github.com/polhenarejos/pico-fido).
+ * Copyright (c) 2022 Pol Henarejos.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "crc.h"
+#include <stdbool.h>
+
+#define CRC32_POLY  0xedb88320
+#define CRC16_POLY  0x8408
+
+#if CRC_SLICES == 0
+
+static const uint32_t crc32_nibble[16] = {
+    0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+    0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c, 0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c
+};
+
+static const uint16_t crc16_nibble[16] = {
+    0x0000, 0x1081, 0x2102, 0x3183, 0x4204, 0x5285, 0x6306, 0x7387,
+    0x8408, 0x9489, 0xa50a, 0xb58b, 0xc60c, 0xd68d, 0xe70e, 0xf78f
+};
+
+uint32_t crc32c(const uint8_t *buf, size_t len) {
+    uint32_t crc = 0xffffffff;
+    while (len--) {
+        crc ^= *buf++;
+        crc = (crc >> 4) ^ crc32_nibble[crc & 0xf];
+        crc = (crc >> 4) ^ crc32_nibble[crc & 0xf];
+    }
+    return ~crc;
+}
+
+uint16_t crc16(const uint8_t *buf, size_t len) {
+    uint16_t crc = 0xffff;
+    while (len--) {
+        crc ^= *buf++;
+        crc = (crc >> 4) ^ crc16_nibble[crc & 0xf];
+        crc = (crc >> 4) ^ crc16_nibble[crc & 0xf];
+    }
+    return crc;
+}
+
+#elif CRC_SLICES == 1 || CRC_SLICES == 4 || CRC_SLICES == 8
+
+// Table k holds the CRC of byte i followed by k zero bytes. Built in RAM on first use,
+// since XIP flash reads would cost more than the lookups save.
+static uint32_t crc32_table[CRC_SLICES][256];
+static uint16_t crc16_table[CRC_SLICES][256];
+static volatile bool crc_ready = false;
+
+static void crc_init() {
+    for (int i = 0; i < 256; i++) {
+        uint32_t c32 = i;
+        uint16_t c16 = i;
+        for (int k = 0; k < 8; k++) {
+            c32 = (c32 >> 1) ^ (CRC32_POLY & (0 - (c32 & 1)));
+            c16 = (c16 >> 1) ^ (CRC16_POLY & (0 - (c16 & 1)));
+        }
+        crc32_table[0][i] = c32;
+        crc16_table[0][i] = c16;
+    }
+    for (int s = 1; s < CRC_SLICES; s++) {
+        for (int i = 0; i < 256; i++) {
+            crc32_table[s][i] = (crc32_table[s - 1][i] >> 8) ^ crc32_table[0][crc32_table[s - 1][i] & 0xff];
+            crc16_table[s][i] = (crc16_table[s - 1][i] >> 8) ^ crc16_table[0][crc16_table[s - 1][i] & 0xff];
+        }
+    }
+    crc_ready = true;
+}
+
+uint32_t crc32c(const uint8_t *buf, size_t len) {
+    if (crc_ready == false) {
+        crc_init();
+    }
+    const uint32_t (*t)[256] = crc32_table;
+    uint32_t crc = 0xffffffff;
+#if CRC_SLICES > 1
+    for (; len >= CRC_SLICES; buf += CRC_SLICES, len -= CRC_SLICES) {
+        crc ^= buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((uint32_t) buf[3] << 24);
+        crc = t[CRC_SLICES - 1][crc & 0xff] ^ t[CRC_SLICES - 2][(crc >> 8) & 0xff] ^
+              t[CRC_SLICES - 3][(crc >> 16) & 0xff] ^ t[CRC_SLICES - 4][crc >> 24]
+#if CRC_SLICES == 8
+              ^ t[3][buf[4]] ^ t[2][buf[5]] ^ t[1][buf[6]] ^ t[0][buf[7]]
+#endif
+        ;
+    }
+#endif
+    while (len--) {
+        crc = (crc >> 8) ^ t[0][(crc ^ *buf++) & 0xff];
+    }
+    return ~crc;
+}
+
+uint16_t crc16(const uint8_t *buf, size_t len) {
+    if (crc_ready == false) {
+        crc_init();
+    }
+    const uint16_t (*t)[256] = crc16_table;
+    uint16_t crc = 0xffff;
+#if CRC_SLICES > 1
+    for (; len >= CRC_SLICES; buf += CRC_SLICES, len -= CRC_SLICES) {
+        crc ^= buf[0] | (buf[1] << 8);
+        crc = t[CRC_SLICES - 1][crc & 0xff] ^ t[CRC_SLICES - 2][crc >> 8] ^
+              t[CRC_SLICES - 3][buf[2]] ^ t[CRC_SLICES - 4][buf[3]]
+#if CRC_SLICES == 8
+              ^ t[3][buf[4]] ^ t[2][buf[5]] ^ t[1][buf[6]] ^ t[0][buf[7]]
+#endif
+        ;
+    }
+#endif
+    while (len--) {
+        crc = (crc >> 8) ^ t[0][(crc ^ *buf++) & 0xff];
+    }
+    return crc;
+}
+
+#else
+#error "CRC_SLICES must be 0, 1, 4 or 8"
+#endif
@@ -0,0 +1,38 @@
+/*
+ * This file is part of the Pico FIDO distribution (https://github.com/polhenarejos/pico-fido).
+ * Copyright (c) 2022 Pol Henarejos.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CRC_H_
+#define _CRC_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Number of lookup tables, set by the CRC_SLICES CMake option: 8 or 4 (slice-by-N), 1 (byte
+// table) or 0 (16-entry nibble tables in flash). Each table costs 1.5 KB of RAM; callers only
+// checksum a few dozen bytes, so the default is 0.
+#ifndef CRC_SLICES
+#define CRC_SLICES 0
+#endif
+
+// Reflected CRC-32 (poly 0xEDB88320, init and xorout 0xFFFFFFFF). Despite the name this
+// is not Castagnoli; the MKEK checksum in flash depends on it.
+extern uint32_t crc32c(const uint8_t *buf, size_t len);
+
+// CRC-16/MCRF4XX (reflected poly 0x8408, init 0xFFFF, no xorout), as used by Yubico OTP.
+extern uint16_t crc16(const uint8_t *buf, size_t len);
+
+#endif //_CRC_H_
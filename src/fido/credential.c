@@ -15,9 +15,12 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define CBOR_FILE_ID 11
+
 #include "mbedtls/chachapoly.h"
 #include "mbedtls/sha256.h"
 #include "credential.h"
+#include "cbor_arena.h"
 #if !defined(ENABLE_EMULATION) && !defined(ESP_PLATFORM)
 #include "bsp/board.h"
 #endif
@@ -183,8 +186,9 @@ err:
 int credential_load(const uint8_t *cred_id, size_t cred_id_len, const uint8_t *rp_id_hash, Credential *cred) {
     int ret = 0;
     CborError error = CborNoError;
-    uint8_t *copy_cred_id = (uint8_t *) calloc(1, cred_id_len);
-    if (!cred) {
+    size_t mark = cbor_arena_mark();
+    uint8_t *copy_cred_id = (uint8_t *) cbor_arena_alloc(cred_id_len);
+    if (!cred || !copy_cred_id) {
         CBOR_ERROR(CTAP2_ERR_INVALID_CREDENTIAL);
     }
     memset(cred, 0, sizeof(Credential));
@@ -266,7 +270,7 @@ int credential_load(const uint8_t *cred_id, size_t cred_id_len, const uint8_t *r
     cred->id.len = cred_id_len;
     cred->present = true;
 err:
-    free(copy_cred_id);
+    cbor_arena_release(mark);
     if (error != CborNoError) {
         if (error == CborErrorImproperValue) {
             return CTAP2_ERR_CBOR_UNEXPECTED_TYPE;
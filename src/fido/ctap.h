@@ -118,6 +118,7 @@ typedef struct {
 #define CTAP_CONFIG_PHY_LED_GPIO    0x7b392a394de9f948
 #define CTAP_CONFIG_PHY_LED_BTNESS  0x76a85945985d02fd
 #define CTAP_CONFIG_PHY_OPTS        0x969f3b09eceb805f
+#define CTAP_CONFIG_UP_CACHE        0x5ad8e2c6f1a0b437
 
 #define CTAP_VENDOR_CBOR            (CTAPHID_VENDOR_FIRST + 1)
 
@@ -127,6 +128,10 @@ typedef struct {
 #define CTAP_VENDOR_EA                  0x04
 #define CTAP_VENDOR_PHY_OPTS            0x05
 #define CTAP_VENDOR_MEMORY              0x06
+#define CTAP_VENDOR_CLOCK               0x07
+#define CTAP_VENDOR_TOUCH               0x08
+#define CTAP_VENDOR_ERRORS              0x09
+#define CTAP_VENDOR_CRC                 0x0A
 
 #define CTAP_PERMISSION_MC              0x01  // MakeCredential
 #define CTAP_PERMISSION_GA              0x02  // GetAssertion
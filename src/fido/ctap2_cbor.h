@@ -32,17 +32,63 @@ extern void driver_exec_finished(size_t size_next);
 extern int cbor_process(uint8_t, const uint8_t *data, size_t len);
 extern const uint8_t aaguid[16];
 
+// Encoder target of the current transport; the CTAP status byte sits at cbor_resp[-1]
+extern uint8_t *cbor_resp;
+extern size_t cbor_resp_max;
+extern void cbor_resp_set(uint8_t *buf, size_t max);
+
 extern const bool _btrue, _bfalse;
 #define ptrue (&_btrue)
 #define pfalse (&_bfalse)
 
+#define CBOR_EV_CHECK   0
+#define CBOR_EV_ERROR   1
+#define CBOR_EV_ASSERT  2
+
+typedef struct cbor_error_event {
+    int32_t code;
+    uint16_t site;      // CBOR_SITE of the failing check
+    uint8_t handler;    // CTAP command being processed
+    uint8_t kind;       // CBOR_EV_*
+} cbor_error_event_t;
+
+#define CBOR_ERROR_RING_SIZE 32 // Must be a power of two
+
+// Each source file using the macros below defines CBOR_FILE_ID before its includes:
+// 1 cbor.c, 2 cbor_client_pin.c, 3 cbor_config.c, 4 cbor_cred_mgmt.c, 5 cbor_get_assertion.c,
+// 6 cbor_get_info.c, 7 cbor_large_blobs.c, 8 cbor_make_credential.c, 9 cbor_schema.c,
+// 10 cbor_vendor.c, 11 credential.c. The site is the file ID in the top 4 bits and the line below.
+#ifndef CBOR_FILE_ID
+#define CBOR_FILE_ID 0
+#endif
+#define CBOR_SITE ((uint16_t)((CBOR_FILE_ID << 12) | (__LINE__ & 0xfff)))
+
+extern cbor_error_event_t cbor_error_ring[CBOR_ERROR_RING_SIZE];
+extern uint32_t cbor_error_count;
+extern uint8_t cbor_error_handler;
+
+static inline void cbor_error_push(int32_t code, uint16_t site, uint8_t kind) {
+    cbor_error_event_t *ev = &cbor_error_ring[cbor_error_count++ & (CBOR_ERROR_RING_SIZE - 1)];
+    ev->code = code;
+    ev->site = site;
+    ev->handler = cbor_error_handler;
+    ev->kind = kind;
+}
+
+#ifdef CBOR_VERBOSE_ERRORS
+#define CBOR_LOG(...) printf(__VA_ARGS__)
+#else
+#define CBOR_LOG(...) do { } while (0)
+#endif
+
 #define CBOR_CHECK(f)           \
     do                          \
     {                           \
         error = f;      \
         if (error != CborNoError) \
         {                       \
-            printf("Cannot encode CBOR [%s:%d]: %s (%d)\n", __FILE__, __LINE__, #f, error); \
+            cbor_error_push((int32_t)error, CBOR_SITE, CBOR_EV_CHECK); \
+            CBOR_LOG("Cannot encode CBOR [%s:%d]: %s (%d)\n", __FILE__, __LINE__, #f, error); \
             goto err; \
         } \
     } while (0)
@@ -61,7 +107,8 @@ extern const bool _btrue, _bfalse;
     do                \
     {                 \
         error = e;    \
-        printf("Cbor ERROR [%s:%d]: %x\n", __FILE__, __LINE__, e); \
+        cbor_error_push((int32_t)error, CBOR_SITE, CBOR_EV_ERROR); \
+        CBOR_LOG("Cbor ERROR [%s:%d]: %x\n", __FILE__, __LINE__, e); \
         goto err;     \
     } while (0)
 
@@ -71,7 +118,8 @@ extern const bool _btrue, _bfalse;
         if (!c)                             \
         {                                   \
             error = CborErrorImproperValue; \
-            printf("Cbor ASSERT [%s:%d]: %s\n", __FILE__, __LINE__, #c); \
+            cbor_error_push((int32_t)error, CBOR_SITE, CBOR_EV_ASSERT); \
+            CBOR_LOG("Cbor ASSERT [%s:%d]: %s\n", __FILE__, __LINE__, #c); \
             goto err;                       \
         }                                   \
     } while (0)
@@ -148,6 +196,28 @@ typedef struct CborCharString {
         (v).present = true; \
     } while (0)
 
+// Borrowed slices point into the request buffer and are not NUL terminated.
+// Indefinite-length strings fall back to an owned copy.
+#define CBOR_FIELD_BORROW_BYTES(v, _n) \
+    do { \
+        CBOR_ASSERT(cbor_value_is_byte_string(&(_f##_n)) == true); \
+        uint8_t *_b; \
+        CBOR_CHECK(cbor_borrow_string(&(_f##_n), &_b, &(v).len, &(v).nofree)); \
+        (v).data = (void *) _b; \
+        (v).present = true; \
+    } while (0)
+
+#define CBOR_FIELD_BORROW_TEXT(v, _n) \
+    do { \
+        CBOR_ASSERT(cbor_value_is_text_string(&(_f##_n)) == true); \
+        uint8_t *_b; \
+        CBOR_CHECK(cbor_borrow_string(&(_f##_n), &_b, &(v).len, &(v).nofree)); \
+        (v).data = (void *) _b; \
+        (v).present = true; \
+    } while (0)
+
+#define CBOR_TEXT_EQUAL(v, t) ((v).len == sizeof(t) - 1 && memcmp((v).data, (t), sizeof(t) - 1) == 0)
+
 #define CBOR_FIELD_GET_BOOL(v, _n) \
     do { \
         CBOR_ASSERT(cbor_value_is_boolean(&(_f##_n)) == true); \
@@ -157,14 +227,20 @@ typedef struct CborCharString {
         CBOR_CHECK(cbor_value_advance_fixed(&(_f##_n))); \
     } while (0)
 
+// Text map keys are borrowed from the buffer and matched by length, first byte and
+// then the remaining bytes, so mismatches are rejected without touching the key.
 #define CBOR_FIELD_GET_KEY_TEXT(_n) \
     CBOR_ASSERT(cbor_value_is_text_string(&(_f##_n)) == true); \
-    char _fd##_n[64] = {0}; \
-    size_t _fdl##_n = sizeof(_fd##_n); \
-    CBOR_CHECK(cbor_value_copy_text_string(&(_f##_n), _fd##_n, &_fdl##_n, &(_f##_n)))
+    const uint8_t *_fd##_n = NULL; \
+    size_t _fdl##_n = 0; \
+    CBOR_CHECK(cbor_borrow_key(&(_f##_n), &_fd##_n, &_fdl##_n))
+
+#define CBOR_KEY_TEXT_IS(_n, _t) \
+    (_fdl##_n == sizeof(_t) - 1 && _fd##_n[0] == (uint8_t)(_t)[0] && \
+     memcmp(_fd##_n + 1, (_t) + 1, sizeof(_t) - 2) == 0)
 
 #define CBOR_FIELD_KEY_TEXT_VAL_TEXT(_n, _t, _v) \
-    if (strcmp(_fd##_n, _t) == 0) { \
+    if (CBOR_KEY_TEXT_IS(_n, _t)) { \
         CBOR_ASSERT(cbor_value_is_text_string(&_f##_n) == true); \
         CBOR_CHECK(cbor_value_dup_text_string(&(_f##_n), &(_v).data, &(_v).len, &(_f##_n))); \
         (_v).present = true; \
@@ -172,27 +248,39 @@ typedef struct CborCharString {
     }
 
 #define CBOR_FIELD_KEY_TEXT_VAL_BYTES(_n, _t, _v) \
-    if (strcmp(_fd##_n, _t) == 0) { \
+    if (CBOR_KEY_TEXT_IS(_n, _t)) { \
         CBOR_ASSERT(cbor_value_is_byte_string(&_f##_n) == true); \
         CBOR_CHECK(cbor_value_dup_byte_string(&(_f##_n), &(_v).data, &(_v).len, &(_f##_n))); \
         (_v).present = true; \
         continue; \
     }
 
+#define CBOR_FIELD_KEY_TEXT_VAL_BORROW_TEXT(_n, _t, _v) \
+    if (CBOR_KEY_TEXT_IS(_n, _t)) { \
+        CBOR_FIELD_BORROW_TEXT(_v, _n); \
+        continue; \
+    }
+
+#define CBOR_FIELD_KEY_TEXT_VAL_BORROW_BYTES(_n, _t, _v) \
+    if (CBOR_KEY_TEXT_IS(_n, _t)) { \
+        CBOR_FIELD_BORROW_BYTES(_v, _n); \
+        continue; \
+    }
+
 #define CBOR_FIELD_KEY_TEXT_VAL_INT(_n, _t, _v) \
-    if (strcmp(_fd##_n, _t) == 0) { \
+    if (CBOR_KEY_TEXT_IS(_n, _t)) { \
         CBOR_FIELD_GET_INT(_v, _n); \
         continue; \
     }
 
 #define CBOR_FIELD_KEY_TEXT_VAL_UINT(_n, _t, _v) \
-    if (strcmp(_fd##_n, _t) == 0) { \
+    if (CBOR_KEY_TEXT_IS(_n, _t)) { \
         CBOR_FIELD_GET_UINT(_v, _n); \
         continue; \
     }
 
 #define CBOR_FIELD_KEY_TEXT_VAL_BOOL(_n, _t, _v) \
-    if (strcmp(_fd##_n, _t) == 0) { \
+    if (CBOR_KEY_TEXT_IS(_n, _t)) { \
         CBOR_FIELD_GET_BOOL(_v, _n); \
         continue; \
     }
@@ -215,7 +303,7 @@ typedef struct CborCharString {
     do { \
         if ((v).data && (v).len > 0) { \
             CBOR_CHECK(cbor_encode_uint(&(p), (k))); \
-            CBOR_CHECK(cbor_encode_text_stringz(&(p), (v).data)); \
+            CBOR_CHECK(cbor_encode_text_string(&(p), (v).data, (v).len)); \
         } } while (0)
 
 
@@ -244,6 +332,8 @@ typedef struct CborCharString {
             CBOR_CHECK(cbor_encode_boolean(&(p), v == ptrue ? true : false)); \
         } } while (0)
 
+extern CborError cbor_borrow_key(CborValue *it, const uint8_t **data, size_t *len);
+extern CborError cbor_borrow_string(CborValue *it, uint8_t **data, size_t *len, bool *nofree);
 extern CborError COSE_key(mbedtls_ecp_keypair *, CborEncoder *, CborEncoder *);
 extern CborError COSE_key_shared(mbedtls_ecdh_context *key,
                                  CborEncoder *mapEncoderParent,
@@ -166,6 +166,42 @@ int fido_load_key(int curve, const uint8_t *cred_id, mbedtls_ecp_keypair *key) {
     return derive_key(NULL, false, key_path, mbedtls_curve, key);
 }
 
+const mbedtls_md_info_t *fido_sig_md(mbedtls_ecp_group_id id) {
+    if (id == MBEDTLS_ECP_DP_SECP384R1) {
+        return mbedtls_md_info_from_type(MBEDTLS_MD_SHA384);
+    }
+    else if (id == MBEDTLS_ECP_DP_SECP521R1) {
+        return mbedtls_md_info_from_type(MBEDTLS_MD_SHA512);
+    }
+#ifdef MBEDTLS_EDDSA_C
+    else if (id == MBEDTLS_ECP_DP_ED25519) {
+        return NULL; // Pure EdDSA signs the message itself
+    }
+#endif
+    return mbedtls_md_info_from_type(MBEDTLS_MD_SHA256);
+}
+
+// Hashes authData || clientDataHash without concatenating them
+int fido_sig_hash(const mbedtls_md_info_t *md, const uint8_t *aut_data, size_t aut_data_len, const uint8_t *cdh, size_t cdh_len, uint8_t *hash) {
+    mbedtls_md_context_t ctx;
+    mbedtls_md_init(&ctx);
+    int ret = mbedtls_md_setup(&ctx, md, 0);
+    if (ret == 0) {
+        ret = mbedtls_md_starts(&ctx);
+    }
+    if (ret == 0) {
+        ret = mbedtls_md_update(&ctx, aut_data, aut_data_len);
+    }
+    if (ret == 0) {
+        ret = mbedtls_md_update(&ctx, cdh, cdh_len);
+    }
+    if (ret == 0) {
+        ret = mbedtls_md_finish(&ctx, hash);
+    }
+    mbedtls_md_free(&ctx);
+    return ret;
+}
+
 int x509_create_cert(mbedtls_ecdsa_context *ecdsa, uint8_t *buffer, size_t buffer_size) {
     mbedtls_x509write_cert ctx;
     mbedtls_x509write_crt_init(&ctx);
@@ -401,17 +437,13 @@ int scan_files_fido() {
         file_put_data(ef_pin, pin_data, 34);
     }
     ef_authtoken = search_by_fid(EF_AUTHTOKEN, NULL, SPECIFY_EF);
-    if (ef_authtoken) {
-        if (!file_has_data(ef_authtoken)) {
-            uint8_t t[32];
-            random_gen(NULL, t, sizeof(t));
-            file_put_data(ef_authtoken, t, sizeof(t));
-        }
-        paut.data = file_get_data(ef_authtoken);
-        paut.len = file_get_size(ef_authtoken);
-    }
-    else {
+    if (file_has_data(ef_authtoken)) { // Token lives in RAM only. Wipe the copy left by older versions
+        flash_clear_file(ef_authtoken);
     }
+    stopUsingPinUvAuthToken();
+    resetPinUvAuthToken();
+    file_t *ef_up_cache = search_by_fid(EF_UP_CACHE, NULL, SPECIFY_EF);
+    up_cache_window = file_has_data(ef_up_cache) ? *file_get_data(ef_up_cache) : 0;
     ef_largeblob = search_by_fid(EF_LARGEBLOB, NULL, SPECIFY_EF);
     if (!file_has_data(ef_largeblob)) {
         file_put_data(ef_largeblob, (const uint8_t *) "\x80\x76\xbe\x8b\x52\x8d\x00\x75\xf7\xaa\xe9\x8d\x6f\xa5\x7a\x6d\x3c", 17);
@@ -467,9 +499,26 @@ void init_fido() {
     init_touch();
     scan_all();
     init_otp();
+    get_info_invalidate();
+#if ENABLE_OATH_APP
+    oath_index_invalidate();
+#endif
 }
 
+#ifdef ENABLE_EMULATION
+uint32_t touch_count = 0;
+uint8_t touch_script[16] = {0};
+uint8_t touch_script_len = 0, touch_script_pos = 0;
+#endif
+
 bool wait_button_pressed() {
+#ifdef ENABLE_EMULATION
+    touch_count++;
+    if (touch_script_pos < touch_script_len) { // 0 simulates a timeout
+        return touch_script[touch_script_pos++] == 0;
+    }
+    return false;
+#else
     absolute_time_t start = get_absolute_time();
     uint32_t led_mode = led_get_mode();
     
@@ -489,16 +538,31 @@ bool wait_button_pressed() {
 
     led_set_mode(MODE_NOT_MOUNTED);
     return true; // timeout
+#endif
 }
 
 uint32_t user_present_time_limit = 0;
-
-bool check_user_presence() {
-    if (user_present_time_limit == 0 || user_present_time_limit + TRANSPORT_TIME_LIMIT < board_millis()) {
-        if (wait_button_pressed() == true) { //timeout
-            return false;
+uint8_t up_cache_window = 0;
+uint8_t up_cache_rp_id_hash[32] = {0};
+
+// A touch is reused within up_cache_window only for the RP it was given for, and never across
+// pinUvAuthToken resets. rp_id_hash is NULL for the authenticator selection touch, which is never cached.
+bool check_user_presence(const uint8_t *rp_id_hash) {
+    bool cacheable = up_cache_window > 0 && rp_id_hash != NULL &&
+                     (paut.in_use == false || paut.has_rp_id == false || memcmp(paut.rp_id_hash, rp_id_hash, 32) == 0);
+    if (cacheable && user_present_time_limit != 0 && memcmp(up_cache_rp_id_hash, rp_id_hash, 32) == 0 &&
+        (int32_t)(fido_millis() - (user_present_time_limit + up_cache_window * 1000)) <= 0) {
+        if (paut.in_use == true) {
+            paut.user_present = true;
         }
-        //user_present_time_limit = board_millis();
+        return true;
+    }
+    if (wait_button_pressed() == true) { //timeout
+        return false;
+    }
+    if (cacheable) {
+        user_present_time_limit = fido_millis();
+        memcpy(up_cache_rp_id_hash, rp_id_hash, 32);
     }
     return true;
 }
@@ -520,24 +584,29 @@ void set_opts(uint8_t opts) {
     file_t *ef = search_by_fid(EF_OPTS, NULL, SPECIFY_EF);
     file_put_data(ef, &opts, sizeof(uint8_t));
     low_flash_available();
+    get_info_invalidate();
 }
 
 extern int cmd_register();
 extern int cmd_authenticate();
 extern int cmd_version();
-extern int cbor_parse(int, uint8_t *, size_t);
+extern int cbor_parse(uint8_t, const uint8_t *, size_t);
+extern uint8_t *cbor_resp;
+extern void cbor_resp_set(uint8_t *buf, size_t max);
 
 #define CTAP_CBOR 0x10
 
 int cmd_cbor() {
     uint8_t *old_buf = res_APDU;
-    int ret = cbor_parse(0x90, apdu.data, apdu.nc);
+    // Encode straight after the status byte, no copy from the HID buffer
+    cbor_resp_set(old_buf + 1, CTAP_MAX_CBOR_PAYLOAD);
+    res_APDU = cbor_resp;
+    int ret = cbor_parse(CTAPHID_CBOR, apdu.data, apdu.nc);
+    res_APDU = old_buf;
     if (ret != 0) {
         return SW_EXEC_ERROR();
     }
-    res_APDU = old_buf;
     res_APDU_size += 1;
-    memcpy(res_APDU, ctap_resp->init.data, res_APDU_size);
     return SW_OK();
 }
 
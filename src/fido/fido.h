@@ -56,6 +56,8 @@ extern mbedtls_ecp_group_id fido_curve_to_mbedtls(int curve);
 extern int mbedtls_curve_to_fido(mbedtls_ecp_group_id id);
 extern int fido_load_key(int curve, const uint8_t *cred_id, mbedtls_ecp_keypair *key);
 extern int load_keydev(uint8_t *key);
+extern const mbedtls_md_info_t *fido_sig_md(mbedtls_ecp_group_id id);
+extern int fido_sig_hash(const mbedtls_md_info_t *md, const uint8_t *aut_data, size_t aut_data_len, const uint8_t *cdh, size_t cdh_len, uint8_t *hash);
 extern int encrypt(uint8_t protocol, const uint8_t *key, const uint8_t *in, uint16_t in_len, uint8_t *out);
 extern int decrypt(uint8_t protocol, const uint8_t *key, const uint8_t *in, uint16_t in_len, uint8_t *out);
 extern int ecdh(uint8_t protocol, const mbedtls_ecp_point *Q, uint8_t *sharedSecret);
@@ -97,6 +99,8 @@ extern void send_keepalive();
 extern uint32_t get_sign_counter();
 extern uint8_t get_opts();
 extern void set_opts(uint8_t);
+extern void get_info_invalidate();
+extern void oath_index_invalidate();
 #define MAX_CREDENTIAL_COUNT_IN_LIST 16
 #define MAX_CRED_ID_LENGTH        1024
 #define MAX_RESIDENT_CREDENTIALS  256
@@ -116,10 +120,10 @@ extern const known_app_t *find_app_by_rp_id_hash(const uint8_t *rp_id_hash);
 
 #define TRANSPORT_TIME_LIMIT (30 * 1000) //USB
 
-bool check_user_presence();
+bool check_user_presence(const uint8_t *rp_id_hash);
 
 typedef struct pinUvAuthToken {
-    uint8_t *data;
+    uint8_t data[32];
     size_t len;
     bool in_use;
     uint8_t permissions;
@@ -130,8 +134,25 @@ typedef struct pinUvAuthToken {
 } pinUvAuthToken_t;
 
 extern uint32_t user_present_time_limit;
+extern uint8_t up_cache_window;
+#define MAX_UP_CACHE_WINDOW     60 // seconds
+
+#ifdef ENABLE_EMULATION
+extern uint32_t emulation_clock_skew;
+#define fido_millis() (board_millis() + emulation_clock_skew)
+extern uint32_t touch_count;
+extern uint8_t touch_script[16];
+extern uint8_t touch_script_len, touch_script_pos;
+#else
+#define fido_millis() board_millis()
+#endif
 
 extern pinUvAuthToken_t paut;
+extern int resetPinUvAuthToken();
+extern void stopUsingPinUvAuthToken();
+extern int pinUvAuthTokenUsageTimerObserver();
+extern bool fill_key_agreement_pool();
+extern void free_key_agreement_pool();
 extern int verify(uint8_t protocol, const uint8_t *key, const uint8_t *data, uint16_t len, uint8_t *sign);
 
 extern uint8_t session_pin[32];
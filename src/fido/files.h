@@ -34,10 +34,13 @@
 #define EF_CRED         0xCF00 // Creds at 0xCF00 - 0xCFFF
 #define EF_RP           0xD000 // RPs at 0xD000 - 0xD0FF
 #define EF_LARGEBLOB    0x1101 // Large Blob Array
+#define EF_UP_CACHE     0x1102 // User presence caching window (s)
 #define EF_OATH_CRED    0xBA00 // OATH Creds at 0xBA00 - 0xBAFE
 #define EF_OATH_CODE    0xBAFF
 #define EF_OTP_SLOT1    0xBB00
 #define EF_OTP_SLOT2    0xBB01
+#define EF_OATH_STORE   0xBC00 // Packed OATH records at 0xBC00 - 0xBC3F
+#define EF_OATH_CTR     0xBC40 // HOTP counter log
 #define EF_OTP_PIN      0x10A0 // Nitrokey OTP PIN
 
 extern file_t *ef_keydev;
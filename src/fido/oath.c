@@ -24,8 +24,12 @@
 #include "asn1.h"
 #include "crypto_utils.h"
 #include "management.h"
+#include "oath_store.h"
+#include "mbedtls/sha1.h"
+#include "mbedtls/sha256.h"
+#include "mbedtls/sha512.h"
+#include "mbedtls/platform_util.h"
 
-#define MAX_OATH_CRED   255
 #define CHALLENGE_LEN   8
 #define MAX_OTP_COUNTER 3
 
@@ -61,8 +65,26 @@ int oath_process_apdu();
 int oath_unload();
 
 static bool validated = true;
+static void oath_hmac_wipe();
+static void oath_batch_free();
+static int oath_send_page();
 static uint8_t challenge[CHALLENGE_LEN] = { 0 };
 
+// LIST and CALCULATE ALL are served in pages of at most OATH_PAGE_SIZE bytes. Codes are
+// computed while each page is built, and SEND REMAINING resumes from the next slot.
+#ifndef OATH_PAGE_SIZE
+#define OATH_PAGE_SIZE  256
+#endif
+
+static struct {
+    bool active;
+    bool list;
+    uint8_t truncate;
+    uint8_t chal_len;
+    uint8_t chal[64];
+    int next;
+} oath_page = { 0 };
+
 const uint8_t oath_aid[] = {
     7,
     0xa0, 0x00, 0x00, 0x05, 0x27, 0x21, 0x01
@@ -73,6 +95,9 @@ int oath_select(app_t *a, uint8_t force) {
     if (cap_supported(CAP_OATH)) {
         a->process_apdu = oath_process_apdu;
         a->unload = oath_unload;
+        if (oath_store_loaded() == false) {
+            oath_store_load();
+        }
         res_APDU_size = 0;
         res_APDU[res_APDU_size++] = TAG_T_VERSION;
         res_APDU[res_APDU_size++] = 3;
@@ -97,8 +122,10 @@ int oath_select(app_t *a, uint8_t force) {
             res_APDU[res_APDU_size++] = *pin_data;
         }
         res_APDU[res_APDU_size++] = TAG_ALGO;
-        res_APDU[res_APDU_size++] = 1;
+        res_APDU[res_APDU_size++] = 3;
         res_APDU[res_APDU_size++] = ALG_HMAC_SHA1;
+        res_APDU[res_APDU_size++] = ALG_HMAC_SHA256;
+        res_APDU[res_APDU_size++] = ALG_HMAC_SHA512;
         apdu.ne = res_APDU_size;
         return PICOKEY_OK;
     }
@@ -110,68 +137,485 @@ INITIALIZER ( oath_ctor ) {
 }
 
 int oath_unload() {
+    oath_page.active = false;
+    oath_batch_free();
+    oath_hmac_wipe();
     return PICOKEY_OK;
 }
 
-file_t *find_oath_cred(const uint8_t *name, size_t name_len) {
-    for (int i = 0; i < MAX_OATH_CRED; i++) {
-        file_t *ef = search_dynamic_file((uint16_t)(EF_OATH_CRED + i));
-        asn1_ctx_t ctxi, ef_tag = { 0 };
-        asn1_ctx_init(file_get_data(ef), file_get_size(ef), &ctxi);
-        if (file_has_data(ef) && asn1_find_tag(&ctxi, TAG_NAME, &ef_tag) == true && ef_tag.len == name_len && memcmp(ef_tag.data, name, name_len) == 0) {
-            return ef;
+void oath_index_invalidate() {
+    oath_store_invalidate();
+    oath_hmac_wipe();
+}
+
+const mbedtls_md_info_t *get_oath_md_info(uint8_t alg) {
+    if ((alg & ALG_MASK) == ALG_HMAC_SHA1) {
+        return mbedtls_md_info_from_type(MBEDTLS_MD_SHA1);
+    }
+    else if ((alg & ALG_MASK) == ALG_HMAC_SHA256) {
+        return mbedtls_md_info_from_type(MBEDTLS_MD_SHA256);
+    }
+    else if ((alg & ALG_MASK) == ALG_HMAC_SHA512) {
+        return mbedtls_md_info_from_type(MBEDTLS_MD_SHA512);
+    }
+    return NULL;
+}
+
+// HMAC midstates after absorbing each credential's ipad/opad block, filled lazily per slot.
+// SHA-512 contexts are twice the size of the others, so they live in a smaller pool of
+// their own and the entry only points at them.
+#ifndef OATH_HMAC_CACHE_SIZE
+#define OATH_HMAC_CACHE_SIZE    32
+#endif
+#ifndef OATH_HMAC512_CACHE_SIZE
+#define OATH_HMAC512_CACHE_SIZE 4
+#endif
+
+typedef struct {
+    uint16_t slot;
+    uint8_t alg;
+    union {
+        mbedtls_sha1_context sha1[2];
+        mbedtls_sha256_context sha256[2];
+        mbedtls_sha512_context *sha512;
+    } ctx;
+} oath_hmac_t;
+
+static oath_hmac_t oath_hmac_cache[OATH_HMAC_CACHE_SIZE];
+static uint8_t oath_hmac_used = 0;
+static mbedtls_sha512_context oath_hmac512[OATH_HMAC512_CACHE_SIZE][2];
+static bool oath_hmac512_busy[OATH_HMAC512_CACHE_SIZE];
+
+static void oath_hmac_wipe() {
+    mbedtls_platform_zeroize(oath_hmac_cache, sizeof(oath_hmac_cache));
+    mbedtls_platform_zeroize(oath_hmac512, sizeof(oath_hmac512));
+    memset(oath_hmac512_busy, 0, sizeof(oath_hmac512_busy));
+    oath_hmac_used = 0;
+}
+
+static oath_hmac_t *oath_hmac_find(int slot) {
+    for (uint8_t e = 0; e < oath_hmac_used; e++) {
+        if (oath_hmac_cache[e].slot == slot) {
+            return &oath_hmac_cache[e];
         }
     }
     return NULL;
 }
 
+static void oath_hmac_drop(int slot) {
+    oath_hmac_t *h = oath_hmac_find(slot);
+    if (h == NULL) {
+        return;
+    }
+    oath_hmac_t *last = &oath_hmac_cache[oath_hmac_used - 1];
+    if (h->alg == ALG_HMAC_SHA512) {
+        int i = (int)(h->ctx.sha512 - oath_hmac512[0]) / 2;
+        mbedtls_platform_zeroize(oath_hmac512[i], sizeof(oath_hmac512[i]));
+        oath_hmac512_busy[i] = false;
+    }
+    if (h != last) {
+        *h = *last;
+    }
+    mbedtls_platform_zeroize(last, sizeof(oath_hmac_t));
+    oath_hmac_used--;
+}
+
+// For SHA-512, h->ctx.sha512 must already point at two free contexts.
+static void oath_hmac_setup(oath_hmac_t *h, uint8_t alg, const uint8_t *key, size_t key_len) {
+    uint8_t pad[128], sum[64];
+    size_t block = alg == ALG_HMAC_SHA512 ? 128 : 64;
+    if (key_len > block) {
+        if (alg == ALG_HMAC_SHA1) {
+            mbedtls_sha1(key, key_len, sum);
+            key_len = 20;
+        }
+        else if (alg == ALG_HMAC_SHA256) {
+            mbedtls_sha256(key, key_len, sum, 0);
+            key_len = 32;
+        }
+        else {
+            mbedtls_sha512(key, key_len, sum, 0);
+            key_len = 64;
+        }
+        key = sum;
+    }
+    h->alg = alg;
+    for (int i = 0; i < 2; i++) {
+        memset(pad, i == 0 ? 0x36 : 0x5c, block);
+        for (size_t j = 0; j < key_len; j++) {
+            pad[j] ^= key[j];
+        }
+        if (alg == ALG_HMAC_SHA1) {
+            mbedtls_sha1_init(&h->ctx.sha1[i]);
+            mbedtls_sha1_starts(&h->ctx.sha1[i]);
+            mbedtls_sha1_update(&h->ctx.sha1[i], pad, block);
+        }
+        else if (alg == ALG_HMAC_SHA256) {
+            mbedtls_sha256_init(&h->ctx.sha256[i]);
+            mbedtls_sha256_starts(&h->ctx.sha256[i], 0);
+            mbedtls_sha256_update(&h->ctx.sha256[i], pad, block);
+        }
+        else {
+            mbedtls_sha512_init(&h->ctx.sha512[i]);
+            mbedtls_sha512_starts(&h->ctx.sha512[i], 0);
+            mbedtls_sha512_update(&h->ctx.sha512[i], pad, block);
+        }
+    }
+    mbedtls_platform_zeroize(pad, sizeof(pad));
+    mbedtls_platform_zeroize(sum, sizeof(sum));
+}
+
+static int oath_hmac_finish(const oath_hmac_t *h, const uint8_t *chal, size_t chal_len, uint8_t *hmac) {
+    int ret = 0;
+    if (h->alg == ALG_HMAC_SHA1) {
+        mbedtls_sha1_context ctx;
+        mbedtls_sha1_init(&ctx);
+        mbedtls_sha1_clone(&ctx, &h->ctx.sha1[0]);
+        ret = mbedtls_sha1_update(&ctx, chal, chal_len);
+        if (ret == 0) {
+            ret = mbedtls_sha1_finish(&ctx, hmac);
+        }
+        if (ret == 0) {
+            mbedtls_sha1_clone(&ctx, &h->ctx.sha1[1]);
+            ret = mbedtls_sha1_update(&ctx, hmac, 20);
+        }
+        if (ret == 0) {
+            ret = mbedtls_sha1_finish(&ctx, hmac);
+        }
+        mbedtls_sha1_free(&ctx);
+    }
+    else if (h->alg == ALG_HMAC_SHA256) {
+        mbedtls_sha256_context ctx;
+        mbedtls_sha256_init(&ctx);
+        mbedtls_sha256_clone(&ctx, &h->ctx.sha256[0]);
+        ret = mbedtls_sha256_update(&ctx, chal, chal_len);
+        if (ret == 0) {
+            ret = mbedtls_sha256_finish(&ctx, hmac);
+        }
+        if (ret == 0) {
+            mbedtls_sha256_clone(&ctx, &h->ctx.sha256[1]);
+            ret = mbedtls_sha256_update(&ctx, hmac, 32);
+        }
+        if (ret == 0) {
+            ret = mbedtls_sha256_finish(&ctx, hmac);
+        }
+        mbedtls_sha256_free(&ctx);
+    }
+    else {
+        mbedtls_sha512_context ctx;
+        mbedtls_sha512_init(&ctx);
+        mbedtls_sha512_clone(&ctx, &h->ctx.sha512[0]);
+        ret = mbedtls_sha512_update(&ctx, chal, chal_len);
+        if (ret == 0) {
+            ret = mbedtls_sha512_finish(&ctx, hmac);
+        }
+        if (ret == 0) {
+            mbedtls_sha512_clone(&ctx, &h->ctx.sha512[1]);
+            ret = mbedtls_sha512_update(&ctx, hmac, 64);
+        }
+        if (ret == 0) {
+            ret = mbedtls_sha512_finish(&ctx, hmac);
+        }
+        mbedtls_sha512_free(&ctx);
+    }
+    return ret;
+}
+
+static oath_hmac_t *oath_hmac_add(int slot, uint8_t alg, const uint8_t *key, size_t key_len) {
+    if (oath_hmac_used >= OATH_HMAC_CACHE_SIZE) {
+        return NULL;
+    }
+    oath_hmac_t *h = &oath_hmac_cache[oath_hmac_used];
+    if (alg == ALG_HMAC_SHA512) {
+        int i = 0;
+        for (; i < OATH_HMAC512_CACHE_SIZE && oath_hmac512_busy[i]; i++);
+        if (i == OATH_HMAC512_CACHE_SIZE) {
+            return NULL;
+        }
+        oath_hmac512_busy[i] = true;
+        h->ctx.sha512 = oath_hmac512[i];
+    }
+    h->slot = (uint16_t)slot;
+    oath_hmac_setup(h, alg, key, key_len);
+    oath_hmac_used++;
+    return h;
+}
+
+static int oath_hmac(int slot, const uint8_t *key, size_t key_len, const uint8_t *chal, size_t chal_len, uint8_t *hmac) {
+    uint8_t alg = key[0] & ALG_MASK;
+    if (slot >= 0 && get_oath_md_info(alg) != NULL) {
+        oath_hmac_t *h = oath_hmac_find(slot);
+        if (h != NULL && h->alg != alg) {
+            oath_hmac_drop(slot);
+            h = NULL;
+        }
+        if (h == NULL) {
+            h = oath_hmac_add(slot, alg, key + 2, key_len - 2);
+        }
+        if (h != NULL) {
+            return oath_hmac_finish(h, chal, chal_len, hmac);
+        }
+    }
+    return mbedtls_md_hmac(get_oath_md_info(alg), key + 2, key_len - 2, chal, chal_len, hmac);
+}
+
+// Writes the live HOTP counter of slot into the IMF of rec, a copy of its stored record, so
+// rewriting the copy does not roll the counter back to the last folded value.
+static void oath_carry_counter(int slot, uint8_t *rec, uint16_t len) {
+    uint64_t ctr = 0;
+    asn1_ctx_t ctxo, imf = { 0 };
+    asn1_ctx_init(rec, len, &ctxo);
+    if (oath_store_counter(slot, &ctr) && asn1_find_tag(&ctxo, TAG_IMF, &imf) && imf.len == 8) {
+        put_uint64_t_be(ctr, imf.data);
+    }
+}
+
+// Copies a PUT body into rec, widening the HOTP moving factor to 8 bytes. rec must hold len + 10 bytes.
+static uint16_t oath_put_record(const uint8_t *data, uint16_t len, uint8_t *rec) {
+    asn1_ctx_t ctxi, key = { 0 }, name = { 0 }, imf = { 0 };
+    asn1_ctx_init((uint8_t *)data, len, &ctxi);
+    if (asn1_find_tag(&ctxi, TAG_KEY, &key) == false || key.len < 2 || asn1_find_tag(&ctxi, TAG_NAME, &name) == false) {
+        return 0;
+    }
+    if (get_oath_md_info(key.data[0]) == NULL) {
+        return 0;
+    }
+    bool hotp = (key.data[0] & OATH_TYPE_MASK) == OATH_TYPE_HOTP;
+    if (hotp && asn1_find_tag(&ctxi, TAG_IMF, &imf) == true && imf.len > 8) {
+        return 0;
+    }
+    uint16_t n = 0, tag = 0, tag_len = 0;
+    uint8_t *p = NULL, *tag_data = NULL;
+    for (uint8_t *tlv = ctxi.data; walk_tlv(&ctxi, &p, &tag, &tag_len, &tag_data); tlv = p) {
+        if (hotp && tag == TAG_IMF) {
+            continue;
+        }
+        memcpy(rec + n, tlv, tag_data + tag_len - tlv);
+        n += (uint16_t)(tag_data + tag_len - tlv);
+    }
+    if (hotp) {
+        rec[n++] = TAG_IMF;
+        rec[n++] = 8;
+        memset(rec + n, 0, 8 - imf.len);
+        if (imf.len > 0) {
+            memcpy(rec + n + 8 - imf.len, imf.data, imf.len);
+        }
+        n += 8;
+    }
+    return n;
+}
+
 int cmd_put() {
     if (validated == false) {
         return SW_SECURITY_STATUS_NOT_SATISFIED();
     }
-    asn1_ctx_t ctxi, key = { 0 }, name = { 0 }, imf = { 0 };
-    asn1_ctx_init(apdu.data, (uint16_t)apdu.nc, &ctxi);
-    if (asn1_find_tag(&ctxi, TAG_KEY, &key) == false) {
-        return SW_INCORRECT_PARAMS();
+    uint8_t *rec = (uint8_t *) calloc(1, apdu.nc + 10);
+    if (rec == NULL) {
+        return SW_MEMORY_FAILURE();
     }
-    if (asn1_find_tag(&ctxi, TAG_NAME, &name) == false) {
+    uint16_t rec_len = oath_put_record(apdu.data, (uint16_t)apdu.nc, rec);
+    if (rec_len == 0) {
+        free(rec);
         return SW_INCORRECT_PARAMS();
     }
-    if ((key.data[0] & OATH_TYPE_MASK) == OATH_TYPE_HOTP) {
-        if (asn1_find_tag(&ctxi, TAG_IMF, &imf) == false) {
-            memcpy(apdu.data + apdu.nc, "\x7a\x08\x00\x00\x00\x00\x00\x00\x00\x00", 10);
-            apdu.nc += 10;
-        }
-        else { //prepend zero-valued bytes
-            if (imf.len < 8) {
-                memmove(imf.data + (8 - imf.len), imf.data, imf.len);
-                memset(imf.data, 0, 8 - imf.len);
-                *(imf.data - 1) = 8;
-                apdu.nc += (8 - imf.len);
-            }
+    asn1_ctx_t ctxi, name = { 0 };
+    asn1_ctx_init(rec, rec_len, &ctxi);
+    asn1_find_tag(&ctxi, TAG_NAME, &name);
+    int slot = oath_store_find(name.data, name.len);
+    if (slot >= 0) {
+        oath_hmac_drop(slot);
+    }
+    slot = oath_store_put(slot, rec, rec_len);
+    free(rec);
+    if (slot == PICOKEY_ERR_NO_MEMORY) {
+        return SW_FILE_FULL();
+    }
+    if (slot < 0) {
+        return SW_EXEC_ERROR();
+    }
+    low_flash_available();
+    return SW_OK();
+}
+
+// Batched PUT: the body is a sequence of PUT bodies, each starting with its name tag,
+// sent with ISO command chaining. Nothing is stored unless every entry fits.
+#ifndef OATH_BATCH_MAX
+#define OATH_BATCH_MAX  8192
+#endif
+
+static uint8_t *oath_batch = NULL;
+static uint16_t oath_batch_len = 0;
 
+static void oath_batch_free() {
+    if (oath_batch) {
+        mbedtls_platform_zeroize(oath_batch, oath_batch_len);
+        free(oath_batch);
+    }
+    oath_batch = NULL;
+    oath_batch_len = 0;
+}
+
+static bool oath_rec_name(const uint8_t *rec, uint16_t len, asn1_ctx_t *name) {
+    asn1_ctx_t ctxi;
+    asn1_ctx_init((uint8_t *)rec, len, &ctxi);
+    return asn1_find_tag(&ctxi, TAG_NAME, name);
+}
+
+static int oath_batch_commit() {
+    asn1_ctx_t ctxi;
+    uint16_t n = 0, tag = 0, tag_len = 0;
+    uint8_t *p = NULL, *tag_data = NULL;
+    asn1_ctx_init(oath_batch, oath_batch_len, &ctxi);
+    for (uint8_t *tlv = ctxi.data; walk_tlv(&ctxi, &p, &tag, &tag_len, &tag_data); tlv = p) {
+        if (tlv == ctxi.data && tag != TAG_NAME) {
+            return SW_INCORRECT_PARAMS();
         }
+        n += (tag == TAG_NAME);
     }
-    file_t *ef = find_oath_cred(name.data, name.len);
-    if (file_has_data(ef)) {
-        file_put_data(ef, apdu.data, (uint16_t)apdu.nc);
-        low_flash_available();
+    if (n == 0 || p != ctxi.data + ctxi.len) {
+        return SW_INCORRECT_PARAMS();
     }
-    else {
-        for (int i = 0; i < MAX_OATH_CRED; i++) {
-            file_t *tef = search_dynamic_file((uint16_t)(EF_OATH_CRED + i));
-            if (!file_has_data(tef)) {
-                tef = file_new((uint16_t)(EF_OATH_CRED + i));
-                file_put_data(tef, apdu.data, (uint16_t)apdu.nc);
-                low_flash_available();
-                return SW_OK();
+    size_t recs_size = oath_batch_len + 10 * n;
+    uint8_t *recs = (uint8_t *) calloc(1, recs_size);
+    int *ids = (int *) calloc(n, sizeof(int));
+    uint16_t *lens = (uint16_t *) calloc(n, sizeof(uint16_t));
+    uint16_t *offs = (uint16_t *) calloc(n + 1, sizeof(uint16_t));
+    uint16_t *old_lens = (uint16_t *) calloc(n, sizeof(uint16_t));
+    int *put_ids = (int *) calloc(n, sizeof(int));
+    uint8_t *olds = NULL;
+    size_t olds_size = 0;
+    int ret = SW_OK();
+    if (recs == NULL || ids == NULL || lens == NULL || offs == NULL || old_lens == NULL || put_ids == NULL) {
+        ret = SW_MEMORY_FAILURE();
+        goto err;
+    }
+    uint16_t e = 0;
+    uint8_t *start = NULL;
+    p = NULL;
+    for (uint8_t *tlv = ctxi.data;; tlv = p) {
+        bool more = walk_tlv(&ctxi, &p, &tag, &tag_len, &tag_data);
+        if (start && (more == false || tag == TAG_NAME)) {
+            asn1_ctx_t name = { 0 }, prev = { 0 };
+            lens[e] = oath_put_record(start, (uint16_t)(tlv - start), recs + offs[e]);
+            if (lens[e] == 0) {
+                ret = SW_INCORRECT_PARAMS();
+                goto err;
             }
+            oath_rec_name(recs + offs[e], lens[e], &name);
+            for (uint16_t k = 0; k < e; k++) {
+                oath_rec_name(recs + offs[k], lens[k], &prev);
+                if (prev.len == name.len && memcmp(prev.data, name.data, name.len) == 0) {
+                    ret = SW_WRONG_DATA();
+                    goto err;
+                }
+            }
+            ids[e] = oath_store_find(name.data, name.len);
+            offs[e + 1] = offs[e] + lens[e];
+            e++;
+        }
+        if (more == false) {
+            break;
+        }
+        if (tag == TAG_NAME) {
+            start = tlv;
         }
-        return SW_FILE_FULL();
     }
-    return SW_OK();
+    if (oath_store_reserve(ids, lens, n) == false) {
+        ret = SW_FILE_FULL();
+        goto err;
+    }
+    // Keep the records being replaced, with their current HOTP counter, to undo a partial import
+    for (e = 0; e < n; e++) {
+        if (ids[e] >= 0) {
+            oath_store_get(ids[e], &old_lens[e]);
+            olds_size += old_lens[e];
+        }
+    }
+    olds = (uint8_t *) calloc(1, olds_size + 1);
+    if (olds == NULL) {
+        ret = SW_MEMORY_FAILURE();
+        goto err;
+    }
+    for (e = 0, p = olds; e < n; p += old_lens[e], e++) {
+        uint16_t len = 0;
+        const uint8_t *rec = oath_store_get(ids[e], &len);
+        if (rec == NULL) {
+            continue;
+        }
+        memcpy(p, rec, len);
+        oath_carry_counter(ids[e], p, len);
+    }
+    uint16_t done = 0;
+    for (; done < n; done++) {
+        if (ids[done] >= 0) {
+            oath_hmac_drop(ids[done]);
+        }
+        put_ids[done] = oath_store_put(ids[done], recs + offs[done], lens[done]);
+        if (put_ids[done] < 0) {
+            break;
+        }
+    }
+    if (done == n) {
+        low_flash_available();
+        goto err;
+    }
+    // Undo what was written and leave it uncommitted, so the store stays as before the batch
+    ret = SW_EXEC_ERROR();
+    p = olds + olds_size;
+    for (int k = n - 1; k >= 0; k--) {
+        p -= old_lens[k];
+        if (k >= done) {
+            continue;
+        }
+        oath_hmac_drop(put_ids[k]);
+        if (ids[k] >= 0) {
+            oath_store_put(ids[k], p, old_lens[k]);
+        }
+        else {
+            oath_store_delete(put_ids[k]);
+        }
+    }
+err:
+    if (recs) {
+        mbedtls_platform_zeroize(recs, recs_size);
+        free(recs);
+    }
+    free(ids);
+    free(lens);
+    free(offs);
+    if (olds) {
+        mbedtls_platform_zeroize(olds, olds_size);
+        free(olds);
+    }
+    free(old_lens);
+    free(put_ids);
+    return ret;
 }
 
+int cmd_put_batch() {
+    if (validated == false) {
+        oath_batch_free();
+        return SW_SECURITY_STATUS_NOT_SATISFIED();
+    }
+    if (oath_batch_len + apdu.nc > OATH_BATCH_MAX) {
+        oath_batch_free();
+        return SW_WRONG_LENGTH();
+    }
+    uint8_t *buf = (uint8_t *) realloc(oath_batch, oath_batch_len + apdu.nc);
+    if (buf == NULL) {
+        oath_batch_free();
+        return SW_MEMORY_FAILURE();
+    }
+    oath_batch = buf;
+    memcpy(oath_batch + oath_batch_len, apdu.data, apdu.nc);
+    oath_batch_len += (uint16_t)apdu.nc;
+    if (CLA(apdu) & 0x10) {
+        return SW_OK();
+    }
+    int ret = oath_batch_commit();
+    oath_batch_free();
+    return ret;
+}
 
 int cmd_delete() {
     if (validated == false) {
@@ -180,9 +624,11 @@ int cmd_delete() {
     asn1_ctx_t ctxi, ctxo = { 0 };
     asn1_ctx_init(apdu.data, (uint16_t)apdu.nc, &ctxi);
     if (asn1_find_tag(&ctxi, TAG_NAME, &ctxo) == true) {
-        file_t *ef = find_oath_cred(ctxo.data, ctxo.len);
-        if (ef) {
-            delete_file(ef);
+        int slot = oath_store_find(ctxo.data, ctxo.len);
+        if (slot >= 0) {
+            oath_hmac_drop(slot);
+            oath_store_delete(slot);
+            low_flash_available();
             return SW_OK();
         }
         return SW_DATA_INVALID();
@@ -190,19 +636,6 @@ int cmd_delete() {
     return SW_INCORRECT_PARAMS();
 }
 
-const mbedtls_md_info_t *get_oath_md_info(uint8_t alg) {
-    if ((alg & ALG_MASK) == ALG_HMAC_SHA1) {
-        return mbedtls_md_info_from_type(MBEDTLS_MD_SHA1);
-    }
-    else if ((alg & ALG_MASK) == ALG_HMAC_SHA256) {
-        return mbedtls_md_info_from_type(MBEDTLS_MD_SHA256);
-    }
-    else if ((alg & ALG_MASK) == ALG_HMAC_SHA512) {
-        return mbedtls_md_info_from_type(MBEDTLS_MD_SHA512);
-    }
-    return NULL;
-}
-
 int cmd_set_code() {
     if (validated == false) {
         return SW_SECURITY_STATUS_NOT_SATISFIED();
@@ -253,12 +686,8 @@ int cmd_reset() {
     if (P1(apdu) != 0xde || P2(apdu) != 0xad) {
         return SW_INCORRECT_P1P2();
     }
-    for (int i = 0; i < MAX_OATH_CRED; i++) {
-        file_t *ef = search_dynamic_file((uint16_t)(EF_OATH_CRED + i));
-        if (file_has_data(ef)) {
-            delete_file(ef);
-        }
-    }
+    oath_store_clear();
+    oath_hmac_wipe();
     delete_file(search_dynamic_file(EF_OATH_CODE));
     flash_clear_file(search_by_fid(EF_OTP_PIN, NULL, SPECIFY_EF));
     low_flash_available();
@@ -270,21 +699,10 @@ int cmd_list() {
     if (validated == false) {
         return SW_SECURITY_STATUS_NOT_SATISFIED();
     }
-    for (int i = 0; i < MAX_OATH_CRED; i++) {
-        file_t *ef = search_dynamic_file((uint16_t)(EF_OATH_CRED + i));
-        if (file_has_data(ef)) {
-            asn1_ctx_t ctxi, key = { 0 }, name = { 0 };
-            asn1_ctx_init(file_get_data(ef), file_get_size(ef), &ctxi);
-            if (asn1_find_tag(&ctxi, TAG_NAME, &name) == true && asn1_find_tag(&ctxi, TAG_KEY, &key) == true) {
-                res_APDU[res_APDU_size++] = TAG_NAME_LIST;
-                res_APDU[res_APDU_size++] = (uint8_t)(name.len + 1);
-                res_APDU[res_APDU_size++] = key.data[0];
-                memcpy(res_APDU + res_APDU_size, name.data, name.len); res_APDU_size += name.len;
-            }
-        }
-    }
-    apdu.ne = res_APDU_size;
-    return SW_OK();
+    oath_page.active = true;
+    oath_page.list = true;
+    oath_page.next = oath_store_next(-1);
+    return oath_send_page();
 }
 
 int cmd_validate() {
@@ -328,13 +746,13 @@ int cmd_validate() {
     return SW_OK();
 }
 
-int calculate_oath(uint8_t truncate, const uint8_t *key, size_t key_len, const uint8_t *chal, size_t chal_len) {
+static int calculate_oath_slot(int slot, uint8_t truncate, const uint8_t *key, size_t key_len, const uint8_t *chal, size_t chal_len) {
     const mbedtls_md_info_t *md_info = get_oath_md_info(key[0]);
     if (md_info == NULL) {
         return SW_INCORRECT_PARAMS();
     }
     uint8_t hmac[64];
-    int r = mbedtls_md_hmac(md_info, key + 2, key_len - 2, chal, chal_len, hmac);
+    int r = oath_hmac(slot, key, key_len, chal, chal_len, hmac);
     size_t hmac_size = mbedtls_md_get_size(md_info);
     if (r != 0) {
         return PICOKEY_EXEC_ERROR;
@@ -357,6 +775,84 @@ int calculate_oath(uint8_t truncate, const uint8_t *key, size_t key_len, const u
     return PICOKEY_OK;
 }
 
+int calculate_oath(uint8_t truncate, const uint8_t *key, size_t key_len, const uint8_t *chal, size_t chal_len) {
+    return calculate_oath_slot(-1, truncate, key, key_len, chal, chal_len);
+}
+
+static size_t oath_entry_size(const asn1_ctx_t *name, const asn1_ctx_t *key, const asn1_ctx_t *prop) {
+    if (oath_page.list) {
+        return 2 + 1 + name->len;
+    }
+    size_t len = 2 + name->len;
+    if ((key->data[0] & OATH_TYPE_MASK) == OATH_TYPE_HOTP || (prop->len > 0 && (prop->data[0] & PROP_TOUCH))) {
+        return len + 3;
+    }
+    const mbedtls_md_info_t *md_info = get_oath_md_info(key->data[0]);
+    if (oath_page.truncate == 0x01 || md_info == NULL) {
+        return len + 2 + 5;
+    }
+    return len + 2 + 1 + mbedtls_md_get_size(md_info);
+}
+
+static void oath_put_entry(int slot, const asn1_ctx_t *name, const asn1_ctx_t *key, const asn1_ctx_t *prop) {
+    if (oath_page.list) {
+        res_APDU[res_APDU_size++] = TAG_NAME_LIST;
+        res_APDU[res_APDU_size++] = (uint8_t)(name->len + 1);
+        res_APDU[res_APDU_size++] = key->data[0];
+        memcpy(res_APDU + res_APDU_size, name->data, name->len); res_APDU_size += name->len;
+        return;
+    }
+    res_APDU[res_APDU_size++] = TAG_NAME;
+    res_APDU[res_APDU_size++] = (uint8_t)name->len;
+    memcpy(res_APDU + res_APDU_size, name->data, name->len); res_APDU_size += name->len;
+    if ((key->data[0] & OATH_TYPE_MASK) == OATH_TYPE_HOTP) {
+        res_APDU[res_APDU_size++] = TAG_NO_RESPONSE;
+        res_APDU[res_APDU_size++] = 1;
+        res_APDU[res_APDU_size++] = key->data[1];
+    }
+    else if (prop->len > 0 && (prop->data[0] & PROP_TOUCH)) {
+        res_APDU[res_APDU_size++] = TAG_TOUCH_RESPONSE;
+        res_APDU[res_APDU_size++] = 1;
+        res_APDU[res_APDU_size++] = key->data[1];
+    }
+    else {
+        res_APDU[res_APDU_size++] = TAG_RESPONSE + oath_page.truncate;
+        int ret = calculate_oath_slot(slot, oath_page.truncate, key->data, key->len, oath_page.chal, oath_page.chal_len);
+        if (ret != PICOKEY_OK) {
+            res_APDU[res_APDU_size++] = 1;
+            res_APDU[res_APDU_size++] = key->data[1];
+        }
+    }
+}
+
+static int oath_send_page() {
+    size_t budget = apdu.ne > 0 && apdu.ne < OATH_PAGE_SIZE ? apdu.ne : OATH_PAGE_SIZE;
+    res_APDU_size = 0;
+    for (; oath_page.next >= 0; oath_page.next = oath_store_next(oath_page.next)) {
+        uint16_t rec_len = 0;
+        uint8_t *rec = oath_store_get(oath_page.next, &rec_len);
+        if (rec == NULL) {
+            continue;
+        }
+        asn1_ctx_t ctxe, key = { 0 }, name = { 0 }, prop = { 0 };
+        asn1_ctx_init(rec, rec_len, &ctxe);
+        if (asn1_find_tag(&ctxe, TAG_NAME, &name) == false || asn1_find_tag(&ctxe, TAG_KEY, &key) == false) {
+            continue;
+        }
+        asn1_find_tag(&ctxe, TAG_PROPERTY, &prop);
+        if (res_APDU_size > 0 && res_APDU_size + oath_entry_size(&name, &key, &prop) > budget) {
+            break;
+        }
+        oath_put_entry(oath_page.next, &name, &key, &prop);
+    }
+    apdu.ne = res_APDU_size;
+    if (oath_page.next >= 0) {
+        return SW_BYTES_REMAINING_00();
+    }
+    oath_page.active = false;
+    return SW_OK();
+}
+
 int cmd_calculate() {
     if (P2(apdu) != 0x0 && P2(apdu) != 0x1) {
         return SW_INCORRECT_P1P2();
@@ -372,48 +868,47 @@ int cmd_calculate() {
     if (asn1_find_tag(&ctxi, TAG_NAME, &name) == false) {
         return SW_INCORRECT_PARAMS();
     }
-    file_t *ef = find_oath_cred(name.data, name.len);
-    if (file_has_data(ef) == false) {
+    uint16_t rec_len = 0;
+    int slot = oath_store_find(name.data, name.len);
+    uint8_t *rec = oath_store_get(slot, &rec_len);
+    if (rec == NULL) {
         return SW_DATA_INVALID();
     }
     asn1_ctx_t ctxe;
-    asn1_ctx_init(file_get_data(ef), file_get_size(ef), &ctxe);
+    asn1_ctx_init(rec, rec_len, &ctxe);
     if (asn1_find_tag(&ctxe, TAG_KEY, &key) == false) {
         return SW_INCORRECT_PARAMS();
     }
 
+    uint64_t ctr = 0;
+    uint8_t imf[8];
     if ((key.data[0] & OATH_TYPE_MASK) == OATH_TYPE_HOTP) {
-        if (asn1_find_tag(&ctxe, TAG_IMF, &chal) == false) {
+        if (oath_store_counter(slot, &ctr) == false) {
             return SW_INCORRECT_PARAMS();
         }
+        put_uint64_t_be(ctr, imf);
+        chal.data = imf;
+        chal.len = sizeof(imf);
     }
 
     res_APDU[res_APDU_size++] = TAG_RESPONSE + P2(apdu);
 
-    int ret = calculate_oath(P2(apdu), key.data, key.len, chal.data, chal.len);
+    int ret = calculate_oath_slot(slot, P2(apdu), key.data, key.len, chal.data, chal.len);
     if (ret != PICOKEY_OK) {
         return SW_EXEC_ERROR();
     }
     if ((key.data[0] & OATH_TYPE_MASK) == OATH_TYPE_HOTP) {
-        uint64_t v = get_uint64_t_be(chal.data);
-        size_t ef_size = file_get_size(ef);
-        v++;
-        uint8_t *tmp = (uint8_t *) calloc(1, ef_size);
-        memcpy(tmp, file_get_data(ef), ef_size);
-        asn1_ctx_t ctxt;
-        asn1_ctx_init(tmp, (uint16_t)ef_size, &ctxt);
-        asn1_find_tag(&ctxt, TAG_IMF, &chal);
-        put_uint64_t_be(v, chal.data);
-        file_put_data(ef, tmp, (uint16_t)ef_size);
+        if (oath_store_set_counter(slot, ctr + 1) != PICOKEY_OK) {
+            return SW_MEMORY_FAILURE();
+        }
         low_flash_available();
-        free(tmp);
     }
     apdu.ne = res_APDU_size;
     return SW_OK();
 }
 
 int cmd_calculate_all() {
-    asn1_ctx_t ctxi, key = { 0 }, chal = { 0 }, name = { 0 }, prop = { 0 };
+    asn1_ctx_t ctxi, chal = { 0 };
     asn1_ctx_init(apdu.data, (uint16_t)apdu.nc, &ctxi);
     if (P2(apdu) != 0x0 && P2(apdu) != 0x1) {
         return SW_INCORRECT_P1P2();
@@ -424,46 +919,23 @@ int cmd_calculate_all() {
     if (asn1_find_tag(&ctxi, TAG_CHALLENGE, &chal) == false) {
         return SW_INCORRECT_PARAMS();
     }
-    res_APDU_size = 0;
-    for (int i = 0; i < MAX_OATH_CRED; i++) {
-        file_t *ef = search_dynamic_file((uint16_t)(EF_OATH_CRED + i));
-        if (file_has_data(ef)) {
-            const uint8_t *ef_data = file_get_data(ef);
-            size_t ef_len = file_get_size(ef);
-            asn1_ctx_t ctxe;
-            asn1_ctx_init((uint8_t *)ef_data, (uint16_t)ef_len, &ctxe);
-            if (asn1_find_tag(&ctxe, TAG_NAME, &name) == false || asn1_find_tag(&ctxe, TAG_KEY, &key) == false) {
-                continue;
-            }
-            res_APDU[res_APDU_size++] = TAG_NAME;
-            res_APDU[res_APDU_size++] = (uint8_t)name.len;
-            memcpy(res_APDU + res_APDU_size, name.data, name.len); res_APDU_size += name.len;
-            if ((key.data[0] & OATH_TYPE_MASK) == OATH_TYPE_HOTP) {
-                res_APDU[res_APDU_size++] = TAG_NO_RESPONSE;
-                res_APDU[res_APDU_size++] = 1;
-                res_APDU[res_APDU_size++] = key.data[1];
-            }
-            else if (asn1_find_tag(&ctxe, TAG_PROPERTY, &prop) == true && (prop.data[0] & PROP_TOUCH)) {
-                res_APDU[res_APDU_size++] = TAG_TOUCH_RESPONSE;
-                res_APDU[res_APDU_size++] = 1;
-                res_APDU[res_APDU_size++] = key.data[1];
-            }
-            else {
-                res_APDU[res_APDU_size++] = TAG_RESPONSE + P2(apdu);
-                int ret = calculate_oath(P2(apdu), key.data, key.len, chal.data, chal.len);
-                if (ret != PICOKEY_OK) {
-                    res_APDU[res_APDU_size++] = 1;
-                    res_APDU[res_APDU_size++] = key.data[1];
-                }
-            }
-        }
+    if (chal.len > sizeof(oath_page.chal)) {
+        return SW_WRONG_LENGTH();
     }
-    apdu.ne = res_APDU_size;
-    return SW_OK();
+    oath_page.active = true;
+    oath_page.list = false;
+    oath_page.truncate = P2(apdu);
+    oath_page.next = oath_store_next(-1);
+    memcpy(oath_page.chal, chal.data, chal.len);
+    oath_page.chal_len = (uint8_t)chal.len;
+    return oath_send_page();
 }
 
 int cmd_send_remaining() {
-    return SW_OK();
+    if (oath_page.active == false) {
+        return SW_OK();
+    }
+    return oath_send_page();
 }
 
 int cmd_set_otp_pin() {
@@ -538,19 +1010,26 @@ int cmd_verify_otp_pin() {
     return SW_OK();
 }
 
+// Counter values past the stored one that VERIFY HOTP accepts, to resync a token pressed off-card.
+#ifndef OATH_HOTP_WINDOW
+#define OATH_HOTP_WINDOW    10
+#endif
+
 int cmd_verify_hotp() {
-    asn1_ctx_t ctxi, key = { 0 }, chal = { 0 }, name = { 0 }, code = { 0 };
+    asn1_ctx_t ctxi, key = { 0 }, name = { 0 }, code = { 0 };
     asn1_ctx_init(apdu.data, (uint16_t)apdu.nc, &ctxi);
     uint32_t code_int = 0;
     if (asn1_find_tag(&ctxi, TAG_NAME, &name) == false) {
         return SW_INCORRECT_PARAMS();
     }
-    file_t *ef = find_oath_cred(name.data, name.len);
-    if (file_has_data(ef) == false) {
+    uint16_t rec_len = 0;
+    int slot = oath_store_find(name.data, name.len);
+    uint8_t *rec = oath_store_get(slot, &rec_len);
+    if (rec == NULL) {
         return SW_DATA_INVALID();
     }
     asn1_ctx_t ctxe;
-    asn1_ctx_init(file_get_data(ef), file_get_size(ef), &ctxe);
+    asn1_ctx_init(rec, rec_len, &ctxe);
     if (asn1_find_tag(&ctxe, TAG_KEY, &key) == false) {
         return SW_INCORRECT_PARAMS();
     }
@@ -558,27 +1037,53 @@ int cmd_verify_hotp() {
     if ((key.data[0] & OATH_TYPE_MASK) != OATH_TYPE_HOTP) {
         return SW_DATA_INVALID();
     }
-    if (asn1_find_tag(&ctxe, TAG_IMF, &chal) == false) {
+    const mbedtls_md_info_t *md_info = get_oath_md_info(key.data[0]);
+    if (md_info == NULL) {
+        return SW_INCORRECT_PARAMS();
+    }
+    uint64_t ctr = 0;
+    if (oath_store_counter(slot, &ctr) == false) {
         return SW_INCORRECT_PARAMS();
     }
     if (asn1_find_tag(&ctxi, TAG_RESPONSE, &code) == true) {
         code_int = get_uint32_t_be(code.data);
     }
 
-    int ret = calculate_oath(0x01, key.data, key.len, chal.data, chal.len);
-    if (ret != PICOKEY_OK) {
-        return SW_EXEC_ERROR();
+    // The key schedule is absorbed once and every step only hashes the 8-byte counter
+    oath_hmac_t local, *h = oath_hmac_find(slot);
+    mbedtls_sha512_context local512[2];
+    if (h == NULL || h->alg != (key.data[0] & ALG_MASK)) {
+        local.ctx.sha512 = local512;
+        oath_hmac_setup(&local, key.data[0] & ALG_MASK, key.data + 2, key.len - 2);
+        h = &local;
     }
-    uint32_t res_int = get_uint32_t_be(res_APDU + 2);
-    if (res_APDU[1] == 6) {
-        res_int %= (uint32_t) 1e6;
+    size_t hmac_size = mbedtls_md_get_size(md_info);
+    uint32_t mod = key.data[1] == 6 ? (uint32_t) 1e6 : (uint32_t) 1e8;
+    uint8_t chal[8], hmac[64];
+    int step = -1, ret = 0;
+    for (int i = 0; i <= OATH_HOTP_WINDOW && step < 0 && ret == 0; i++) {
+        put_uint64_t_be(ctr + i, chal);
+        ret = oath_hmac_finish(h, chal, sizeof(chal), hmac);
+        uint8_t offset = hmac[hmac_size - 1] & 0x0f;
+        if (ret == 0 && (get_uint32_t_be(hmac + offset) & 0x7fffffff) % mod == code_int) {
+            step = i;
+        }
     }
-    else {
-        res_int %= (uint32_t) 1e8;
+    if (h == &local) {
+        mbedtls_platform_zeroize(&local, sizeof(local));
+        mbedtls_platform_zeroize(local512, sizeof(local512));
     }
-    if (res_int != code_int) {
+    mbedtls_platform_zeroize(hmac, sizeof(hmac));
+    if (ret != 0) {
+        return SW_EXEC_ERROR();
+    }
+    if (step < 0) {
         return SW_WRONG_DATA();
     }
+    if (oath_store_set_counter(slot, ctr + step + 1) != PICOKEY_OK) {
+        return SW_MEMORY_FAILURE();
+    }
+    low_flash_available();
     res_APDU_size = 0;
     apdu.ne = 0;
     return SW_OK();
@@ -605,24 +1110,32 @@ int cmd_rename() {
     if (memcmp(name.data, new_name.data, name.len) == 0) {
         return SW_WRONG_DATA();
     }
-    file_t *ef = find_oath_cred(name.data, name.len);
-    if (file_has_data(ef) == false) {
+    uint16_t fsize = 0;
+    int slot = oath_store_find(name.data, name.len);
+    uint8_t *fdata = oath_store_get(slot, &fsize);
+    if (fdata == NULL) {
         return SW_DATA_INVALID();
     }
-    uint8_t *fdata = file_get_data(ef);
-    uint16_t fsize = file_get_size(ef);
     asn1_ctx_init(fdata, fsize, &ctxi);
     if (asn1_find_tag(&ctxi, TAG_NAME, &name) == false) {
         return SW_WRONG_DATA();
     }
-    uint8_t *new_data = (uint8_t *) calloc(sizeof(uint8_t), fsize + new_name.len - name.len);
+    uint16_t new_len = fsize + new_name.len - name.len;
+    uint8_t *new_data = (uint8_t *) calloc(sizeof(uint8_t), new_len);
+    if (new_data == NULL) {
+        return SW_MEMORY_FAILURE();
+    }
     memcpy(new_data, fdata, name.data - fdata);
     *(new_data + (name.data - fdata) - 1) = new_name.len;
     memcpy(new_data + (name.data - fdata), new_name.data, new_name.len);
     memcpy(new_data + (name.data - fdata) + new_name.len, name.data + name.len, fsize - (name.data + name.len - fdata));
-    file_put_data(ef, new_data, fsize + new_name.len - name.len);
-    low_flash_available();
+    oath_carry_counter(slot, new_data, new_len); // oath_store_put() drops the counter log of slot
+    int ret = oath_store_put(slot, new_data, new_len);
     free(new_data);
+    if (ret < 0) {
+        return SW_EXEC_ERROR();
+    }
+    low_flash_available();
     return SW_OK();
 }
 
@@ -631,6 +1144,7 @@ int cmd_rename() {
 #define INS_SET_CODE        0x03
 #define INS_RESET           0x04
 #define INS_RENAME          0x05
+#define INS_PUT_BATCH       0x06
 #define INS_LIST            0xa1
 #define INS_CALCULATE       0xa2
 #define INS_VALIDATE        0xa3
@@ -647,6 +1161,7 @@ static const cmd_t cmds[] = {
     { INS_SET_CODE, cmd_set_code },
     { INS_RESET, cmd_reset },
     { INS_RENAME, cmd_rename },
+    { INS_PUT_BATCH, cmd_put_batch },
     { INS_LIST, cmd_list },
     { INS_VALIDATE, cmd_validate },
     { INS_CALCULATE, cmd_calculate },
@@ -660,12 +1175,18 @@ static const cmd_t cmds[] = {
 };
 
 int oath_process_apdu() {
-    if (CLA(apdu) != 0x00) {
+    if (CLA(apdu) != 0x00 && (CLA(apdu) != 0x10 || INS(apdu) != INS_PUT_BATCH)) {
         return SW_CLA_NOT_SUPPORTED();
     }
     if (cap_supported(CAP_OATH)) {
         for (const cmd_t *cmd = cmds; cmd->ins != 0x00; cmd++) {
             if (cmd->ins == INS(apdu)) {
+                if (cmd->ins != INS_SEND_REMAINING) {
+                    oath_page.active = false;
+                }
+                if (cmd->ins != INS_PUT_BATCH) {
+                    oath_batch_free();
+                }
                 int r = cmd->cmd_handler();
                 return r;
             }
@@ -0,0 +1,607 @@
+/*
+ * This file is part of the Pico FIDO distribution (https://github.com/polhenarejos/pico-fido).
+ * Copyright (c) 2022 Pol Henarejos.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "pico_keys.h"
+#include "files.h"
+#include "asn1.h"
+#include "oath_store.h"
+
+#define MAX_OATH_CRED       255
+#define TAG_NAME            0x71
+#define TAG_IMF             0x7a
+
+// Record layout inside a page: id (2), length (2), sequence (4), credential TLVs.
+// Deleted and superseded records keep their length with id OATH_REC_DEAD until
+// the page is compacted. If two copies of an id survive, the higher sequence wins.
+#define OATH_REC_HDR        8
+#define OATH_REC_DEAD       0xFFFF
+#define OATH_STORE_BUCKETS  256
+
+typedef struct {
+    uint16_t hash;
+    uint16_t next;
+    uint16_t off;
+    uint8_t page;
+    uint8_t used;
+} oath_rec_t;
+
+static oath_rec_t oath_rec[OATH_STORE_MAX];
+static uint16_t oath_bucket[OATH_STORE_BUCKETS];
+static uint16_t oath_dead[OATH_STORE_PAGES];
+static uint32_t oath_seq = 0;
+static bool oath_store_ready = false;
+
+static void oath_ctr_recover();
+static void oath_ctr_forget(int id);
+
+static uint16_t oath_hash(const uint8_t *name, uint16_t name_len) {
+    uint32_t h = 0x811c9dc5;
+    for (uint16_t i = 0; i < name_len; i++) {
+        h = (h ^ name[i]) * 0x01000193;
+    }
+    return (uint16_t)(h ^ (h >> 16));
+}
+
+static bool oath_rec_name(const uint8_t *data, uint16_t len, asn1_ctx_t *name) {
+    asn1_ctx_t ctxi;
+    asn1_ctx_init((uint8_t *)data, len, &ctxi);
+    return asn1_find_tag(&ctxi, TAG_NAME, name);
+}
+
+static void oath_unlink(int id) {
+    uint16_t *p = &oath_bucket[oath_rec[id].hash % OATH_STORE_BUCKETS];
+    while (*p != 0 && *p != id + 1) {
+        p = &oath_rec[*p - 1].next;
+    }
+    if (*p != 0) {
+        *p = oath_rec[id].next;
+    }
+    oath_rec[id].next = 0;
+    oath_rec[id].used = 0;
+}
+
+static void oath_link(int id, uint8_t page, uint16_t off, const uint8_t *name, uint16_t name_len) {
+    uint16_t h = oath_hash(name, name_len);
+    uint16_t *head = &oath_bucket[h % OATH_STORE_BUCKETS];
+    oath_rec[id].hash = h;
+    oath_rec[id].page = page;
+    oath_rec[id].off = off;
+    oath_rec[id].next = *head;
+    oath_rec[id].used = 1;
+    *head = (uint16_t)(id + 1);
+}
+
+static uint8_t *oath_page_get(uint8_t page, uint16_t *size) {
+    file_t *ef = search_dynamic_file((uint16_t)(EF_OATH_STORE + page));
+    if (!file_has_data(ef)) {
+        *size = 0;
+        return NULL;
+    }
+    *size = file_get_size(ef);
+    return file_get_data(ef);
+}
+
+// Rewrites a page, turning record kill and stale copies into tombstones, dropping
+// tombstones if compact is set and appending data as record id.
+static int oath_page_write(uint8_t page, int kill, bool compact, int id, const uint8_t *data, uint16_t len) {
+    uint16_t size = 0, n = 0, dead = oath_dead[page];
+    const uint8_t *p = oath_page_get(page, &size);
+    uint8_t *buf = (uint8_t *) calloc(1, OATH_STORE_PAGE_SIZE);
+    if (buf == NULL) {
+        return PICOKEY_ERR_MEMORY_FATAL;
+    }
+    for (uint16_t off = 0; off + OATH_REC_HDR <= size;) {
+        uint16_t rid = get_uint16_t_be(p + off), rlen = get_uint16_t_be(p + off + 2);
+        bool live = rid < OATH_STORE_MAX && oath_rec[rid].used && oath_rec[rid].page == page && oath_rec[rid].off == off;
+        if (rid == kill) {
+            rid = OATH_REC_DEAD;
+            dead += OATH_REC_HDR + rlen;
+        }
+        else if (live == false) {
+            // Already counted in oath_dead when it was loaded or superseded
+            rid = OATH_REC_DEAD;
+        }
+        if (rid != OATH_REC_DEAD || compact == false) {
+            memcpy(buf + n, p + off, OATH_REC_HDR + rlen);
+            put_uint16_t_be(rid, buf + n);
+            n += OATH_REC_HDR + rlen;
+        }
+        off += OATH_REC_HDR + rlen;
+    }
+    if (compact) {
+        dead = 0;
+    }
+    if (data) {
+        put_uint16_t_be((uint16_t)id, buf + n);
+        put_uint16_t_be(len, buf + n + 2);
+        put_uint32_t_be(++oath_seq, buf + n + 4);
+        memcpy(buf + n + OATH_REC_HDR, data, len);
+        n += OATH_REC_HDR + len;
+    }
+    file_t *ef = search_dynamic_file((uint16_t)(EF_OATH_STORE + page));
+    int ret = PICOKEY_OK;
+    if (n == 0) {
+        if (ef) {
+            delete_file(ef);
+        }
+    }
+    else {
+        if (ef == NULL) {
+            ef = file_new((uint16_t)(EF_OATH_STORE + page));
+        }
+        ret = file_put_data(ef, buf, n);
+    }
+    if (ret == PICOKEY_OK) {
+        // Only live records are left with their id, so their new offsets can be taken as is
+        oath_dead[page] = dead;
+        for (uint16_t off = 0; off < n; off += OATH_REC_HDR + get_uint16_t_be(buf + off + 2)) {
+            uint16_t rid = get_uint16_t_be(buf + off);
+            if (rid < OATH_STORE_MAX && oath_rec[rid].used && oath_rec[rid].page == page) {
+                oath_rec[rid].off = off;
+            }
+        }
+    }
+    free(buf);
+    return ret;
+}
+
+// Called while loading: tells whether a copy of id with sequence seq replaces the linked one,
+// and if so retires the linked copy.
+static bool oath_store_newer(int id, uint32_t seq) {
+    if (oath_rec[id].used == 0) {
+        return true;
+    }
+    uint16_t size = 0;
+    const uint8_t *p = oath_page_get(oath_rec[id].page, &size);
+    if (get_uint32_t_be(p + oath_rec[id].off + 4) > seq) {
+        return false;
+    }
+    oath_dead[oath_rec[id].page] += OATH_REC_HDR + get_uint16_t_be(p + oath_rec[id].off + 2);
+    oath_unlink(id);
+    return true;
+}
+
+void oath_store_load() {
+    memset(oath_rec, 0, sizeof(oath_rec));
+    memset(oath_bucket, 0, sizeof(oath_bucket));
+    memset(oath_dead, 0, sizeof(oath_dead));
+    oath_seq = 0;
+    for (uint8_t page = 0; page < OATH_STORE_PAGES; page++) {
+        uint16_t size = 0;
+        const uint8_t *p = oath_page_get(page, &size);
+        for (uint16_t off = 0; off + OATH_REC_HDR <= size;) {
+            uint16_t rid = get_uint16_t_be(p + off), rlen = get_uint16_t_be(p + off + 2);
+            uint32_t seq = get_uint32_t_be(p + off + 4);
+            asn1_ctx_t name = { 0 };
+            if (rid != OATH_REC_DEAD && seq > oath_seq) {
+                oath_seq = seq;
+            }
+            if (rid < OATH_STORE_MAX && oath_rec_name(p + off + OATH_REC_HDR, rlen, &name) && oath_store_newer(rid, seq)) {
+                oath_link(rid, page, off, name.data, name.len);
+            }
+            else {
+                oath_dead[page] += OATH_REC_HDR + rlen;
+            }
+            off += OATH_REC_HDR + rlen;
+        }
+    }
+    oath_store_ready = true;
+
+    // Move credentials left in the one-file-per-credential layout
+    bool migrated = false;
+    for (int i = 0; i < MAX_OATH_CRED; i++) {
+        file_t *ef = search_dynamic_file((uint16_t)(EF_OATH_CRED + i));
+        if (file_has_data(ef)) {
+            asn1_ctx_t name = { 0 };
+            if (oath_rec_name(file_get_data(ef), file_get_size(ef), &name) && oath_store_find(name.data, name.len) < 0) {
+                if (oath_store_put(-1, file_get_data(ef), file_get_size(ef)) < 0) {
+                    break;
+                }
+            }
+            delete_file(ef);
+            migrated = true;
+        }
+    }
+    oath_ctr_recover();
+    if (migrated) {
+        low_flash_available();
+    }
+}
+
+void oath_store_invalidate() {
+    oath_store_ready = false;
+}
+
+bool oath_store_loaded() {
+    return oath_store_ready;
+}
+
+int oath_store_find(const uint8_t *name, uint16_t name_len) {
+    if (oath_store_ready == false) {
+        oath_store_load();
+    }
+    uint16_t h = oath_hash(name, name_len);
+    for (uint16_t s = oath_bucket[h % OATH_STORE_BUCKETS]; s != 0; s = oath_rec[s - 1].next) {
+        if (oath_rec[s - 1].hash != h) {
+            continue;
+        }
+        uint16_t len = 0;
+        const uint8_t *data = oath_store_get(s - 1, &len);
+        asn1_ctx_t ef_tag = { 0 };
+        if (data && oath_rec_name(data, len, &ef_tag) && ef_tag.len == name_len && memcmp(ef_tag.data, name, name_len) == 0) {
+            return s - 1;
+        }
+    }
+    return -1;
+}
+
+uint8_t *oath_store_get(int id, uint16_t *len) {
+    if (id < 0 || id >= OATH_STORE_MAX || oath_rec[id].used == 0) {
+        return NULL;
+    }
+    uint16_t size = 0;
+    uint8_t *p = oath_page_get(oath_rec[id].page, &size);
+    if (p == NULL || oath_rec[id].off + OATH_REC_HDR > size) {
+        return NULL;
+    }
+    *len = get_uint16_t_be(p + oath_rec[id].off + 2);
+    return p + oath_rec[id].off + OATH_REC_HDR;
+}
+
+static bool oath_page_fits(uint8_t page, uint16_t need, uint16_t reuse, bool *compact) {
+    uint16_t size = 0;
+    oath_page_get(page, &size);
+    if (size + need <= OATH_STORE_PAGE_SIZE) {
+        *compact = oath_dead[page] + reuse > OATH_STORE_PAGE_SIZE / 4;
+        return true;
+    }
+    if (size - oath_dead[page] - reuse + need <= OATH_STORE_PAGE_SIZE) {
+        *compact = true;
+        return true;
+    }
+    return false;
+}
+
+static int oath_store_write(int id, const uint8_t *data, uint16_t len) {
+    asn1_ctx_t name = { 0 };
+    if (oath_rec_name(data, len, &name) == false) {
+        return PICOKEY_WRONG_DATA;
+    }
+    if (len + OATH_REC_HDR > OATH_STORE_PAGE_SIZE) {
+        return PICOKEY_ERR_NO_MEMORY;
+    }
+    if (id < 0) {
+        for (id = 0; id < OATH_STORE_MAX && oath_rec[id].used; id++);
+        if (id == OATH_STORE_MAX) {
+            return PICOKEY_ERR_NO_MEMORY;
+        }
+    }
+    int old = -1, page = -1;
+    uint16_t old_len = 0;
+    bool compact = false;
+    if (oath_rec[id].used) {
+        old = oath_rec[id].page;
+        oath_store_get(id, &old_len);
+        old_len += OATH_REC_HDR;
+        if (oath_page_fits((uint8_t)old, len + OATH_REC_HDR, old_len, &compact)) {
+            page = old;
+        }
+    }
+    for (int p = 0; p < OATH_STORE_PAGES && page < 0; p++) {
+        if (oath_page_fits((uint8_t)p, len + OATH_REC_HDR, 0, &compact)) {
+            page = p;
+        }
+    }
+    if (page < 0) {
+        return PICOKEY_ERR_NO_MEMORY;
+    }
+    uint8_t *copy = (uint8_t *) calloc(1, len);
+    if (copy == NULL) {
+        return PICOKEY_ERR_MEMORY_FATAL;
+    }
+    memcpy(copy, data, len);
+    // The new copy goes in first, so a failed write leaves the old record in place
+    int ret = oath_page_write((uint8_t)page, old == page ? id : -1, compact, id, copy, len);
+    if (ret == PICOKEY_OK) {
+        uint16_t size = 0, off = 0;
+        const uint8_t *p = oath_page_get((uint8_t)page, &size);
+        for (uint16_t o = 0; o + OATH_REC_HDR <= size; o += OATH_REC_HDR + get_uint16_t_be(p + o + 2)) {
+            off = o;
+        }
+        if (old >= 0 && old != page) {
+            // If this tombstone fails, the copy left behind loses on load by its older sequence
+            if (oath_page_write((uint8_t)old, id, false, -1, NULL, 0) != PICOKEY_OK) {
+                oath_dead[old] += old_len;
+            }
+        }
+        if (oath_rec[id].used) {
+            oath_unlink(id);
+        }
+        oath_rec_name(copy, len, &name);
+        oath_link(id, (uint8_t)page, off, name.data, name.len);
+    }
+    free(copy);
+    return ret == PICOKEY_OK ? id : ret;
+}
+
+// Replays the page choice of oath_store_put() to tell whether n records, replacing ids[i]
+// when set, would all be stored.
+bool oath_store_reserve(const int *ids, const uint16_t *lens, uint16_t n) {
+    uint16_t room[OATH_STORE_PAGES];
+    int free_ids = 0;
+    for (uint8_t page = 0; page < OATH_STORE_PAGES; page++) {
+        uint16_t size = 0;
+        oath_page_get(page, &size);
+        room[page] = OATH_STORE_PAGE_SIZE - size + oath_dead[page];
+    }
+    for (int id = 0; id < OATH_STORE_MAX; id++) {
+        free_ids += (oath_rec[id].used == 0);
+    }
+    for (uint16_t i = 0; i < n; i++) {
+        uint16_t need = lens[i] + OATH_REC_HDR, old_len = 0;
+        int page = -1;
+        if (need > OATH_STORE_PAGE_SIZE) {
+            return false;
+        }
+        if (ids[i] >= 0 && oath_store_get(ids[i], &old_len)) {
+            room[oath_rec[ids[i]].page] += old_len + OATH_REC_HDR;
+            if (room[oath_rec[ids[i]].page] >= need) {
+                page = oath_rec[ids[i]].page;
+            }
+        }
+        else if (--free_ids < 0) {
+            return false;
+        }
+        for (uint8_t p = 0; p < OATH_STORE_PAGES && page < 0; p++) {
+            if (room[p] >= need) {
+                page = p;
+            }
+        }
+        if (page < 0) {
+            return false;
+        }
+        room[page] -= need;
+    }
+    return true;
+}
+
+int oath_store_put(int id, const uint8_t *data, uint16_t len) {
+    if (oath_store_ready == false) {
+        oath_store_load();
+    }
+    bool replace = id >= 0 && id < OATH_STORE_MAX && oath_rec[id].used;
+    int ret = oath_store_write(id, data, len);
+    if (replace && ret >= 0) {
+        oath_ctr_forget(id);
+    }
+    return ret;
+}
+
+int oath_store_delete(int id) {
+    if (id < 0 || id >= OATH_STORE_MAX || oath_rec[id].used == 0) {
+        return PICOKEY_ERR_FILE_NOT_FOUND;
+    }
+    oath_ctr_forget(id);
+    uint8_t page = oath_rec[id].page;
+    uint16_t len = 0;
+    oath_store_get(id, &len);
+    oath_unlink(id);
+    int ret = oath_page_write(page, id, oath_dead[page] > OATH_STORE_PAGE_SIZE / 4, -1, NULL, 0);
+    if (ret != PICOKEY_OK) {
+        oath_dead[page] += OATH_REC_HDR + len;
+    }
+    return ret;
+}
+
+void oath_store_clear() {
+    for (uint8_t page = 0; page < OATH_STORE_PAGES; page++) {
+        file_t *ef = search_dynamic_file((uint16_t)(EF_OATH_STORE + page));
+        if (file_has_data(ef)) {
+            delete_file(ef);
+        }
+    }
+    for (int i = 0; i < MAX_OATH_CRED; i++) {
+        file_t *ef = search_dynamic_file((uint16_t)(EF_OATH_CRED + i));
+        if (file_has_data(ef)) {
+            delete_file(ef);
+        }
+    }
+    delete_file(search_dynamic_file(EF_OATH_CTR));
+    memset(oath_rec, 0, sizeof(oath_rec));
+    memset(oath_bucket, 0, sizeof(oath_bucket));
+    memset(oath_dead, 0, sizeof(oath_dead));
+    oath_seq = 0;
+    oath_store_ready = true;
+}
+
+int oath_store_next(int id) {
+    if (oath_store_ready == false) {
+        oath_store_load();
+    }
+    for (id++; id < OATH_STORE_MAX; id++) {
+        if (oath_rec[id].used) {
+            return id;
+        }
+    }
+    return -1;
+}
+
+// HOTP counters are appended to a small log (id, counter) instead of rewriting the record.
+// A record's counter is the larger of its IMF and its latest log entry. When the log is
+// full it is compacted and, if still half full, folded back into the records.
+#define OATH_CTR_ENTRY      10
+#ifndef OATH_CTR_LOG_MAX
+#define OATH_CTR_LOG_MAX    48
+#endif
+
+static bool oath_rec_imf(int id, uint64_t *ctr) {
+    uint16_t len = 0;
+    uint8_t *data = oath_store_get(id, &len);
+    asn1_ctx_t ctxi, imf = { 0 };
+    asn1_ctx_init(data, len, &ctxi);
+    if (data == NULL || asn1_find_tag(&ctxi, TAG_IMF, &imf) == false || imf.len != 8) {
+        return false;
+    }
+    *ctr = get_uint64_t_be(imf.data);
+    return true;
+}
+
+static const uint8_t *oath_ctr_log(uint16_t *n) {
+    file_t *ef = search_dynamic_file(EF_OATH_CTR);
+    if (!file_has_data(ef)) {
+        *n = 0;
+        return NULL;
+    }
+    *n = file_get_size(ef) / OATH_CTR_ENTRY;
+    return file_get_data(ef);
+}
+
+static int oath_ctr_save(const uint8_t *log, uint16_t n) {
+    file_t *ef = search_dynamic_file(EF_OATH_CTR);
+    if (n == 0) {
+        if (ef) {
+            delete_file(ef);
+        }
+        return PICOKEY_OK;
+    }
+    if (ef == NULL) {
+        ef = file_new(EF_OATH_CTR);
+    }
+    return file_put_data(ef, log, n * OATH_CTR_ENTRY);
+}
+
+// Keeps the latest entry of each live record that is ahead of the record itself, minus skip.
+static uint16_t oath_ctr_compact(uint8_t *buf, const uint8_t *log, uint16_t n, int skip) {
+    uint16_t m = 0;
+    for (int i = n - 1; i >= 0; i--) {
+        const uint8_t *e = log + i * OATH_CTR_ENTRY;
+        uint16_t id = get_uint16_t_be(e);
+        uint64_t ctr = 0;
+        bool seen = false;
+        for (uint16_t j = 0; j < m && !seen; j++) {
+            seen = get_uint16_t_be(buf + j * OATH_CTR_ENTRY) == id;
+        }
+        if (seen || id == skip || oath_rec_imf(id, &ctr) == false || get_uint64_t_be(e + 2) <= ctr) {
+            continue;
+        }
+        memcpy(buf + m * OATH_CTR_ENTRY, e, OATH_CTR_ENTRY);
+        m++;
+    }
+    return m;
+}
+
+static int oath_ctr_fold(int id, uint64_t ctr) {
+    uint16_t len = 0;
+    uint8_t *data = oath_store_get(id, &len);
+    if (data == NULL) {
+        return PICOKEY_ERR_FILE_NOT_FOUND;
+    }
+    uint8_t *copy = (uint8_t *) calloc(1, len);
+    if (copy == NULL) {
+        return PICOKEY_ERR_MEMORY_FATAL;
+    }
+    memcpy(copy, data, len);
+    asn1_ctx_t ctxi, imf = { 0 };
+    asn1_ctx_init(copy, len, &ctxi);
+    int ret = PICOKEY_WRONG_DATA;
+    if (asn1_find_tag(&ctxi, TAG_IMF, &imf) == true && imf.len == 8) {
+        put_uint64_t_be(ctr, imf.data);
+        ret = oath_store_write(id, copy, len);
+    }
+    free(copy);
+    return ret < 0 ? ret : PICOKEY_OK;
+}
+
+static void oath_ctr_forget(int id) {
+    uint16_t n = 0;
+    const uint8_t *log = oath_ctr_log(&n);
+    if (n == 0) {
+        return;
+    }
+    uint8_t *buf = (uint8_t *) calloc(n, OATH_CTR_ENTRY);
+    if (buf) {
+        uint16_t m = oath_ctr_compact(buf, log, n, id);
+        if (m != n) {
+            oath_ctr_save(buf, m);
+        }
+        free(buf);
+    }
+}
+
+static void oath_ctr_recover() {
+    oath_ctr_forget(-1);
+}
+
+bool oath_store_counter(int id, uint64_t *ctr) {
+    if (oath_rec_imf(id, ctr) == false) {
+        return false;
+    }
+    uint16_t n = 0;
+    const uint8_t *log = oath_ctr_log(&n);
+    for (int i = n - 1; i >= 0; i--) {
+        if (get_uint16_t_be(log + i * OATH_CTR_ENTRY) == id) {
+            uint64_t v = get_uint64_t_be(log + i * OATH_CTR_ENTRY + 2);
+            if (v > *ctr) {
+                *ctr = v;
+            }
+            break;
+        }
+    }
+    return true;
+}
+
+int oath_store_set_counter(int id, uint64_t ctr) {
+    uint16_t n = 0, m = 0;
+    const uint8_t *log = oath_ctr_log(&n);
+    uint8_t *buf = (uint8_t *) calloc(n + 1, OATH_CTR_ENTRY);
+    if (buf == NULL) {
+        return PICOKEY_ERR_MEMORY_FATAL;
+    }
+    if (n >= OATH_CTR_LOG_MAX) {
+        m = oath_ctr_compact(buf, log, n, id);
+        if (m >= OATH_CTR_LOG_MAX / 2) {
+            // Entries that fail to fold stay in the log; the folded ones are dropped on next compaction
+            bool folded = true;
+            for (uint16_t j = 0; j < m; j++) {
+                const uint8_t *e = buf + j * OATH_CTR_ENTRY;
+                folded &= oath_ctr_fold(get_uint16_t_be(e), get_uint64_t_be(e + 2)) == PICOKEY_OK;
+            }
+            if (folded) {
+                m = 0;
+            }
+        }
+        if (m >= OATH_CTR_LOG_MAX) {
+            // Still full: this counter goes into its record and the log is not grown
+            int ret = oath_ctr_fold(id, ctr);
+            if (ret == PICOKEY_OK) {
+                ret = oath_ctr_save(buf, m);
+            }
+            free(buf);
+            return ret;
+        }
+    }
+    else if (n > 0) {
+        memcpy(buf, log, n * OATH_CTR_ENTRY);
+        m = n;
+    }
+    put_uint16_t_be((uint16_t)id, buf + m * OATH_CTR_ENTRY);
+    put_uint64_t_be(ctr, buf + m * OATH_CTR_ENTRY + 2);
+    int ret = oath_ctr_save(buf, m + 1);
+    free(buf);
+    return ret;
+}
@@ -0,0 +1,46 @@
+/*
+ * This file is part of the Pico FIDO distribution (https://github.com/polhenarejos/pico-fido).
+ * Copyright (c) 2022 Pol Henarejos.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _OATH_STORE_H_
+#define _OATH_STORE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifndef OATH_STORE_MAX
+#define OATH_STORE_MAX          2048
+#endif
+#define OATH_STORE_PAGES        64
+#define OATH_STORE_PAGE_SIZE    2048
+
+// Packed OATH credential records. Each record keeps the TLV layout of the
+// former per-file credentials and is addressed by a stable id.
+extern void oath_store_load();
+extern void oath_store_invalidate();
+extern bool oath_store_loaded();
+extern int oath_store_find(const uint8_t *name, uint16_t name_len);
+extern uint8_t *oath_store_get(int id, uint16_t *len);
+extern int oath_store_put(int id, const uint8_t *data, uint16_t len);
+extern int oath_store_delete(int id);
+extern bool oath_store_reserve(const int *ids, const uint16_t *lens, uint16_t n);
+extern void oath_store_clear();
+extern int oath_store_next(int id);
+extern bool oath_store_counter(int id, uint64_t *ctr);
+extern int oath_store_set_counter(int id, uint64_t ctr);
+
+#endif //_OATH_STORE_H_
@@ -29,6 +29,7 @@
 #endif
 #include "mbedtls/aes.h"
 #include "management.h"
+#include "crc.h"
 #ifndef ENABLE_EMULATION
 #include "tusb.h"
 #endif
@@ -185,21 +186,6 @@ extern int calculate_oath(uint8_t truncate,
                           const uint8_t *chal,
                           size_t chal_len);
 
-uint16_t calculate_crc(const uint8_t *data, size_t data_len) {
-    uint16_t crc = 0xFFFF;
-    for (size_t idx = 0; idx < data_len; idx++) {
-        crc ^= data[idx];
-        for (uint8_t i = 0; i < 8; i++) {
-            uint16_t j = crc & 0x1;
-            crc >>= 1;
-            if (j == 1) {
-                crc ^= 0x8408;
-            }
-        }
-    }
-    return crc & 0xFFFF;
-}
-
 #ifndef ENABLE_EMULATION
 static uint8_t session_counter[2] = { 0 };
 #endif
@@ -290,7 +276,7 @@ int otp_button_pressed(uint8_t slot) {
         *po++ = session_counter[slot - 1];
         random_gen(NULL, po, 2);
         po += 2;
-        crc = calculate_crc(otpk + 6, 14);
+        crc = crc16(otpk + 6, 14);
         po += put_uint16_t_le(~crc, po);
         mbedtls_aes_context ctx;
         mbedtls_aes_init(&ctx);
@@ -381,7 +367,7 @@ uint16_t otp_status(bool is_otp) {
 }
 
 bool check_crc(const otp_config_t *data) {
-    uint16_t crc = calculate_crc((const uint8_t *) data, otp_config_size);
+    uint16_t crc = crc16((const uint8_t *) data, otp_config_size);
     return crc == 0xF0B8;
 }
 
@@ -578,7 +564,7 @@ uint8_t otp_header[4] = {0};
 extern uint16_t *get_send_buffer_size(uint8_t itf);
 
 int otp_send_frame(uint8_t *frame, size_t frame_len) {
-    uint16_t crc = calculate_crc(frame, frame_len);
+    uint16_t crc = crc16(frame, frame_len);
     frame_len += put_uint16_t_le(~crc, frame + frame_len);
     *get_send_buffer_size(ITF_KEYBOARD) = frame_len;
     otp_exp_seq = (frame_len / 7);
@@ -607,7 +593,7 @@ int otp_hid_set_report_cb(uint8_t itf, uint8_t report_id, hid_report_type_t repo
                 if (rseq == 9) {
                     DEBUG_DATA(otp_frame_rx, sizeof(otp_frame_rx));
                     DEBUG_PAYLOAD(otp_frame_rx, sizeof(otp_frame_rx));
-                    uint16_t residual_crc = calculate_crc(otp_frame_rx, 64), rcrc = get_uint16_t_le(otp_frame_rx + 65);
+                    uint16_t residual_crc = crc16(otp_frame_rx, 64), rcrc = get_uint16_t_le(otp_frame_rx + 65);
                     uint8_t slot_id = otp_frame_rx[64];
                     if (residual_crc == rcrc) {
                         uint8_t hdr[5];
@@ -28,6 +28,7 @@ from fido2.ctap import CtapError
 from fido2.webauthn import CollectedClientData, PublicKeyCredentialParameters, PublicKeyCredentialType
 from utils import *
 from fido2.cose import ES256
+from fido2 import cbor
 import sys
 import pytest
 import os
@@ -145,6 +146,18 @@ class Device():
             event.is_set()
             return self.dev.call(cmd, data, event, on_keepalive = on_keepalive)
 
+    def vendor(self, cmd, vendor_cmd, param=None):
+        req = {1: vendor_cmd}
+        if param is not None:
+            req[2] = {1: param}
+        res = self.send_data(CTAP_VENDOR_CBOR, bytes([cmd]) + cbor.encode(req))
+        if res[0] != 0:
+            raise CtapError(res[0])
+        return cbor.decode(res[1:]) if len(res) > 1 else {}
+
+    def advance_clock(self, ms):
+        return self.vendor(CTAP_VENDOR_CLOCK, 0x02, struct.pack('>I', ms))[1]
+
     def cid(self):
         return self.dev._channel_id
 
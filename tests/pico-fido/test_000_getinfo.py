@@ -19,7 +19,11 @@
 
 
 import pytest
+from fido2 import cbor
+from fido2.hid import CTAPHID
 from fido2.client import CtapError
+from fido2.ctap2 import Config
+from fido2.ctap2.pin import PinProtocolV2, ClientPin
 
 
 def test_getinfo(device):
@@ -45,3 +49,34 @@ def test_Check_up_option(device, info):
         with pytest.raises(CtapError) as e:
             device.MC(options={"up": True})
         assert e.value.code == CtapError.ERR.INVALID_OPTION
+
+
+def get_info_raw(device):
+    res = device.send_data(CTAPHID.CBOR, bytes([0x04]))
+    assert res[0] == 0
+    return res[1:]
+
+def test_get_info_cache_matches_fresh(device):
+    # First call after each state change is built from scratch, the next one comes from the cache
+    device.reset()
+    fresh = get_info_raw(device)
+    assert get_info_raw(device) == fresh
+    assert cbor.decode(fresh)[4]['clientPin'] is False
+
+    client_pin = ClientPin(device.client()._backend.ctap2)
+    client_pin.set_pin('12345678')
+    fresh = get_info_raw(device)
+    assert cbor.decode(fresh)[4]['clientPin'] is True
+    assert get_info_raw(device) == fresh
+
+    pt = client_pin.get_pin_token('12345678', permissions=ClientPin.PERMISSION.AUTHENTICATOR_CFG)
+    Config(device.client()._backend.ctap2, PinProtocolV2(), pt).set_min_pin_length(6)
+    fresh = get_info_raw(device)
+    assert cbor.decode(fresh)[0x0D] == 6
+    assert get_info_raw(device) == fresh
+
+    device.reset()
+    fresh = get_info_raw(device)
+    assert cbor.decode(fresh)[4]['clientPin'] is False
+    assert cbor.decode(fresh)[0x0D] == 4
+    assert get_info_raw(device) == fresh
@@ -22,6 +22,7 @@ import os
 import pytest
 from fido2.ctap import CtapError
 from fido2.client import ClientPin
+from fido2.ctap2 import CredentialManagement
 from fido2.webauthn import UserVerificationRequirement
 from fido2.utils import hmac_sha256
 
@@ -259,3 +260,39 @@ def test_pin_attempts(device, client_pin):
 
     res = client_pin.get_pin_retries()
     assert res[0] == (8)
+
+def test_token_initial_usage_window(device, client_pin):
+    device.reset()
+    client_pin.set_pin(PIN1)
+    pt = client_pin.get_pin_token(PIN1, permissions=ClientPin.PERMISSION.CREDENTIAL_MGMT)
+    device.advance_clock(31 * 1000)
+    cm = CredentialManagement(device.client()._backend.ctap2, client_pin.protocol, pt)
+    with pytest.raises(CtapError) as e:
+        cm.get_metadata()
+    assert e.value.code == CtapError.ERR.PIN_AUTH_INVALID
+
+def test_token_rolling_timer(device, client_pin):
+    device.reset()
+    client_pin.set_pin(PIN1)
+    pt = client_pin.get_pin_token(PIN1, permissions=ClientPin.PERMISSION.CREDENTIAL_MGMT)
+    cm = CredentialManagement(device.client()._backend.ctap2, client_pin.protocol, pt)
+    for _ in range(3):
+        device.advance_clock(20 * 1000)
+        cm.get_metadata()
+    device.advance_clock(31 * 1000)
+    with pytest.raises(CtapError) as e:
+        cm.get_metadata()
+    assert e.value.code == CtapError.ERR.PIN_AUTH_INVALID
+
+def test_token_max_usage_period(device, client_pin):
+    device.reset()
+    client_pin.set_pin(PIN1)
+    pt = client_pin.get_pin_token(PIN1, permissions=ClientPin.PERMISSION.CREDENTIAL_MGMT)
+    cm = CredentialManagement(device.client()._backend.ctap2, client_pin.protocol, pt)
+    for _ in range(23):
+        device.advance_clock(25 * 1000)
+        cm.get_metadata()
+    device.advance_clock(26 * 1000)
+    with pytest.raises(CtapError) as e:
+        cm.get_metadata()
+    assert e.value.code == CtapError.ERR.PIN_AUTH_INVALID
@@ -22,8 +22,10 @@ from fido2.client import CtapError
 from fido2.cose import ES256, ES384, ES512, EdDSA
 import fido2.features
 fido2.features.webauthn_json_mapping.enabled = False
-from utils import ES256K
+from utils import ES256K, send_apdu
+from fido2 import cbor
 import pytest
+import os
 
 
 def test_register(device):
@@ -195,3 +197,32 @@ def test_exclude_list_excluded(device):
 def test_unknown_option(device):
     device.reset()
     device.MC(options={"unknown": False})
+
+CTAP_VENDOR_MEMORY = 0x06
+MEMORY_ARENA_PEAK = 0x06
+MEMORY_ARENA_SIZE = 0x07
+
+def test_request_arena_high_water(device):
+    device.doMC(rk=True)
+    mem = device.vendor(CTAP_VENDOR_MEMORY, 0x01)
+    assert 0 < mem[MEMORY_ARENA_PEAK] <= mem[MEMORY_ARENA_SIZE]
+
+def ccid_cbor(card, cmd, req):
+    resp = send_apdu(card, [0x80, 0x10], 0, 0, data=[cmd] + list(cbor.encode(req)))
+    assert resp[0] == 0
+    return cbor.decode(bytes(resp[1:]))
+
+def test_request_arena_ccid(device, ccid_card):
+    # CTAP2 over CCID must free the arena per request too, well past its capacity
+    send_apdu(ccid_card, 0xA4, 0x04, 0x00, [0xA0, 0x00, 0x00, 0x06, 0x47, 0x2F, 0x00, 0x01])
+    size = device.vendor(CTAP_VENDOR_MEMORY, 0x01)[MEMORY_ARENA_SIZE]
+    rp = {'id': 'example.com', 'name': 'Example RP'}
+    for i in range(2 * size // 1024):
+        res = ccid_cbor(ccid_card, 0x01, {1: os.urandom(32), 2: rp, 3: {'id': bytes([i]), 'name': 'user'},
+                                          4: [{'type': 'public-key', 'alg': -7}]})
+        auth_data = res[2]
+        cred_id_len = int.from_bytes(auth_data[53:55], 'big')
+        cred_id = auth_data[55:55 + cred_id_len]
+        res = ccid_cbor(ccid_card, 0x02, {1: rp['id'], 2: os.urandom(32),
+                                          3: [{'type': 'public-key', 'id': cred_id}]})
+        assert res[1]['id'] == cred_id
@@ -256,3 +256,32 @@ def test_returned_credential(device):
     # the returned credential should have user id in it
     #print(ga_res)
     #assert 'id' in ga_res.user and len(ga_res.user["id"]) > 0
+
+
+def test_next_assertion_from_allowlist(device):
+    regs = [device.doMC()['res'].attestation_object for _ in range(3)]
+    allow_list = [{"id": r.auth_data.credential_data.credential_id, "type": "public-key"} for r in regs]
+
+    res = device.GA(allow_list=allow_list)
+    assert res['res'].number_of_credentials == 3
+    auths = [res['res']] + [device.GNA() for _ in range(2)]
+    with pytest.raises(CtapError):
+        device.GNA()
+
+    by_id = {bytes(r.auth_data.credential_data.credential_id): r for r in regs}
+    assert len({bytes(a.credential['id']) for a in auths}) == 3
+    for a in auths:
+        verify(by_id[bytes(a.credential['id'])], a, res['req']['client_data_hash'])
+
+def test_next_assertion_timeout(device):
+    regs = [device.doMC()['res'].attestation_object for _ in range(3)]
+    allow_list = [{"id": r.auth_data.credential_data.credential_id, "type": "public-key"} for r in regs]
+
+    res = device.GA(allow_list=allow_list)
+    assert res['res'].number_of_credentials == 3
+    device.advance_clock(20 * 1000)
+    device.GNA()
+    device.advance_clock(31 * 1000)
+    with pytest.raises(CtapError) as e:
+        device.GNA()
+    assert e.value.code == CtapError.ERR.NOT_ALLOWED
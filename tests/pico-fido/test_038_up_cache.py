@@ -0,0 +1,108 @@
+"""
+/*
+ * This file is part of the Pico Fido distribution (https://github.com/polhenarejos/pico-fido).
+ * Copyright (c) 2022 Pol Henarejos.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+"""
+
+
+import pytest
+from fido2.ctap import CtapError
+from fido2.ctap2.pin import PinProtocolV2, ClientPin
+from fido2.ctap2 import Config
+
+from utils import *
+
+PIN='12345678'
+CTAP_CONFIG_UP_CACHE = 0x5ad8e2c6f1a0b437
+CTAP_VENDOR_TOUCH = 0x08
+
+def FidoConfig(device):
+    pt = ClientPin(device.client()._backend.ctap2).get_pin_token(PIN, permissions=ClientPin.PERMISSION.AUTHENTICATOR_CFG)
+    return Config(device.client()._backend.ctap2, PinProtocolV2(), pt)
+
+def touches(device, script=None):
+    if script is None:
+        return device.vendor(CTAP_VENDOR_TOUCH, 0x01)[1]
+    return device.vendor(CTAP_VENDOR_TOUCH, 0x02, script)[1]
+
+@pytest.fixture(scope="function")
+def RegUP(device):
+    device.reset()
+    ClientPin(device.client()._backend.ctap2).set_pin(PIN)
+    reg = device.doMC()['res'].attestation_object
+    return [{"type": "public-key", "id": reg.auth_data.credential_data.credential_id}]
+
+def test_up_cache_off_by_default(device, RegUP):
+    n = touches(device)
+    device.GA(allow_list=RegUP)
+    device.GA(allow_list=RegUP)
+    assert touches(device) == n + 2
+
+def test_up_cache_window(device, RegUP):
+    FidoConfig(device)._call(0x7f, {1: CTAP_CONFIG_UP_CACHE, 3: 10})
+    n = touches(device)
+    device.GA(allow_list=RegUP)
+    device.advance_clock(5 * 1000)
+    device.GA(allow_list=RegUP)
+    assert touches(device) == n + 1
+
+    device.advance_clock(6 * 1000)
+    device.GA(allow_list=RegUP)
+    assert touches(device) == n + 2
+
+def test_up_cache_per_rp(device, RegUP):
+    FidoConfig(device)._call(0x7f, {1: CTAP_CONFIG_UP_CACHE, 3: 10})
+    rp = {"id": "other.org", "name": "Other RP"}
+    reg = device.doMC(rp=rp)['res'].attestation_object
+    other = [{"type": "public-key", "id": reg.auth_data.credential_data.credential_id}]
+    n = touches(device)
+    device.GA(allow_list=RegUP)
+    device.GA(rp_id=rp['id'], allow_list=other)
+    device.GA(allow_list=RegUP)
+    assert touches(device) == n + 3
+
+def test_up_cache_selection_touch(device, RegUP):
+    FidoConfig(device)._call(0x7f, {1: CTAP_CONFIG_UP_CACHE, 3: 10})
+    n = touches(device)
+    device.GA(allow_list=RegUP)
+    with pytest.raises(CtapError) as e:
+        device.GA(pin_uv_param=b"")
+    assert e.value.code == CtapError.ERR.PIN_AUTH_INVALID
+    with pytest.raises(CtapError) as e:
+        device.MC(pin_uv_param=b"")
+    assert e.value.code == CtapError.ERR.PIN_AUTH_INVALID
+    assert touches(device) == n + 3
+
+def test_up_cache_token_reset(device, RegUP):
+    FidoConfig(device)._call(0x7f, {1: CTAP_CONFIG_UP_CACHE, 3: 10})
+    n = touches(device)
+    device.GA(allow_list=RegUP)
+    ClientPin(device.client()._backend.ctap2).get_pin_token(PIN, permissions=ClientPin.PERMISSION.GET_ASSERTION, permissions_rpid='example.com')
+    device.GA(allow_list=RegUP)
+    assert touches(device) == n + 2
+
+def test_up_cache_denied(device, RegUP):
+    FidoConfig(device)._call(0x7f, {1: CTAP_CONFIG_UP_CACHE, 3: 10})
+    touches(device, b'\x00')
+    with pytest.raises(CtapError) as e:
+        device.GA(allow_list=RegUP)
+    assert e.value.code == CtapError.ERR.OPERATION_DENIED
+    device.GA(allow_list=RegUP)
+
+def test_up_cache_too_long(device, RegUP):
+    with pytest.raises(CtapError) as e:
+        FidoConfig(device)._call(0x7f, {1: CTAP_CONFIG_UP_CACHE, 3: 61})
+    assert e.value.code == CtapError.ERR.INVALID_PARAMETER
@@ -0,0 +1,134 @@
+"""
+/*
+ * This file is part of the Pico Fido distribution (https://github.com/polhenarejos/pico-fido).
+ * Copyright (c) 2022 Pol Henarejos.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+"""
+
+
+import os
+import random
+import pytest
+from fido2 import cbor
+from fido2.hid import CTAPHID
+from fido2.ctap import CtapError
+
+from utils import *
+
+# makeCredential, getAssertion, clientPIN, credentialManagement, largeBlobs, config
+COMMANDS = [0x01, 0x02, 0x06, 0x0A, 0x0C, 0x0D]
+
+# Fixed so failures reproduce; override with FUZZ_SEED=<n> to explore other inputs
+FUZZ_SEED = int(os.environ.get('FUZZ_SEED', '0x5eed'), 0)
+
+def random_value(rnd, depth=0):
+    kinds = ['uint', 'int', 'bool', 'bytes', 'text']
+    if depth < 2:
+        kinds += ['map', 'array']
+    kind = rnd.choice(kinds)
+    if kind == 'uint':
+        return rnd.choice([0, 1, 2, 23, 24, 255, 65535, 2**32, 2**64 - 1])
+    if kind == 'int':
+        return -rnd.randint(1, 2**16)
+    if kind == 'bool':
+        return rnd.choice([True, False])
+    if kind == 'bytes':
+        return rnd.randbytes(rnd.choice([0, 1, 16, 32, 64]))
+    if kind == 'text':
+        return rnd.choice(['', 'id', 'type', 'alg', 'transports', 'public-key', 'hmac-secret', 'rk', 'up', 'uv'])
+    if kind == 'array':
+        return [random_value(rnd, depth + 1) for _ in range(rnd.randint(0, 20))]
+    m = {}
+    for _ in range(rnd.randint(0, 6)):
+        k = rnd.choice([rnd.randint(0, 12), rnd.choice(['id', 'type', 'alg', 'transports', 'name'])])
+        m[k] = random_value(rnd, depth + 1)
+    return m
+
+def random_request(rnd):
+    req = {}
+    for k in sorted(rnd.sample(range(1, 12), rnd.randint(0, 8))):
+        req[k] = random_value(rnd)
+    data = cbor.encode(req)
+    if rnd.random() < 0.3 and len(data) > 1:
+        data = bytearray(data)
+        for _ in range(rnd.randint(1, 4)):
+            data[rnd.randrange(len(data))] = rnd.randrange(256)
+        data = bytes(data)
+    if rnd.random() < 0.1:
+        data = data[:rnd.randrange(len(data))]
+    return data
+
+def send_cbor(device, cmd, data):
+    try:
+        return device.send_data(CTAPHID.CBOR, bytes([cmd]) + data)
+    except CtapError as e:
+        return bytes([e.code])
+
+@pytest.fixture
+def fuzz_device(device):
+    yield device
+    device.reset() # Random clientPIN/config requests may have changed persistent state
+
+@pytest.mark.parametrize("cmd", COMMANDS)
+def test_fuzz_request_map(fuzz_device, cmd, record_property):
+    seed = FUZZ_SEED ^ cmd
+    record_property('fuzz_seed', seed)
+    print(f'fuzz seed {seed:#x}')
+    rnd = random.Random(seed)
+    for i in range(200):
+        data = random_request(rnd)
+        res = send_cbor(fuzz_device, cmd, data)
+        assert len(res) > 0, f'seed={seed:#x} iter={i} data={data.hex()}'
+        if res[0] == 0 and len(res) > 1:
+            cbor.decode(res[1:])
+    assert fuzz_device.client()._backend.ctap2.get_info() is not None
+
+@pytest.mark.parametrize("cmd", COMMANDS)
+def test_fuzz_schema_errors(device, cmd):
+    # Decoder failures come back as CTAP2 codes, not raw tinycbor errors
+    assert send_cbor(device, cmd, cbor.encode([1]))[0] == CtapError.ERR.CBOR_UNEXPECTED_TYPE
+    assert send_cbor(device, cmd, cbor.encode({'a': 1}))[0] == CtapError.ERR.CBOR_UNEXPECTED_TYPE
+    assert send_cbor(device, cmd, bytes([0xA1, 0x01]))[0] == CtapError.ERR.INVALID_CBOR
+
+@pytest.mark.parametrize("cmd", COMMANDS)
+def test_fuzz_unsorted_keys(device, cmd):
+    # Keys out of order must be rejected regardless of the command
+    res = send_cbor(device, cmd, bytes([0xA2, 0x02, 0x00, 0x01, 0x00]))
+    assert res[0] != 0
+
+@pytest.mark.parametrize("cmd", [0x01, 0x02])
+def test_fuzz_list_overflow(device, cmd):
+    cred = {'type': 'public-key', 'id': os.urandom(32), 'transports': ['usb'] * 20}
+    if cmd == 0x01:
+        req = {1: os.urandom(32), 2: {'id': 'example.com'}, 3: {'id': b'1'},
+               4: [{'type': 'public-key', 'alg': -7}] * 20}
+    else:
+        req = {1: 'example.com', 2: os.urandom(32), 3: [cred] * 20}
+    res = send_cbor(device, cmd, cbor.encode(req))
+    assert res[0] == CtapError.ERR.LIMIT_EXCEEDED
+
+CTAP_VENDOR_ERRORS = 0x09
+
+def test_error_ring_records_failure(device):
+    device.vendor(CTAP_VENDOR_ERRORS, 0x02)
+    res = send_cbor(device, 0x01, cbor.encode({2: {'id': 'example.com'}}))
+    assert res[0] == CtapError.ERR.MISSING_PARAMETER
+    err = device.vendor(CTAP_VENDOR_ERRORS, 0x01)
+    assert err[1] == len(err[2]) == 1
+    code, handler, site, kind = err[2][0]
+    assert handler == 0x01
+    assert code == CtapError.ERR.MISSING_PARAMETER
+    assert site >> 12 == 8 # cbor_make_credential.c
+    assert site & 0xfff > 0
@@ -19,17 +19,20 @@
 
 import pytest
 from utils import *
-import hmac, hashlib
+import hmac, hashlib, time
 
 INS_PUT = 0x01
 INS_DELETE = 0x02
 INS_SET_CODE = 0x03
 INS_RESET = 0x04
+INS_RENAME = 0x05
+INS_PUT_BATCH = 0x06
 INS_LIST = 0xa1
 INS_CALCULATE = 0xa2
 INS_VALIDATE = 0xa3
 INS_CALC_ALL = 0xa4
 INS_SEND_REMAINING = 0xa5
+INS_VERIFY_CODE = 0xb1
 
 RESP_MORE_DATA = 0x61
 
@@ -53,6 +56,7 @@ TYPE_TOTP = 0x20
 ALG_MASK = 0x0f
 ALG_SHA1 = 0x01
 ALG_SHA256 = 0x02
+ALG_SHA512 = 0x03
 
 PROP_ALWAYS_INC = 0x01
 PROP_REQUIRE_TOUCH = 0x02
@@ -193,6 +197,63 @@ def test_imf_more(reset_oath):
     exp = [TAG_T_RESPONSE, 5, 6, 0x41, 0x39, 0x7e, 0xea]
     assert(exp == resp)
 
+def test_hotp_counter_log(reset_oath):
+    key = list(b'12345678901234567890')
+    names = [list(bytes(f'hotp{i}', 'ascii')) for i in range(3)]
+    for name in names:
+        data = [TAG_NAME, len(name)] + name + [TAG_KEY, len(key)+2, ALG_SHA1 | TYPE_HOTP, 6] + key
+        send_apdu(reset_oath, INS_PUT, p1=0, p2=0, data=data)
+    # Enough presses to wrap the counter log several times
+    for ctr in range(40):
+        for name in names:
+            resp = send_apdu(reset_oath, INS_CALCULATE, p1=0, p2=1, data=[TAG_NAME, len(name)] + name + [TAG_CHALLENGE, 0])
+            mac = hmac.digest(bytes(key), ctr.to_bytes(8, 'big'), hashlib.sha1)
+            o = mac[-1] & 0xf
+            assert(resp[3:] == [mac[o] & 0x7f] + list(mac[o+1:o+4]))
+
+    data = [TAG_NAME, len(names[0])] + names[0] + [TAG_KEY, len(key)+2, ALG_SHA1 | TYPE_HOTP, 6] + key
+    send_apdu(reset_oath, INS_PUT, p1=0, p2=0, data=data)
+    resp = send_apdu(reset_oath, INS_CALCULATE, p1=0, p2=1, data=[TAG_NAME, len(names[0])] + names[0] + [TAG_CHALLENGE, 0])
+    assert(resp[3:] == [0x4c, 0x93, 0xcf, 0x18])
+
+def test_rename_hotp_counter(reset_oath):
+    key = list(b'12345678901234567890')
+    name, new_name = list(b'hotp'), list(b'hotp-renamed')
+    data = [TAG_NAME, len(name)] + name + [TAG_KEY, len(key)+2, ALG_SHA1 | TYPE_HOTP, 6] + key
+    send_apdu(reset_oath, INS_PUT, p1=0, p2=0, data=data)
+    def code(ctr):
+        mac = hmac.digest(bytes(key), ctr.to_bytes(8, 'big'), hashlib.sha1)
+        o = mac[-1] & 0xf
+        return [mac[o] & 0x7f] + list(mac[o+1:o+4])
+    n = 5
+    for ctr in range(n):
+        resp = send_apdu(reset_oath, INS_CALCULATE, p1=0, p2=1, data=[TAG_NAME, len(name)] + name + [TAG_CHALLENGE, 0])
+        assert(resp[3:] == code(ctr))
+    send_apdu(reset_oath, INS_RENAME, p1=0, p2=0, data=[TAG_NAME, len(name)] + name + [TAG_NAME, len(new_name)] + new_name)
+    resp = send_apdu(reset_oath, INS_CALCULATE, p1=0, p2=1, data=[TAG_NAME, len(new_name)] + new_name + [TAG_CHALLENGE, 0])
+    assert(resp[3:] == code(n))
+
+def test_verify_hotp_window(reset_oath):
+    key = list(b'12345678901234567890')
+    name = list(b'door')
+    data = [TAG_NAME, len(name)] + name + [TAG_KEY, len(key)+2, ALG_SHA1 | TYPE_HOTP, 6] + key
+    send_apdu(reset_oath, INS_PUT, p1=0, p2=0, data=data)
+    # rfc4226 appendix D
+    codes = [755224, 287082, 359152, 969429, 338314, 254676, 287922, 162583, 399871, 520489]
+    def verify(code):
+        data = [TAG_NAME, len(name)] + name + [TAG_RESPONSE, 4] + list(code.to_bytes(4, 'big'))
+        send_apdu(reset_oath, INS_VERIFY_CODE, p1=0, p2=0, data=data)
+
+    verify(codes[3])
+    with pytest.raises(APDUResponse) as e:
+        verify(codes[3])
+    assert([e.value.sw1, e.value.sw2] == [0x6A, 0x80])
+    verify(codes[9])
+    resp = send_apdu(reset_oath, INS_CALCULATE, p1=0, p2=1, data=[TAG_NAME, len(name)] + name + [TAG_CHALLENGE, 0])
+    mac = hmac.digest(bytes(key), (10).to_bytes(8, 'big'), hashlib.sha1)
+    o = mac[-1] & 0xf
+    assert(resp[3:] == [mac[o] & 0x7f] + list(mac[o+1:o+4]))
+
 def test_delete(reset_oath):
     key = list(bytes(b'blahonga!'))
     firstname = list(bytes(b'one'))
@@ -220,6 +281,190 @@ def test_delete(reset_oath):
     exp = [TAG_NAME_LIST, len(thirdname)+1, type] + thirdname + [TAG_NAME_LIST, len(secondname)+1, type] + secondname
     assert(exp == resp)
 
+def test_name_lookup(reset_oath):
+    key = list(bytes(b'blahonga!'))
+    type = ALG_SHA1 | TYPE_TOTP
+    names = [list(bytes(f'acct{i:03d}', 'ascii')) for i in range(40)]
+    for name in names:
+        data = [TAG_NAME, len(name)] + name + [TAG_KEY, len(key)+2, type, 6] + key
+        send_apdu(reset_oath, INS_PUT, p1=0, p2=0, data=data)
+
+    chal = [0, 0, 0, 0, 0, 0, 0, 1]
+    exp = [TAG_RESPONSE, 21, 6] + list(hmac.digest(bytes(key), bytes(chal), 'sha1'))
+    data = [TAG_NAME, len(names[-1])] + names[-1] + [TAG_CHALLENGE, len(chal)] + chal
+    resp = send_apdu(reset_oath, INS_CALCULATE, p1=0, p2=0, data=data)
+    assert(resp == exp)
+
+    newname = list(bytes(b'renamed'))
+    data = [TAG_NAME, len(names[20])] + names[20] + [TAG_NAME, len(newname)] + newname
+    send_apdu(reset_oath, INS_RENAME, p1=0, p2=0, data=data)
+    data = [TAG_NAME, len(newname)] + newname + [TAG_CHALLENGE, len(chal)] + chal
+    resp = send_apdu(reset_oath, INS_CALCULATE, p1=0, p2=0, data=data)
+    assert(resp == exp)
+    data = [TAG_NAME, len(names[20])] + names[20] + [TAG_CHALLENGE, len(chal)] + chal
+    with pytest.raises(APDUResponse) as e:
+        send_apdu(reset_oath, INS_CALCULATE, p1=0, p2=0, data=data)
+    assert([e.value.sw1, e.value.sw2] == [0x69, 0x84])
+
+    send_apdu(reset_oath, INS_DELETE, p1=0, p2=0, data=[TAG_NAME, len(newname)] + newname)
+    data = [TAG_NAME, len(newname)] + newname + [TAG_CHALLENGE, len(chal)] + chal
+    with pytest.raises(APDUResponse) as e:
+        send_apdu(reset_oath, INS_CALCULATE, p1=0, p2=0, data=data)
+    assert([e.value.sw1, e.value.sw2] == [0x69, 0x84])
+
+def test_calc_all_rekey(reset_oath):
+    name = list(bytes(b'rekey'))
+    chal = [0, 0, 0, 0, 0, 0, 0, 1]
+    for key in [list(bytes(b'first key')), list(bytes(b'second key'))]:
+        data = [TAG_NAME, len(name)] + name + [TAG_KEY, len(key)+2, ALG_SHA1 | TYPE_TOTP, 6] + key
+        send_apdu(reset_oath, INS_PUT, p1=0, p2=0, data=data)
+        exp = [TAG_NAME, len(name)] + name + [TAG_RESPONSE, 21, 6] + list(hmac.digest(bytes(key), bytes(chal), 'sha1'))
+        for _ in range(2):
+            resp = send_apdu(reset_oath, INS_CALC_ALL, p1=0, p2=0, data=[TAG_CHALLENGE, len(chal)] + chal)
+            assert(resp == exp)
+
+def send_chained(card, ins, p1=0, p2=0, data=None):
+    out, pages = [], 1
+    apdu = [0x00, ins, p1, p2] + ([len(data)] + data if data else []) + [0x00]
+    resp, sw1, sw2 = card.connection.transmit(apdu)
+    out += resp
+    while sw1 == RESP_MORE_DATA:
+        resp, sw1, sw2 = card.connection.transmit([0x00, INS_SEND_REMAINING, 0x00, 0x00, 0x00])
+        out += resp
+        pages += 1
+    assert([sw1, sw2] == [0x90, 0x00])
+    return out, pages
+
+def test_send_remaining(reset_oath):
+    key = list(bytes(b'blahonga!'))
+    type = ALG_SHA1 | TYPE_TOTP
+    names = [list(bytes(f'a-rather-long-account-name-{i:03d}', 'ascii')) for i in range(24)]
+    for name in names:
+        data = [TAG_NAME, len(name)] + name + [TAG_KEY, len(key)+2, type, 6] + key
+        send_apdu(reset_oath, INS_PUT, p1=0, p2=0, data=data)
+
+    resp, pages = send_chained(reset_oath, INS_LIST)
+    exp = []
+    for name in names:
+        exp += [TAG_NAME_LIST, len(name)+1, type] + name
+    assert(resp == exp)
+    assert(pages > 1)
+
+    chal = [0, 0, 0, 0, 0, 0, 0, 1]
+    code = list(hmac.digest(bytes(key), bytes(chal), 'sha1'))
+    resp, pages = send_chained(reset_oath, INS_CALC_ALL, data=[TAG_CHALLENGE, len(chal)] + chal)
+    exp = []
+    for name in names:
+        exp += [TAG_NAME, len(name)] + name + [TAG_RESPONSE, 21, 6] + code
+    assert(resp == exp)
+    assert(pages > 1)
+
+def test_beyond_255(reset_oath):
+    key = list(bytes(b'blahonga!'))
+    type = ALG_SHA1 | TYPE_TOTP
+    names = [list(bytes(f'svc{i:04d}', 'ascii')) for i in range(300)]
+    for name in names:
+        data = [TAG_NAME, len(name)] + name + [TAG_KEY, len(key)+2, type, 6] + key
+        send_apdu(reset_oath, INS_PUT, p1=0, p2=0, data=data)
+
+    resp, _ = send_chained(reset_oath, INS_LIST)
+    exp = []
+    for name in names:
+        exp += [TAG_NAME_LIST, len(name)+1, type] + name
+    assert(resp == exp)
+
+    chal = [0, 0, 0, 0, 0, 0, 0, 1]
+    data = [TAG_NAME, len(names[-1])] + names[-1] + [TAG_CHALLENGE, len(chal)] + chal
+    resp = send_apdu(reset_oath, INS_CALCULATE, p1=0, p2=0, data=data)
+    assert(resp == [TAG_RESPONSE, 21, 6] + list(hmac.digest(bytes(key), bytes(chal), 'sha1')))
+
+def send_batch(card, data, chunk=200):
+    while len(data) > chunk:
+        send_apdu(card, [0x10, INS_PUT_BATCH], p1=0, p2=0, data=data[:chunk])
+        data = data[chunk:]
+    return send_apdu(card, INS_PUT_BATCH, p1=0, p2=0, data=data)
+
+def test_put_batch(reset_oath):
+    key = list(bytes(b'blahonga!'))
+    type = ALG_SHA1 | TYPE_TOTP
+    names = [list(bytes(f'import{i:02d}', 'ascii')) for i in range(40)]
+    data = []
+    for name in names:
+        data += [TAG_NAME, len(name)] + name + [TAG_KEY, len(key)+2, type, 6] + key
+    send_batch(reset_oath, data)
+    resp, _ = send_chained(reset_oath, INS_LIST)
+    exp = []
+    for name in names:
+        exp += [TAG_NAME_LIST, len(name)+1, type] + name
+    assert(resp == exp)
+
+    dup = list(bytes(b'dup'))
+    data = [TAG_NAME, len(dup)] + dup + [TAG_KEY, len(key)+2, type, 6] + key
+    with pytest.raises(APDUResponse) as e:
+        send_batch(reset_oath, data + data)
+    assert([e.value.sw1, e.value.sw2] == [0x6A, 0x80])
+    resp, _ = send_chained(reset_oath, INS_LIST)
+    assert(resp == exp)
+
+ALGS = [(ALG_SHA1, 'sha1'), (ALG_SHA256, 'sha256'), (ALG_SHA512, 'sha512')]
+
+def test_select_algorithms(ccid_card):
+    aid = [0xa0, 0x00, 0x00, 0x05, 0x27, 0x21, 0x01, 0x01]
+    resp = send_apdu(ccid_card, 0xA4, 0x04, 0x00, aid)
+    i = resp.index(TAG_ALGO)
+    assert(resp[i+1:i+2+resp[i+1]] == [3, ALG_SHA1, ALG_SHA256, ALG_SHA512])
+
+@pytest.mark.parametrize("alg,digest", ALGS)
+@pytest.mark.parametrize("key_len", [20, 200])
+def test_algorithms(reset_oath, alg, digest, key_len):
+    key = [(i * 7) & 0xff for i in range(key_len)]
+    chal = [0, 0, 0, 0, 0x03, 0x2e, 0x9f, 0x1d]
+    for type in [TYPE_TOTP, TYPE_HOTP]:
+        name = list(bytes(f'{digest}-{type:02x}', 'ascii'))
+        data = [TAG_NAME, len(name)] + name + [TAG_KEY, 0x81, len(key)+2, alg | type, 8] + key
+        send_apdu(reset_oath, INS_PUT, p1=0, p2=0, data=data)
+    name = list(bytes(f'{digest}-{TYPE_TOTP:02x}', 'ascii'))
+    data = [TAG_NAME, len(name)] + name + [TAG_CHALLENGE, len(chal)] + chal
+    resp = send_apdu(reset_oath, INS_CALCULATE, p1=0, p2=0, data=data)
+    mac = list(hmac.digest(bytes(key), bytes(chal), digest))
+    assert(resp == [TAG_RESPONSE, len(mac)+1, 8] + mac)
+
+    name = list(bytes(f'{digest}-{TYPE_HOTP:02x}', 'ascii'))
+    mac = hmac.digest(bytes(key), bytes(8), digest)
+    off = mac[-1] & 0x0f
+    code = (int.from_bytes(mac[off:off+4], 'big') & 0x7fffffff) % 10**8
+    data = [TAG_NAME, len(name)] + name + [TAG_RESPONSE, 4] + list(code.to_bytes(4, 'big'))
+    send_apdu(reset_oath, INS_VERIFY_CODE, p1=0, p2=0, data=data)
+
+@pytest.mark.parametrize("alg,digest", ALGS)
+def test_bench_calculate(reset_oath, alg, digest, record_property):
+    key = list(bytes(b'0123456789abcdef0123'))
+    names = [list(bytes(f'bench{i:02d}', 'ascii')) for i in range(16)]
+    for name in names:
+        data = [TAG_NAME, len(name)] + name + [TAG_KEY, len(key)+2, alg | TYPE_TOTP, 6] + key
+        send_apdu(reset_oath, INS_PUT, p1=0, p2=0, data=data)
+    chal = [0, 0, 0, 0, 0, 0, 0, 1]
+    mac = hmac.digest(bytes(key), bytes(chal), digest)
+    off = mac[-1] & 0x0f
+    code = [TAG_T_RESPONSE, 5, 6] + [mac[off] & 0x7f] + list(mac[off+1:off+4])
+    data = [TAG_NAME, len(names[-1])] + names[-1] + [TAG_CHALLENGE, len(chal)] + chal
+    rounds = 32
+    t = time.perf_counter()
+    for _ in range(rounds):
+        resp = send_apdu(reset_oath, INS_CALCULATE, p1=0, p2=1, data=data)
+        assert(resp == code)
+    calc = (time.perf_counter() - t) / rounds
+    exp = []
+    for name in names:
+        exp += [TAG_NAME, len(name)] + name + code
+    t = time.perf_counter()
+    for _ in range(rounds // 4):
+        resp, _ = send_chained(reset_oath, INS_CALC_ALL, p2=1, data=[TAG_CHALLENGE, len(chal)] + chal)
+        assert(resp == exp)
+    calc_all = (time.perf_counter() - t) / (rounds // 4)
+    record_property(f'calculate_{digest}_ms', round(calc * 1000, 2))
+    record_property(f'calculate_all_{digest}_ms', round(calc_all * 1000, 2))
+
 def test_noauth(reset_oath):
     key = list(bytes(b'kaka blahonga'))
     chal = [1,2,3,4,5,6,7,8]
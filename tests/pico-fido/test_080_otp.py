@@ -0,0 +1,76 @@
+"""
+/*
+ * This file is part of the Pico Fido distribution (https://github.com/polhenarejos/pico-fido).
+ * Copyright (c) 2022 Pol Henarejos.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+"""
+
+import pytest
+import zlib
+from utils import *
+
+INS_OTP = 0x01
+SLOT_CONFIG2 = 0x03
+CFG_CHAL_HMAC = 0x22
+TKT_CHAL_RESP = 0x40
+ACC_CODE = [0] * 6
+CTAP_VENDOR_CRC = 0x0A
+
+def crc16(data):
+    crc = 0xffff
+    for b in data:
+        crc ^= b
+        for _ in range(8):
+            crc = (crc >> 1) ^ (0x8408 if crc & 1 else 0)
+    return crc
+
+@pytest.fixture(scope="class")
+def select_otp(ccid_card):
+    aid = [0xa0, 0x00, 0x00, 0x05, 0x27, 0x20, 0x01, 0x01]
+    send_apdu(ccid_card, 0xA4, 0x04, 0x00, aid)
+    return ccid_card
+
+def otp_config(key):
+    cfg = [0] * 16 + [0] * 6 + key[:16] + ACC_CODE + [0, 0, TKT_CHAL_RESP, CFG_CHAL_HMAC, 0, 0]
+    return cfg + list((~crc16(cfg) & 0xffff).to_bytes(2, 'little'))
+
+def device_crc(device, data):
+    res = device.vendor(CTAP_VENDOR_CRC, 0x01, bytes(data))
+    return res[1], res[2]
+
+def test_crc_golden(device, record_property):
+    assert(device_crc(device, b'123456789') == (0x6f91, 0xcbf43926))
+    assert(device_crc(device, b'') == (0xffff, 0))
+    cfg = otp_config(list(range(20)))
+    assert(device_crc(device, cfg)[0] == 0xf0b8)
+    # Only the CRC_SLICES variant the device was built with is covered; build with
+    # -DCRC_SLICES=1, 4 or 8 to check the others. 33 bytes cover every tail length of each.
+    slices = device.vendor(CTAP_VENDOR_CRC, 0x01, b'')[3]
+    assert(slices in (0, 1, 4, 8))
+    record_property('crc_slices', slices)
+    for n in range(34):
+        data = bytes((i * 37 + n) & 0xff for i in range(n))
+        assert(device_crc(device, data) == (crc16(data), zlib.crc32(data)))
+
+@pytest.mark.parametrize("key_byte", [0x00, 0x5a, 0xff])
+def test_config_crc(select_otp, key_byte):
+    cfg = otp_config([key_byte] * 20)
+    bad = cfg[:-2] + [cfg[-2] ^ 0x01, cfg[-1]]
+    with pytest.raises(APDUResponse) as e:
+        send_apdu(select_otp, INS_OTP, p1=SLOT_CONFIG2, p2=0, data=bad + ACC_CODE)
+    assert([e.value.sw1, e.value.sw2] == [0x6A, 0x80])
+    send_apdu(select_otp, INS_OTP, p1=SLOT_CONFIG2, p2=0, data=cfg + ACC_CODE)
+    # All-zero config deletes the slot again
+    send_apdu(select_otp, INS_OTP, p1=SLOT_CONFIG2, p2=0, data=[0] * 52 + ACC_CODE)
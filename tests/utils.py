@@ -40,6 +40,9 @@ except ModuleNotFoundError:
     print('ERROR: smarctard module not found! Install pyscard package.\nTry with `pip install pyscard`')
     sys.exit(-1)
 
+CTAP_VENDOR_CBOR = 0x41
+CTAP_VENDOR_CLOCK = 0x07
+
 class APDUResponse(Exception):
     def __init__(self, sw1, sw2):
         self.sw1 = sw1
@@ -234,6 +234,7 @@ class Vendor:
         VENDOR_EA        = 0x04
         VENDOR_PHY       = 0x05
         VENDOR_MEMORY    = 0x06
+        VENDOR_ERRORS    = 0x09
 
     @unique
     class PARAM(IntEnum):
@@ -481,7 +482,20 @@ class Vendor:
                 Vendor.CMD.VENDOR_MEMORY,
                 Vendor.SUBCMD.ENABLE,
             )
-        return { 'free': resp[1], 'used': resp[2], 'total': resp[3], 'files': resp[4], 'size': resp[5] }
+        return { 'free': resp[1], 'used': resp[2], 'total': resp[3], 'files': resp[4], 'size': resp[5], 'arena': resp.get(6), 'arena_size': resp.get(7) }
+
+    def errors(self, clear=False):
+        if (clear):
+            self._call(
+                Vendor.CMD.VENDOR_ERRORS,
+                Vendor.SUBCMD.DISABLE,
+            )
+            return None
+        resp = self._call(
+                Vendor.CMD.VENDOR_ERRORS,
+                Vendor.SUBCMD.ENABLE,
+            )
+        return { 'count': resp[1], 'events': resp[2] }
 
 def parse_args():
     parser = argparse.ArgumentParser()
@@ -513,6 +527,9 @@ def parse_args():
 
     parser_mem = subparser.add_parser('memory', help='Get current memory usage.')
 
+    parser_err = subparser.add_parser('errors', help='Get the last CTAP errors recorded by the device.')
+    parser_err.add_argument('--clear', action='store_true', help='Clears the error log.')
+
     args = parser.parse_args()
     return args
 
@@ -578,6 +595,21 @@ def memory(vdr, args):
     print(f'\tTotal: {mem["total"]/1024:.2f} kilobytes')
     print(f'\tFlash size: {mem["size"]/1024:.2f} kilobytes')
     print(f'\tFiles: {mem["files"]}')
+    if (mem['arena'] is not None):
+        print(f'\tRequest arena peak: {mem["arena"]} of {mem["arena_size"]} bytes')
+
+def errors(vdr, args):
+    if (args.clear):
+        vdr.errors(clear=True)
+        print('Error log cleared')
+        return
+    err = vdr.errors()
+    kinds = ['check', 'error', 'assert']
+    files = ['?', 'cbor.c', 'cbor_client_pin.c', 'cbor_config.c', 'cbor_cred_mgmt.c', 'cbor_get_assertion.c', 'cbor_get_info.c',
+             'cbor_large_blobs.c', 'cbor_make_credential.c', 'cbor_schema.c', 'cbor_vendor.c', 'credential.c']
+    print(f'Errors recorded: {err["count"]}')
+    for code, handler, site, kind in err['events']:
+        print(f'\tcmd 0x{handler:02X} {files[site >> 12] if site >> 12 < len(files) else site >> 12}:{site & 0xfff}: {kinds[kind] if kind < len(kinds) else kind} {code} (0x{code & 0xffffffff:X})')
 
 def main(args):
     print('Pico Fido Tool v1.10')
@@ -602,6 +634,8 @@ def main(args):
         phy(vdr, args)
     elif (args.command == 'memory'):
         memory(vdr, args)
+    elif (args.command == 'errors'):
+        errors(vdr, args)
 
 def run():
     args = parse_args()